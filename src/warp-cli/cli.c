@@ -12,6 +12,22 @@
 #include <stdio.h>
 #include <string.h>
 
+// What to do around running a script, on top of the VM's configuration.
+typedef struct {
+    const char  *image;         // Image the VM starts from, if any.
+    const char  *save_image;    // Where to save the VM once the script has run, if anywhere.
+    bool        cache_stats;
+} run_opts_t;
+
+static warp_vm_t *new_vm(const warp_cfg_t *cfg, const run_opts_t *opts) {
+    warp_vm_t *vm = warp_vm_new(cfg);
+    if(opts->image && warp_load_image(vm, opts->image) != WARP_OK) {
+        warp_vm_destroy(vm);
+        exit(66);
+    }
+    return vm;
+}
+
 static void repl_prompt(const char* PS) {
     term_set_fg(stdout, TERM_BLUE);
     printf("%s> ", PS);
@@ -27,8 +43,8 @@ static const char* history_path() {
     return path;
 }
 
-static void repl() {
-    warp_vm_t *vm = warp_vm_new(&(warp_cfg_t){.allocator = NULL});
+static void repl(const warp_cfg_t *cfg, const run_opts_t *opts) {
+    warp_vm_t *vm = new_vm(cfg, opts);
     
     // Set up our fancy line editor
     UNUSED(repl_prompt);
@@ -60,40 +76,143 @@ static void repl() {
     warp_vm_destroy(vm);
 }
 
-static void run_file(const char *path) {
+static char *read_file(const char *path, size_t *length) {
     FILE *f = fopen(path, "rb");
     if(!f) {
         fprintf(stderr, "could not open script file '%s'\n", path);
-        return;
+        return NULL;
     }
     
-    size_t length = 0;
-    char *source = NULL;
-    
     fseek(f, 0, SEEK_END);
-    length = ftell(f);
+    *length = ftell(f);
     fseek(f, 0, SEEK_SET);
     
-    source = malloc(length + 1);
-    fread(source, 1, length, f);
-    source[length] = '\0';
+    char *source = malloc(*length + 1);
+    fread(source, 1, *length, f);
+    source[*length] = '\0';
     fclose(f);
+    return source;
+}
+
+static bool is_bytecode(const char *path) {
+    const char *ext = strrchr(path, '.');
+    return ext && !strcmp(ext, ".warpc");
+}
+
+static void print_cache_stats(warp_vm_t *vm) {
+    warp_cache_stats_t stats;
+    warp_get_cache_stats(vm, &stats);
+    uint32_t total = stats.hits + stats.misses;
+    fprintf(stderr, "cache: %u hits, %u misses (%.1f%% hit rate), %u writes, %u evictions\n",
+            stats.hits, stats.misses, total ? 100.0 * stats.hits / total : 0.0,
+            stats.writes, stats.evictions);
+}
+
+static void run_file(const warp_cfg_t *cfg, const char *path, const run_opts_t *opts) {
+    warp_vm_t *vm = new_vm(cfg, opts);
+    warp_result_t result = WARP_IO_ERROR;
+    char *source = NULL;
+    if(is_bytecode(path)) {
+        result = warp_run_file(vm, path);
+    } else {
+        size_t length = 0;
+        source = read_file(path, &length);
+        if(source) result = warp_interpret(vm, path, source, length);
+        if(opts->cache_stats) print_cache_stats(vm);
+    }
+    
+    if(result == WARP_OK && opts->save_image) warp_save_image(vm, opts->save_image);
+    warp_vm_destroy(vm);
+    free(source);
+}
+
+static int compile_file(const warp_cfg_t *cfg, const char *path, const char *out_path) {
+    size_t length = 0;
+    char *source = read_file(path, &length);
+    if(!source) return 66;
     
-    warp_vm_t *vm = warp_vm_new(&(warp_cfg_t){.allocator = NULL});
-    warp_interpret(vm, path, source, length);
+    warp_vm_t *vm = warp_vm_new(cfg);
+    warp_result_t result = warp_compile_file(vm, path, source, length, out_path);
     warp_vm_destroy(vm);
+    free(source);
+    return result == WARP_OK ? 0 : 65;
+}
+
+static int check_file(const warp_cfg_t *cfg, const char *path) {
+    size_t length = 0;
+    char *source = read_file(path, &length);
+    if(!source) return 66;
     
+    warp_vm_t *vm = warp_vm_new(cfg);
+    warp_result_t result = warp_check(vm, path, source, length);
+    warp_vm_destroy(vm);
     free(source);
+    return result == WARP_OK ? 0 : 65;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: warp [-O0|-O1|-O2] [--lazy] [-C cache_dir [--cache-stats]] [-i image] [path]\n");
+    fprintf(stderr, "       warp [-O0|-O1|-O2] [--lazy] [-i image] -s out.warpi path\n");
+    fprintf(stderr, "       warp [-O0|-O1|-O2] -o out.warpc path\n");
+    fprintf(stderr, "       warp --check path\n");
+    fprintf(stderr, "Scripts are compiled with -O2 unless told otherwise.\n");
+    fprintf(stderr, "Paths ending in .warpc are run as precompiled bytecode. The cache directory\n");
+    fprintf(stderr, "defaults to $WARP_CACHE_DIR. With -s, the VM is saved to an image once the\n");
+    fprintf(stderr, "script has run, which -i starts new VMs from. With --lazy, functions are compiled\n");
+    fprintf(stderr, "when first called; --check reports errors in all of them without running.\n");
+    exit(64);
 }
 
 int main(int argc, const char **argv) {
-    if(argc == 1) {
-        repl();
-    } else if(argc == 2) {
-        run_file(argv[1]);
+    warp_cfg_t cfg = {.allocator = NULL};
+    cfg.compiler.level = WARP_OPT_FULL;
+    cfg.compiler.cache_dir = getenv("WARP_CACHE_DIR");
+    const char *out_path = NULL;
+    bool check_only = false;
+    run_opts_t opts = {.image = NULL};
+    
+    int arg = 1;
+    for(; arg < argc && argv[arg][0] == '-'; ++arg) {
+        if(!strcmp(argv[arg], "-O0")) {
+            cfg.compiler.level = WARP_OPT_NONE;
+        } else if(!strcmp(argv[arg], "-O1")) {
+            cfg.compiler.level = WARP_OPT_BASIC;
+        } else if(!strcmp(argv[arg], "-O2")) {
+            cfg.compiler.level = WARP_OPT_FULL;
+        } else if(!strcmp(argv[arg], "-o") && arg + 1 < argc) {
+            out_path = argv[++arg];
+        } else if(!strcmp(argv[arg], "-C") && arg + 1 < argc) {
+            cfg.compiler.cache_dir = argv[++arg];
+        } else if(!strcmp(argv[arg], "--cache-stats")) {
+            opts.cache_stats = true;
+        } else if(!strcmp(argv[arg], "--lazy")) {
+            cfg.compiler.lazy = true;
+        } else if(!strcmp(argv[arg], "--check")) {
+            check_only = true;
+        } else if(!strcmp(argv[arg], "-i") && arg + 1 < argc) {
+            opts.image = argv[++arg];
+        } else if(!strcmp(argv[arg], "-s") && arg + 1 < argc) {
+            opts.save_image = argv[++arg];
+        } else {
+            usage();
+        }
+    }
+    
+    if(out_path) {
+        if(arg + 1 != argc) usage();
+        return compile_file(&cfg, argv[arg], out_path);
+    }
+    if(check_only) {
+        if(arg + 1 != argc) usage();
+        return check_file(&cfg, argv[arg]);
+    }
+    
+    if(arg == argc && !opts.save_image) {
+        repl(&cfg, &opts);
+    } else if(arg + 1 == argc) {
+        run_file(&cfg, argv[arg], &opts);
     } else {
-        fprintf(stderr, "Usage: warp [path]\n");
-        exit(64);
+        usage();
     }
 }
 
@@ -0,0 +1,787 @@
+//===--------------------------------------------------------------------------------------------===
+// bytecode.c - Compiled functions saved to, and loaded from, .warpc files
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#define _DEFAULT_SOURCE
+#include "bytecode.h"
+#include "compiler.h"
+#include "value_impl.h"
+#include <warp/instr.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define WARP_MMAP 1
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #define WARP_MMAP 0
+#endif
+
+#define WARP_OP(code, op_size, _) [OP_##code] = op_size+1,
+static const int code_size[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+#define OP_COUNT ((int)(sizeof(code_size) / sizeof(code_size[0])))
+
+// Line tables are used straight from the file.
+_Static_assert(sizeof(line_run_t) == 2 * sizeof(uint32_t), "line runs must be two 32-bit integers");
+
+static const char magic[4] = {'W', 'R', 'P', 'C'};
+static const char image_magic[4] = {'W', 'R', 'P', 'I'};
+static const uint32_t byte_order = 0x01020304;
+
+typedef enum {
+    CONST_NIL,
+    CONST_TRUE,
+    CONST_FALSE,
+    CONST_INT,
+    CONST_NUM,
+    CONST_STR,
+    CONST_FN,
+    CONST_NATIVE,
+} const_kind_t;
+
+static inline int read_16(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static inline bool refers_to_global(uint8_t op) {
+    return op == OP_DEF_GLOB || op == OP_GET_GLOB || op == OP_SET_GLOB || op == OP_POP_GLOB;
+}
+
+// MARK: - Writing
+
+typedef struct {
+    warp_vm_t       *vm;
+    u8_buf_t        *out;
+    warp_map_t      *string_ids;
+    val_buf_t       strings;
+    val_buf_t       fns;
+    val_buf_t       natives;
+} writer_t;
+
+static void write_bytes(writer_t *w, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < size; ++i) {
+        u8_buf_write(w->vm, w->out, bytes[i]);
+    }
+}
+
+static void write_u32(writer_t *w, uint32_t value) {
+    write_bytes(w, &value, sizeof(value));
+}
+
+static void write_padding(writer_t *w) {
+    while(w->out->count % 4) u8_buf_write(w->vm, w->out, 0);
+}
+
+static uint32_t string_id(writer_t *w, warp_str_t *str) {
+    warp_value_t id;
+    if(warp_map_get(w->string_ids, WARP_OBJ_VAL(str), &id)) return (uint32_t)WARP_AS_NUM(id);
+
+    uint32_t idx = w->strings.count;
+    warp_map_set(w->vm, w->string_ids, WARP_OBJ_VAL(str), WARP_NUM_VAL(idx));
+    val_buf_write(w->vm, &w->strings, WARP_OBJ_VAL(str));
+    return idx;
+}
+
+static uint32_t fn_id(writer_t *w, const warp_fn_t *fn) {
+    for(int i = 0; i < w->fns.count; ++i) {
+        if(WARP_AS_OBJ(w->fns.data[i]) == &fn->obj) return i;
+    }
+    val_buf_write(w->vm, &w->fns, WARP_OBJ_VAL(fn));
+    return w->fns.count - 1;
+}
+
+static uint32_t native_id(writer_t *w, const warp_native_t *native) {
+    for(int i = 0; i < w->natives.count; ++i) {
+        if(WARP_AS_OBJ(w->natives.data[i]) == &native->obj) return i;
+    }
+    string_id(w, native->name);
+    val_buf_write(w->vm, &w->natives, WARP_OBJ_VAL(native));
+    return w->natives.count - 1;
+}
+
+static bool collect_value(writer_t *w, warp_value_t value) {
+    if(WARP_IS_STR(value)) {
+        string_id(w, WARP_AS_STR(value));
+    } else if(WARP_IS_FN(value)) {
+        fn_id(w, WARP_AS_FN(value));
+    } else if(WARP_IS_NATIVE(value)) {
+        native_id(w, WARP_AS_NATIVE(value));
+    } else if(!WARP_IS_NUM(value) && !WARP_IS_BOOL(value) && !WARP_IS_NIL(value)) {
+        return false;
+    }
+    return true;
+}
+
+// Gives every string, native and function the file refers to an index, before any of them is
+// written. The roots (the saved function, or the globals' values) must have been collected first.
+static bool collect(writer_t *w) {
+    for(int i = 0; i < w->vm->globals.count; ++i) {
+        string_id(w, w->vm->globals.data[i].name);
+    }
+
+    // Functions found along the way are added at the end, so this reaches all of them. Files only
+    // hold bytecode, so bodies that haven't been compiled yet are compiled now.
+    for(int i = 0; i < w->fns.count; ++i) {
+        warp_fn_t *current = WARP_AS_FN(w->fns.data[i]);
+        if(current->lazy && !compile_body(w->vm, current)) return false;
+        if(current->name) string_id(w, current->name);
+        for(int j = 0; j < current->chunk.inlined.count; ++j) {
+            warp_str_t *name = current->chunk.inlined.data[j].name;
+            if(name) string_id(w, name);
+        }
+
+        const val_buf_t *constants = &current->chunk.constants;
+        for(int c = 0; c < constants->count; ++c) {
+            if(!collect_value(w, constants->data[c])) return false;
+        }
+    }
+    return true;
+}
+
+static void write_const(writer_t *w, warp_value_t value) {
+    uint32_t payload[2] = {0, 0};
+    const_kind_t kind = CONST_NIL;
+
+    if(WARP_IS_INT(value)) {
+        kind = CONST_INT;
+        payload[0] = (uint32_t)WARP_AS_INT(value);
+    } else if(WARP_IS_NUM(value)) {
+        kind = CONST_NUM;
+        double num = WARP_AS_NUM(value);
+        memcpy(payload, &num, sizeof(num));
+    } else if(WARP_IS_BOOL(value)) {
+        kind = WARP_AS_BOOL(value) ? CONST_TRUE : CONST_FALSE;
+    } else if(WARP_IS_STR(value)) {
+        kind = CONST_STR;
+        payload[0] = string_id(w, WARP_AS_STR(value));
+    } else if(WARP_IS_FN(value)) {
+        kind = CONST_FN;
+        payload[0] = fn_id(w, WARP_AS_FN(value));
+    } else if(WARP_IS_NATIVE(value)) {
+        kind = CONST_NATIVE;
+        payload[0] = native_id(w, WARP_AS_NATIVE(value));
+    }
+
+    write_u32(w, kind);
+    write_u32(w, payload[0]);
+    write_u32(w, payload[1]);
+}
+
+static void write_fn(writer_t *w, const warp_fn_t *fn) {
+    const chunk_t *chunk = &fn->chunk;
+    int runs = chunk->lines.count;
+    while(runs > 0 && chunk->lines.data[runs - 1].offset >= chunk->count) runs -= 1;
+    
+    write_u32(w, fn->name ? string_id(w, fn->name) + 1 : 0);
+    write_u32(w, fn->arity);
+    write_u32(w, fn->max_slots);
+    write_u32(w, chunk->count);
+    write_u32(w, chunk->constants.count);
+    write_u32(w, chunk->caches.count);
+    write_u32(w, chunk->loops.count);
+    write_u32(w, runs);
+    write_u32(w, chunk->inlined.count);
+
+    for(int i = 0; i < chunk->constants.count; ++i) {
+        write_const(w, chunk->constants.data[i]);
+    }
+    for(int i = 0; i < chunk->caches.count; ++i) {
+        write_u32(w, chunk->caches.data[i].global);
+    }
+
+    write_bytes(w, chunk->code, chunk->count);
+    write_padding(w);
+    for(int i = 0; i < runs; ++i) {
+        write_u32(w, (uint32_t)chunk->lines.data[i].offset);
+        write_u32(w, (uint32_t)chunk->lines.data[i].line);
+    }
+    for(int i = 0; i < chunk->inlined.count; ++i) {
+        const inlined_t *site = &chunk->inlined.data[i];
+        write_u32(w, (uint32_t)site->line);
+        write_u32(w, (uint32_t)site->caller);
+        write_u32(w, site->name ? string_id(w, site->name) + 1 : 0);
+    }
+}
+
+static void write_sections(writer_t *w, const char *file_magic) {
+    warp_vm_t *vm = w->vm;
+    write_bytes(w, file_magic, sizeof(magic));
+    write_u32(w, byte_order);
+    write_u32(w, WARP_BYTECODE_VERSION);
+    write_u32(w, OP_COUNT);
+    write_u32(w, w->strings.count);
+    write_u32(w, vm->globals.count);
+    write_u32(w, w->natives.count);
+    write_u32(w, w->fns.count);
+
+    for(int i = 0; i < w->strings.count; ++i) {
+        const warp_str_t *str = WARP_AS_STR(w->strings.data[i]);
+        write_u32(w, str->length);
+        write_bytes(w, str->data, str->length);
+        write_padding(w);
+    }
+    for(int i = 0; i < vm->globals.count; ++i) {
+        write_u32(w, string_id(w, vm->globals.data[i].name));
+    }
+    for(int i = 0; i < w->natives.count; ++i) {
+        const warp_native_t *native = WARP_AS_NATIVE(w->natives.data[i]);
+        write_u32(w, string_id(w, native->name));
+        write_u32(w, native->arity);
+    }
+    for(int i = 0; i < w->fns.count; ++i) {
+        write_fn(w, WARP_AS_FN(w->fns.data[i]));
+    }
+}
+
+static void writer_init(writer_t *w, warp_vm_t *vm, u8_buf_t *out) {
+    *w = (writer_t){.vm=vm, .out=out, .string_ids=warp_map_new(vm)};
+    val_buf_init(&w->strings);
+    val_buf_init(&w->fns);
+    val_buf_init(&w->natives);
+}
+
+static void writer_fini(writer_t *w) {
+    val_buf_fini(w->vm, &w->strings);
+    val_buf_fini(w->vm, &w->fns);
+    val_buf_fini(w->vm, &w->natives);
+    warp_map_free(w->vm, w->string_ids);
+}
+
+bool bytecode_write(warp_vm_t *vm, const warp_fn_t *fn, u8_buf_t *out) {
+    ASSERT(vm);
+    ASSERT(fn);
+    ASSERT(out);
+
+    writer_t w;
+    writer_init(&w, vm, out);
+    fn_id(&w, fn);
+    bool ok = collect(&w);
+    if(ok) write_sections(&w, magic);
+    writer_fini(&w);
+    return ok;
+}
+
+bool bytecode_write_image(warp_vm_t *vm, u8_buf_t *out) {
+    ASSERT(vm);
+    ASSERT(out);
+
+    writer_t w;
+    writer_init(&w, vm, out);
+    bool ok = true;
+    for(int i = 0; i < vm->globals.count && ok; ++i) {
+        const global_t *global = &vm->globals.data[i];
+        ok = collect_value(&w, global->value);
+        if(global->inline_fn) fn_id(&w, global->inline_fn);
+    }
+    ok = ok && collect(&w);
+    if(ok) {
+        write_sections(&w, image_magic);
+        for(int i = 0; i < vm->globals.count; ++i) {
+            const global_t *global = &vm->globals.data[i];
+            write_u32(&w, global->defined);
+            write_const(&w, global->value);
+            write_u32(&w, global->inline_fn ? fn_id(&w, global->inline_fn) + 1 : 0);
+        }
+    }
+    writer_fini(&w);
+    return ok;
+}
+
+static bool write_file(const u8_buf_t *data, const char *path) {
+    FILE *f = fopen(path, "wb");
+    bool ok = f && fwrite(data->data, 1, data->count, f) == (size_t)data->count;
+    if(f && fclose(f) != 0) ok = false;
+    if(!ok) fprintf(stderr, "error: could not write '%s'\n", path);
+    return ok;
+}
+
+bool bytecode_save(warp_vm_t *vm, const warp_fn_t *fn, const char *path) {
+    ASSERT(vm);
+    ASSERT(fn);
+    ASSERT(path);
+
+    u8_buf_t data;
+    u8_buf_init(&data);
+    bool ok = bytecode_write(vm, fn, &data);
+    if(!ok) fprintf(stderr, "error: could not write '%s': unsupported constant\n", path);
+    ok = ok && write_file(&data, path);
+    u8_buf_fini(vm, &data);
+    return ok;
+}
+
+bool bytecode_save_image(warp_vm_t *vm, const char *path) {
+    ASSERT(vm);
+    ASSERT(path);
+
+    u8_buf_t data;
+    u8_buf_init(&data);
+    bool ok = bytecode_write_image(vm, &data);
+    if(!ok) fprintf(stderr, "error: could not write '%s': unsupported global value\n", path);
+    ok = ok && write_file(&data, path);
+    u8_buf_fini(vm, &data);
+    return ok;
+}
+
+// MARK: - Reading
+
+typedef struct {
+    warp_vm_t       *vm;
+    uint8_t         *data;
+    size_t          size;
+    size_t          pos;
+    const char      *error;
+
+    warp_str_t      **strings;
+    uint32_t        string_count;
+    int             *globals;       // The VM's slot for each global in the file.
+    uint32_t        global_count;
+    warp_native_t   **natives;
+    uint32_t        native_count;
+    warp_fn_t       **fns;
+    uint32_t        fn_count;
+} reader_t;
+
+static bool fail(reader_t *r, const char *error) {
+    if(!r->error) r->error = error;
+    return false;
+}
+
+static uint8_t *read_bytes(reader_t *r, size_t size) {
+    if(r->error) return NULL;
+    if(size > r->size - r->pos) {
+        fail(r, "file is truncated");
+        return NULL;
+    }
+    uint8_t *bytes = r->data + r->pos;
+    r->pos += size;
+    return bytes;
+}
+
+static uint32_t read_u32(reader_t *r) {
+    uint32_t value = 0;
+    const uint8_t *bytes = read_bytes(r, sizeof(value));
+    if(bytes) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static void skip_padding(reader_t *r) {
+    read_bytes(r, (4 - r->pos % 4) % 4);
+}
+
+static bool read_header(reader_t *r, const char *expected) {
+    const uint8_t *file_magic = read_bytes(r, sizeof(magic));
+    if(!file_magic || memcmp(file_magic, expected, sizeof(magic))) {
+        return fail(r, expected == magic ? "not a bytecode file" : "not an image file");
+    }
+    if(read_u32(r) != byte_order) return fail(r, "compiled for another architecture");
+    if(read_u32(r) != WARP_BYTECODE_VERSION) return fail(r, "compiled by another version of Warp");
+    if(read_u32(r) != OP_COUNT) return fail(r, "compiled by another version of Warp");
+
+    r->string_count = read_u32(r);
+    r->global_count = read_u32(r);
+    r->native_count = read_u32(r);
+    r->fn_count = read_u32(r);
+    if(r->error) return false;
+    // Each of those takes up at least four bytes, which keeps bogus counts from allocating much.
+    size_t left = r->size - r->pos;
+    if(r->string_count > left / 4 || r->global_count > left / 4 || r->native_count > left / 4
+       || r->fn_count > left / 4) {
+        return fail(r, "file is truncated");
+    }
+    if(expected == magic && r->fn_count == 0) return fail(r, "file has no functions");
+    return true;
+}
+
+static bool read_strings(reader_t *r) {
+    r->strings = ALLOCATE_ARRAY(r->vm, warp_str_t *, r->string_count);
+    for(uint32_t i = 0; i < r->string_count; ++i) {
+        uint32_t length = read_u32(r);
+        const uint8_t *data = read_bytes(r, length);
+        skip_padding(r);
+        if(!data || length > INT32_MAX) return fail(r, "file is truncated");
+        r->strings[i] = warp_copy_c_str(r->vm, (const char *)data, (int)length);
+    }
+    return true;
+}
+
+static bool read_globals(reader_t *r) {
+    r->globals = ALLOCATE_ARRAY(r->vm, int, r->global_count);
+    for(uint32_t i = 0; i < r->global_count; ++i) {
+        uint32_t name = read_u32(r);
+        if(r->error) return false;
+        if(name >= r->string_count) return fail(r, "invalid global name");
+        r->globals[i] = vm_global_slot(r->vm, r->strings[name]);
+        if(r->globals[i] > UINT16_MAX) return fail(r, "too many globals");
+    }
+    return true;
+}
+
+// Natives can't be saved, so they are looked up by name among the ones registered with the VM
+// reading the file, which must take the same number of arguments.
+static warp_native_t *find_native(warp_vm_t *vm, const warp_str_t *name) {
+    for(int i = 0; i < vm->globals.count; ++i) {
+        warp_value_t value = vm->globals.data[i].value;
+        if(WARP_IS_NATIVE(value) && WARP_AS_NATIVE(value)->name == name) return WARP_AS_NATIVE(value);
+    }
+    return NULL;
+}
+
+static bool read_natives(reader_t *r) {
+    r->natives = ALLOCATE_ARRAY(r->vm, warp_native_t *, r->native_count);
+    for(uint32_t i = 0; i < r->native_count; ++i) {
+        uint32_t name = read_u32(r);
+        uint32_t arity = read_u32(r);
+        if(r->error) return false;
+        if(name >= r->string_count) return fail(r, "invalid native name");
+
+        r->natives[i] = find_native(r->vm, r->strings[name]);
+        if(!r->natives[i]) return fail(r, "native function is not registered");
+        if(r->natives[i]->arity != arity) return fail(r, "native function has a different arity");
+    }
+    return true;
+}
+
+static bool read_const(reader_t *r, warp_value_t *out) {
+    uint32_t kind = read_u32(r);
+    uint32_t payload[2] = {read_u32(r), read_u32(r)};
+    if(r->error) return false;
+
+    switch(kind) {
+    case CONST_NIL: *out = WARP_NIL_VAL; return true;
+    case CONST_TRUE: *out = WARP_BOOL_VAL(true); return true;
+    case CONST_FALSE: *out = WARP_BOOL_VAL(false); return true;
+    case CONST_INT: *out = WARP_INT_VAL((warp_int_t)payload[0]); return true;
+    case CONST_NUM: {
+        double num = 0;
+        memcpy(&num, payload, sizeof(num));
+        *out = WARP_NUM_VAL(num);
+        return true;
+    }
+    case CONST_STR:
+        if(payload[0] >= r->string_count) return fail(r, "invalid string constant");
+        *out = WARP_OBJ_VAL(r->strings[payload[0]]);
+        return true;
+    case CONST_FN:
+        if(payload[0] >= r->fn_count) return fail(r, "invalid function constant");
+        *out = WARP_OBJ_VAL(r->fns[payload[0]]);
+        return true;
+    case CONST_NATIVE:
+        if(payload[0] >= r->native_count) return fail(r, "invalid native constant");
+        *out = WARP_OBJ_VAL(r->natives[payload[0]]);
+        return true;
+    default:
+        return fail(r, "invalid constant");
+    }
+}
+
+// Points global operands at the slots the globals have in this VM, which can be different from the
+// ones they had in the VM that compiled the code. Everything else is left to verify_fn().
+static bool link_globals(reader_t *r, uint8_t *code, int count) {
+    for(int i = 0; i < count;) {
+        uint8_t op = code[i];
+        if(op >= OP_COUNT || code_size[op] > count - i) return fail(r, "invalid instruction");
+
+        if(refers_to_global(op)) {
+            int idx = read_16(code + i + 1);
+            if((uint32_t)idx >= r->global_count) return fail(r, "invalid global");
+            int slot = r->globals[idx];
+            if(slot != idx) {
+                code[i + 1] = slot & 0xff;
+                code[i + 2] = (slot >> 8) & 0xff;
+            }
+        }
+        i += code_size[op];
+    }
+    return true;
+}
+
+static bool read_fn(reader_t *r, warp_fn_t *fn) {
+    uint32_t name = read_u32(r);
+    uint32_t arity = read_u32(r);
+    uint32_t max_slots = read_u32(r);
+    uint32_t count = read_u32(r);
+    uint32_t const_count = read_u32(r);
+    uint32_t cache_count = read_u32(r);
+    uint32_t loop_count = read_u32(r);
+    uint32_t run_count = read_u32(r);
+    uint32_t inlined_count = read_u32(r);
+    if(r->error) return false;
+
+    if(name > r->string_count) return fail(r, "invalid function name");
+    if(arity > UINT8_MAX) return fail(r, "invalid arity");
+    if(count > INT32_MAX || const_count > UINT16_MAX + 1 || cache_count > UINT16_MAX + 1
+       || loop_count > UINT16_MAX + 1) {
+        return fail(r, "function is too large");
+    }
+    // Runs are at least one byte long, and there is one from the start of the code if there is any.
+    if(run_count > count || (count > 0 && run_count == 0)) return fail(r, "invalid line table");
+    if(inlined_count > (r->size - r->pos) / (3 * sizeof(uint32_t))) {
+        return fail(r, "file is truncated");
+    }
+
+    fn->name = name ? r->strings[name - 1] : NULL;
+    fn->arity = (uint8_t)arity;
+    fn->max_slots = max_slots;
+
+    chunk_t *chunk = &fn->chunk;
+    for(uint32_t i = 0; i < const_count; ++i) {
+        warp_value_t value;
+        if(!read_const(r, &value)) return false;
+        val_buf_write(r->vm, &chunk->constants, value);
+    }
+    for(uint32_t i = 0; i < cache_count; ++i) {
+        uint32_t global = read_u32(r);
+        if(r->error) return false;
+        if(global >= r->global_count) return fail(r, "invalid global");
+        chunk_add_cache(r->vm, chunk, (uint16_t)r->globals[global]);
+    }
+    for(uint32_t i = 0; i < loop_count; ++i) {
+        chunk_add_loop(r->vm, chunk);
+    }
+
+    uint8_t *code = read_bytes(r, count);
+    skip_padding(r);
+    line_run_t *runs = (line_run_t *)read_bytes(r, (size_t)run_count * sizeof(line_run_t));
+    if(!code || !runs) return false;
+    if(!link_globals(r, code, count)) return false;
+    for(uint32_t i = 0; i < run_count; ++i) {
+        int32_t offset = runs[i].offset;
+        bool ordered = i == 0 ? offset == 0 : offset > runs[i - 1].offset;
+        if(!ordered || offset >= (int32_t)count) return fail(r, "invalid line table");
+        if(runs[i].line < -(int32_t)inlined_count) return fail(r, "invalid line table");
+    }
+    // Inlined calls only ever refer to the ones before them, so following callers always ends.
+    for(uint32_t i = 0; i < inlined_count; ++i) {
+        int32_t line = (int32_t)read_u32(r);
+        int32_t caller = (int32_t)read_u32(r);
+        uint32_t site_name = read_u32(r);
+        if(r->error) return false;
+        if(line < 0 || caller < -(int32_t)i || site_name > r->string_count) {
+            return fail(r, "invalid line table");
+        }
+        inlined_buf_write(r->vm, &chunk->inlined, (inlined_t){
+            .line=line,
+            .caller=caller,
+            .name=site_name ? r->strings[site_name - 1] : NULL,
+        });
+    }
+
+    chunk->code = code;
+    chunk->lines = (line_buf_t){.data=runs, .count=run_count, .capacity=run_count};
+    chunk->count = chunk->capacity = count;
+    chunk->borrowed = true;
+    return true;
+}
+
+// Reads everything up to and including the functions, which end up in `r->fns`.
+static bool read_sections(reader_t *r, const char *expected) {
+    if(!read_header(r, expected) || !read_strings(r) || !read_globals(r) || !read_natives(r)) {
+        return false;
+    }
+
+    // Functions can refer to each other in any order, so they all exist before any is read.
+    r->fns = ALLOCATE_ARRAY(r->vm, warp_fn_t *, r->fn_count);
+    for(uint32_t i = 0; i < r->fn_count; ++i) {
+        r->fns[i] = warp_fn_new(r->vm, WARP_FN_BYTECODE);
+    }
+    for(uint32_t i = 0; i < r->fn_count; ++i) {
+        if(!read_fn(r, r->fns[i])) return false;
+    }
+    return true;
+}
+
+static void reader_fini(reader_t *r) {
+    warp_vm_t *vm = r->vm;
+    if(r->strings) FREE_ARRAY(vm, r->strings, warp_str_t *, r->string_count);
+    if(r->globals) FREE_ARRAY(vm, r->globals, int, r->global_count);
+    if(r->natives) FREE_ARRAY(vm, r->natives, warp_native_t *, r->native_count);
+    if(r->fns) FREE_ARRAY(vm, r->fns, warp_fn_t *, r->fn_count);
+}
+
+warp_fn_t *bytecode_read(warp_vm_t *vm, uint8_t *data, size_t size, const char **error) {
+    ASSERT(vm);
+    ASSERT(data);
+    ASSERT(error);
+
+    reader_t r = {.vm=vm, .data=data, .size=size};
+    warp_fn_t *fn = read_sections(&r, magic) ? r.fns[0] : NULL;
+    *error = r.error;
+    reader_fini(&r);
+    return fn;
+}
+
+// Values are all read before any global is set, so that a bad file leaves the globals alone.
+static bool read_values(reader_t *r) {
+    warp_vm_t *vm = r->vm;
+    global_t *values = ALLOCATE_ARRAY(vm, global_t, r->global_count);
+    for(uint32_t i = 0; i < r->global_count && !r->error; ++i) {
+        uint32_t defined = read_u32(r);
+        read_const(r, &values[i].value);
+        uint32_t inline_fn = read_u32(r);
+        if(r->error) break;
+        if(defined > 1 || inline_fn > r->fn_count) {
+            fail(r, "invalid global");
+            break;
+        }
+        values[i].defined = defined;
+        values[i].inline_fn = inline_fn ? r->fns[inline_fn - 1] : NULL;
+    }
+
+    for(uint32_t i = 0; i < r->global_count && !r->error; ++i) {
+        global_t *global = &vm->globals.data[r->globals[i]];
+        global->value = values[i].value;
+        global->defined = values[i].defined;
+        global->inline_fn = values[i].inline_fn;
+        global->version += 1;
+    }
+    FREE_ARRAY(vm, values, global_t, r->global_count);
+    return !r->error;
+}
+
+bool bytecode_read_image(warp_vm_t *vm, uint8_t *data, size_t size, const char **error) {
+    ASSERT(vm);
+    ASSERT(data);
+    ASSERT(error);
+
+    reader_t r = {.vm=vm, .data=data, .size=size};
+    bool ok = read_sections(&r, image_magic) && read_values(&r);
+    *error = r.error;
+    reader_fini(&r);
+    return ok;
+}
+
+// MARK: - Files
+
+static bytecode_file_t *open_file(warp_vm_t *vm, const char *path) {
+#if WARP_MMAP
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat info;
+    void *data = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+        // The mapping is private and writable: linking globals and quickening instructions write
+        // to the code, and only the pages that are written to get copied.
+        data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+
+    bytecode_file_t *file = ALLOCATE_ARRAY(vm, bytecode_file_t, 1);
+    *file = (bytecode_file_t){.data=data, .size=info.st_size, .mapped=true};
+    return file;
+#else
+    FILE *f = fopen(path, "rb");
+    if(!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(size <= 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *data = ALLOCATE_ARRAY(vm, uint8_t, size);
+    bool ok = fread(data, 1, size, f) == (size_t)size;
+    fclose(f);
+    if(!ok) {
+        FREE_ARRAY(vm, data, uint8_t, size);
+        return NULL;
+    }
+
+    bytecode_file_t *file = ALLOCATE_ARRAY(vm, bytecode_file_t, 1);
+    *file = (bytecode_file_t){.data=data, .size=size, .mapped=false};
+    return file;
+#endif
+}
+
+static void close_file(warp_vm_t *vm, bytecode_file_t *file) {
+#if WARP_MMAP
+    if(file->mapped) munmap(file->data, file->size);
+#endif
+    if(!file->mapped) FREE_ARRAY(vm, file->data, uint8_t, file->size);
+    FREE_ARRAY(vm, file, bytecode_file_t, 1);
+}
+
+// Keeps `file` until the VM is destroyed. The file is kept even if it turns out to be invalid: some
+// functions may already point into it.
+static void keep_file(warp_vm_t *vm, bytecode_file_t *file) {
+    file->next = vm->bytecode_files;
+    vm->bytecode_files = file;
+}
+
+warp_fn_t *bytecode_map(warp_vm_t *vm, const char *path, const char **error) {
+    ASSERT(vm);
+    ASSERT(path);
+    ASSERT(error);
+
+    u8_buf_t no_tail;
+    u8_buf_init(&no_tail);
+    return bytecode_map_tail(vm, path, &no_tail, error);
+}
+
+warp_fn_t *bytecode_map_tail(warp_vm_t *vm, const char *path, const u8_buf_t *tail,
+                             const char **error) {
+    ASSERT(vm);
+    ASSERT(path);
+    ASSERT(tail);
+    ASSERT(error);
+
+    bytecode_file_t *file = open_file(vm, path);
+    if(!file) {
+        *error = "could not open file";
+        return NULL;
+    }
+    bool matches = file->size >= (size_t)tail->count && (tail->count == 0
+        || !memcmp(file->data + file->size - tail->count, tail->data, tail->count));
+    if(!matches) {
+        close_file(vm, file);
+        *error = "file is for something else";
+        return NULL;
+    }
+    size_t size = file->size - tail->count;
+    keep_file(vm, file);
+    return bytecode_read(vm, file->data, size, error);
+}
+
+warp_fn_t *bytecode_load(warp_vm_t *vm, const char *path) {
+    const char *error = NULL;
+    warp_fn_t *fn = bytecode_map(vm, path, &error);
+    if(!fn) fprintf(stderr, "error: could not load '%s': %s\n", path, error);
+    return fn;
+}
+
+bool bytecode_load_image(warp_vm_t *vm, const char *path) {
+    ASSERT(vm);
+    ASSERT(path);
+
+    const char *error = "could not open file";
+    bytecode_file_t *file = open_file(vm, path);
+    if(file) keep_file(vm, file);
+    bool ok = file && bytecode_read_image(vm, file->data, file->size, &error);
+    if(!ok) fprintf(stderr, "error: could not load '%s': %s\n", path, error);
+    return ok;
+}
+
+void bytecode_close_files(warp_vm_t *vm) {
+    ASSERT(vm);
+    for(bytecode_file_t *file = vm->bytecode_files; file != NULL;) {
+        bytecode_file_t *next = file->next;
+        close_file(vm, file);
+        file = next;
+    }
+    vm->bytecode_files = NULL;
+}
@@ -0,0 +1,94 @@
+//===--------------------------------------------------------------------------------------------===
+// bytecode.h - Compiled functions saved to, and loaded from, .warpc files
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "buffers.h"
+#include "warp_internal.h"
+#include "types/obj_impl.h"
+
+// Files are only loaded by the version of Warp that wrote them, which checks this along with the
+// instruction set. It goes up whenever the layout below changes.
+#define WARP_BYTECODE_VERSION (3)
+
+// A .warpc file holds a function and everything its constants refer to. All fields are 32-bit
+// integers in the byte order of the machine that wrote the file, which is the only one that can
+// read it back. Sections are padded to four bytes.
+//
+//   header     "WRPC", byte order mark, version, instruction count, then the number of strings,
+//              globals, natives and functions
+//   strings    length and bytes of each string
+//   globals    string index of the name of each global the code refers to by index
+//   natives    string index of the name and arity of each native function the constants refer to
+//   functions  the function that was saved first, then every other function it refers to, each:
+//                name (string index + 1, or 0), arity, max slots,
+//                code size, and the number of constants, call caches, loops, line runs and
+//                inlined calls
+//                constants (kind and two words of payload each)
+//                call caches (index of the global each one is for)
+//                code, then the line table (offset where each run starts, and its line)
+//                inlined calls (line, caller and name string index + 1, or 0, see chunk.h)
+//
+// Images of a VM (.warpi files) are laid out the same, starting with "WRPI", and hold every
+// function the globals refer to. They end with a section for the globals' values:
+//
+//   values     for each global, whether it is defined, its value (kind and two words of payload),
+//              and the function the compiler inlines for it (index + 1, or 0)
+//
+// Native functions are bound by name to the ones the VM reading the file has registered.
+//
+// Loaded functions use the code and line tables in place, so the file stays around, mapped into
+// memory if the platform can do it, until the VM is destroyed.
+typedef struct bytecode_file_t {
+    struct bytecode_file_t  *next;
+    uint8_t                 *data;
+    size_t                  size;
+    bool                    mapped;     // Whether `data` is mapped rather than allocated.
+} bytecode_file_t;
+
+// Serializes `fn` and the functions it refers to at the end of `out`. Fails if one of the constants
+// is something a file can't hold.
+bool bytecode_write(warp_vm_t *vm, const warp_fn_t *fn, u8_buf_t *out);
+
+// Serializes the globals of `vm`, and every function they refer to, at the end of `out`. Fails if
+// one of the values is something a file can't hold.
+bool bytecode_write_image(warp_vm_t *vm, u8_buf_t *out);
+
+// Serializes `fn` into a new file at `path`. Reports what went wrong on stderr when it fails.
+bool bytecode_save(warp_vm_t *vm, const warp_fn_t *fn, const char *path);
+
+// Same as bytecode_save(), for an image of `vm`.
+bool bytecode_save_image(warp_vm_t *vm, const char *path);
+
+// Rebuilds the functions serialized in `data`, and returns the one that was saved. The functions
+// keep pointers into `data`, which is written to as globals are resolved, and must outlive them.
+// Returns NULL and sets `error` if `data` isn't a valid file. The functions' code is only checked
+// by verify_fn() when they are first called.
+warp_fn_t *bytecode_read(warp_vm_t *vm, uint8_t *data, size_t size, const char **error);
+
+// Sets the globals of `vm` to the ones saved in an image. Returns false and sets `error`, leaving
+// the globals as they were, if `data` isn't a valid image or refers to natives `vm` doesn't have.
+bool bytecode_read_image(warp_vm_t *vm, uint8_t *data, size_t size, const char **error);
+
+// Maps the file at `path`, and reads the function in it. Returns NULL and sets `error` when it
+// fails.
+warp_fn_t *bytecode_map(warp_vm_t *vm, const char *path, const char **error);
+
+// Same as bytecode_map(), for a file that has `tail` after the bytecode. Fails, without keeping the
+// file around, if it doesn't end with `tail`.
+warp_fn_t *bytecode_map_tail(warp_vm_t *vm, const char *path, const u8_buf_t *tail,
+                             const char **error);
+
+// Same as bytecode_map(), but reports what went wrong on stderr.
+warp_fn_t *bytecode_load(warp_vm_t *vm, const char *path);
+
+// Maps the image at `path`, and reads it into `vm`. Reports what went wrong on stderr.
+bool bytecode_load_image(warp_vm_t *vm, const char *path);
+
+// Releases the files functions were loaded from. Only safe once none of them will run again.
+void bytecode_close_files(warp_vm_t *vm);
@@ -0,0 +1,245 @@
+//===--------------------------------------------------------------------------------------------===
+// cache.c - On-disk cache of compiled scripts
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#define _DEFAULT_SOURCE
+#include "cache.h"
+#include "bytecode.h"
+#include "compiler.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Entries are shared between processes through rename(), which is only atomic on POSIX systems.
+// Anywhere else scripts are always compiled.
+#if defined(__unix__) || defined(__APPLE__)
+    #define WARP_CACHE 1
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #define WARP_CACHE 0
+#endif
+
+#define CACHE_EXT ".warpc"
+
+// Temporary files are only around while an entry is being written. One that is older than this (in
+// seconds) was left behind by a process that died before it could rename it.
+#define CACHE_TEMP_AGE (10 * 60)
+
+void cache_init(warp_vm_t *vm, const warp_cfg_t *cfg) {
+    ASSERT(vm);
+    ASSERT(cfg);
+    
+    vm->cache.dir = NULL;
+    vm->cache.max_size = cfg->compiler.cache_size ? cfg->compiler.cache_size : WARP_CACHE_SIZE;
+    vm->cache.stats = (warp_cache_stats_t){0};
+    if(!WARP_CACHE || !cfg->compiler.cache_dir) return;
+    
+    size_t length = strlen(cfg->compiler.cache_dir);
+    vm->cache.dir = ALLOCATE_ARRAY(vm, char, length + 1);
+    memcpy(vm->cache.dir, cfg->compiler.cache_dir, length + 1);
+}
+
+void cache_fini(warp_vm_t *vm) {
+    ASSERT(vm);
+    if(vm->cache.dir) FREE_ARRAY(vm, vm->cache.dir, char, strlen(vm->cache.dir) + 1);
+    vm->cache.dir = NULL;
+}
+
+void warp_get_cache_stats(warp_vm_t *vm, warp_cache_stats_t *out) {
+    ASSERT(vm);
+    ASSERT(out);
+    *out = vm->cache.stats;
+}
+
+#if WARP_CACHE
+
+// 64-bit FNV-1a.
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Everything that changes what the compiler produces for the source goes into its key.
+static uint64_t cache_key(const warp_vm_t *vm, const char *source, size_t length) {
+    uint32_t version[3] = {WARP_COMPILER_VERSION, WARP_BYTECODE_VERSION, vm->passes};
+    uint64_t hash = 0xcbf29ce484222325;
+    hash = hash_bytes(hash, version, sizeof(version));
+    hash = hash_bytes(hash, &length, sizeof(length));
+    return hash_bytes(hash, source, length);
+}
+
+// Two sources can have the same key, so entries end with the source they were compiled from, and
+// its length, which has to match before the entry is used.
+static void entry_tail(warp_vm_t *vm, u8_buf_t *out, const char *source, size_t length) {
+    uint64_t size = length;
+    for(size_t i = 0; i < length; ++i) {
+        u8_buf_write(vm, out, (uint8_t)source[i]);
+    }
+    for(size_t i = 0; i < sizeof(size); ++i) {
+        u8_buf_write(vm, out, ((const uint8_t *)&size)[i]);
+    }
+}
+
+typedef struct {
+    char        *path;
+    off_t       size;
+    time_t      used;
+} cache_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+    time_t used_a = ((const cache_entry_t *)a)->used;
+    time_t used_b = ((const cache_entry_t *)b)->used;
+    return (used_a > used_b) - (used_a < used_b);
+}
+
+static bool is_entry(const char *name) {
+    size_t length = strlen(name);
+    size_t ext = strlen(CACHE_EXT);
+    return length > ext && !strcmp(name + length - ext, CACHE_EXT);
+}
+
+// Temporary files are named after the entry they are written for, see write_atomic().
+static bool is_temp(const char *name) {
+    const char *ext = strstr(name, CACHE_EXT ".");
+    return ext && ext != name && strlen(ext) == strlen(CACHE_EXT ".XXXXXX");
+}
+
+// Deletes the least recently used entries until the directory fits in its size again, and any
+// temporary file that was left behind. Other processes may be doing the same, or still running an
+// entry that goes: mappings outlive the file.
+static void evict(warp_vm_t *vm) {
+    DIR *dir = opendir(vm->cache.dir);
+    if(!dir) return;
+    
+    cache_entry_t *entries = NULL;
+    int count = 0, capacity = 0;
+    off_t total = 0;
+    
+    char path[4096];
+    time_t now = time(NULL);
+    for(struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        bool temp = is_temp(ent->d_name);
+        if(!temp && !is_entry(ent->d_name)) continue;
+        snprintf(path, sizeof(path), "%s/%s", vm->cache.dir, ent->d_name);
+        
+        struct stat info;
+        if(stat(path, &info) != 0) continue;
+        if(temp) {
+            if(now - info.st_mtime > CACHE_TEMP_AGE) unlink(path);
+            continue;
+        }
+        if(count == capacity) {
+            int old = capacity;
+            capacity = GROW_CAPACITY(capacity);
+            entries = GROW_ARRAY(vm, entries, cache_entry_t, old, capacity);
+        }
+        
+        size_t length = strlen(path) + 1;
+        entries[count].path = ALLOCATE_ARRAY(vm, char, length);
+        memcpy(entries[count].path, path, length);
+        entries[count].size = info.st_size;
+        entries[count].used = info.st_mtime;
+        total += info.st_size;
+        count += 1;
+    }
+    closedir(dir);
+    
+    qsort(entries, count, sizeof(cache_entry_t), compare_entries);
+    for(int i = 0; i < count; ++i) {
+        if((size_t)total > vm->cache.max_size && unlink(entries[i].path) == 0) {
+            total -= entries[i].size;
+            vm->cache.stats.evictions += 1;
+        }
+        FREE_ARRAY(vm, entries[i].path, char, strlen(entries[i].path) + 1);
+    }
+    if(entries) FREE_ARRAY(vm, entries, cache_entry_t, capacity);
+}
+
+// Writes `data` to a temporary file next to `path`, and moves it over `path` once it is complete.
+static bool write_atomic(const char *path, const u8_buf_t *data) {
+    char tmp[4096];
+    if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) return false;
+    
+    int fd = mkstemp(tmp);
+    if(fd < 0) return false;
+    
+    bool ok = true;
+    for(size_t done = 0; ok && done < (size_t)data->count;) {
+        ssize_t written = write(fd, data->data + done, data->count - done);
+        ok = written > 0;
+        done += ok ? (size_t)written : 0;
+    }
+    ok = ok && fchmod(fd, 0644) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if(!ok) unlink(tmp);
+    return ok;
+}
+
+warp_fn_t *cache_compile(warp_vm_t *vm, const char *fname, const char *source, size_t length) {
+    ASSERT(vm);
+    ASSERT(source);
+    if(!vm->cache.dir) return compile(vm, fname, source, length);
+    
+    char path[4096];
+    uint64_t key = cache_key(vm, source, length);
+    int size = snprintf(path, sizeof(path), "%s/%016" PRIx64 CACHE_EXT, vm->cache.dir, key);
+    if(size < 0 || size >= (int)sizeof(path)) return compile(vm, fname, source, length);
+    
+    u8_buf_t tail;
+    u8_buf_init(&tail);
+    entry_tail(vm, &tail, source, length);
+    
+    const char *error = NULL;
+    warp_fn_t *fn = bytecode_map_tail(vm, path, &tail, &error);
+    if(fn) {
+        // Entries are evicted by modification time, which makes that the time they were last used.
+        utimensat(AT_FDCWD, path, NULL, 0);
+        vm->cache.stats.hits += 1;
+        u8_buf_fini(vm, &tail);
+        return fn;
+    }
+    
+    vm->cache.stats.misses += 1;
+    fn = compile(vm, fname, source, length);
+    if(!fn) {
+        u8_buf_fini(vm, &tail);
+        return NULL;
+    }
+    
+    u8_buf_t data;
+    u8_buf_init(&data);
+    mkdir(vm->cache.dir, 0755);
+    if(bytecode_write(vm, fn, &data)) {
+        for(int i = 0; i < tail.count; ++i) {
+            u8_buf_write(vm, &data, tail.data[i]);
+        }
+        if(write_atomic(path, &data)) {
+            vm->cache.stats.writes += 1;
+            evict(vm);
+        }
+    }
+    u8_buf_fini(vm, &data);
+    u8_buf_fini(vm, &tail);
+    return fn;
+}
+
+#else
+
+warp_fn_t *cache_compile(warp_vm_t *vm, const char *fname, const char *source, size_t length) {
+    return compile(vm, fname, source, length);
+}
+
+#endif
@@ -0,0 +1,35 @@
+//===--------------------------------------------------------------------------------------------===
+// cache.h - On-disk cache of compiled scripts
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "warp_internal.h"
+#include "types/obj_impl.h"
+
+// Bumped whenever the compiler changes the code it emits for the same source, so that nothing it
+// cached before is used again.
+#define WARP_COMPILER_VERSION (1)
+
+// Size the cache directory is trimmed down to, unless the VM was configured otherwise.
+#ifndef WARP_CACHE_SIZE
+    #define WARP_CACHE_SIZE (64 * 1024 * 1024)
+#endif
+
+void cache_init(warp_vm_t *vm, const warp_cfg_t *cfg);
+void cache_fini(warp_vm_t *vm);
+
+// Compiles `source`, or loads what an earlier compile of the same source with the same compiler
+// and passes left in the cache directory. Entries are .warpc files (see bytecode.h) named after a
+// hash of all of those, followed by the source and its length, which are checked against `source`
+// so that two sources with the same hash don't get each other's code. They are written to a
+// temporary file and renamed into place, so processes sharing the directory only ever see complete
+// entries. When a new entry takes the directory over its size, the entries that were used least
+// recently are deleted, along with temporary files left behind by processes that died.
+//
+// Without a cache directory, this is just compile().
+warp_fn_t *cache_compile(warp_vm_t *vm, const char *fname, const char *source, size_t length);
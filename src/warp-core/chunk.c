@@ -11,50 +11,122 @@
 #include <warp/instr.h>
 #include "warp_internal.h"
 
+DEFINE_BUFFER(cache, call_cache_t)
+DEFINE_BUFFER(loop, hot_loop_t)
+DEFINE_BUFFER(line, line_run_t)
+DEFINE_BUFFER(inlined, inlined_t)
+
 void chunk_init(warp_vm_t *vm, chunk_t *chunk) {
     ASSERT(chunk);
     UNUSED(vm); // We could remove vm from the args, but homogeneity? We'll see
     
-    chunk->lines = NULL;
+    line_buf_init(&chunk->lines);
+    inlined_buf_init(&chunk->inlined);
     chunk->code = NULL;
     chunk->count = 0;
     chunk->capacity = 0;
+    chunk->borrowed = false;
     
     val_buf_init(&chunk->constants);
+    cache_buf_init(&chunk->caches);
+    loop_buf_init(&chunk->loops);
 }
 
 void chunk_fini(warp_vm_t *vm, chunk_t *chunk) {
     ASSERT(vm);
     ASSERT(chunk);
     
-    FREE_ARRAY(vm, chunk->code, uint8_t, chunk->capacity);
-    FREE_ARRAY(vm, chunk->lines, int, chunk->capacity);
+    if(!chunk->borrowed) {
+        FREE_ARRAY(vm, chunk->code, uint8_t, chunk->capacity);
+        line_buf_fini(vm, &chunk->lines);
+    }
+    inlined_buf_fini(vm, &chunk->inlined);
     val_buf_fini(vm, &chunk->constants);
+    cache_buf_fini(vm, &chunk->caches);
+    loop_buf_fini(vm, &chunk->loops);
     chunk_init(vm, chunk);
 }
 
 void chunk_write(warp_vm_t *vm, chunk_t *chunk, uint8_t byte, int line) {
     ASSERT(vm);
     ASSERT(chunk);
+    ASSERT(!chunk->borrowed);
     
     if(chunk->capacity < chunk->count + 1) {
         size_t old_cap = chunk->capacity;
         size_t new_cap = GROW_CAPACITY(chunk->capacity);
         chunk->code = GROW_ARRAY(vm, chunk->code, uint8_t, old_cap, new_cap);
-        chunk->lines = GROW_ARRAY(vm, chunk->lines, int, old_cap, new_cap);
         chunk->capacity = new_cap;
     }
+    chunk_add_line(vm, &chunk->lines, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count += 1;
 }
 
+void chunk_add_line(warp_vm_t *vm, line_buf_t *lines, int offset, int line) {
+    ASSERT(vm);
+    ASSERT(lines);
+    
+    while(lines->count > 0 && lines->data[lines->count - 1].offset >= offset) {
+        lines->count -= 1;
+    }
+    if(lines->count > 0 && lines->data[lines->count - 1].line == line) return;
+    line_buf_write(vm, lines, (line_run_t){.offset=offset, .line=line});
+}
+
+int chunk_get_line(const chunk_t *chunk, int offset) {
+    ASSERT(chunk);
+    ASSERT(offset >= 0 && offset < chunk->count);
+    
+    // Finds the last run that starts at or before `offset`.
+    const line_run_t *runs = chunk->lines.data;
+    int lo = 0, hi = chunk->lines.count;
+    while(hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if(runs[mid].offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return chunk->lines.count ? runs[lo].line : 0;
+}
+
+static int add_inlined(warp_vm_t *vm, chunk_t *chunk, inlined_t site) {
+    for(int i = 0; i < chunk->inlined.count; ++i) {
+        const inlined_t *other = &chunk->inlined.data[i];
+        if(other->line == site.line && other->caller == site.caller && other->name == site.name) {
+            return -1 - i;
+        }
+    }
+    inlined_buf_write(vm, &chunk->inlined, site);
+    return -chunk->inlined.count;
+}
+
+int chunk_inline_line(warp_vm_t *vm, chunk_t *chunk, const chunk_t *from, warp_str_t *name,
+                      int line, int caller) {
+    ASSERT(vm);
+    ASSERT(chunk);
+    ASSERT(from);
+    
+    if(line >= 0) {
+        return add_inlined(vm, chunk, (inlined_t){.line=line, .caller=caller, .name=name});
+    }
+    
+    // `from` had code inlined into it already: that comes along, called from wherever it was
+    // called in `from`. Callers are always added before the code they call.
+    inlined_t site = from->inlined.data[-1 - line];
+    site.caller = chunk_inline_line(vm, chunk, from, name, site.caller, caller);
+    return add_inlined(vm, chunk, site);
+}
+
 int chunk_add_const(warp_vm_t *vm, chunk_t *chunk, warp_value_t value) {
     ASSERT(vm);
     ASSERT(chunk);
     
+    // Constants that are only equal, like 0 and -0.0, aren't interchangeable.
     for(int i = 0; i < chunk->constants.count; ++i) {
-        if(value_equals(value, chunk->constants.data[i])) return i;
+        if(value_same(value, chunk->constants.data[i])) return i;
     }
     
     val_buf_write(vm, &chunk->constants, value);
@@ -62,4 +134,24 @@ int chunk_add_const(warp_vm_t *vm, chunk_t *chunk, warp_value_t value) {
     return chunk->constants.count - 1;
 }
 
+int chunk_add_cache(warp_vm_t *vm, chunk_t *chunk, uint16_t global) {
+    ASSERT(vm);
+    ASSERT(chunk);
+    
+    // Globals start at version 1, so a fresh cache never hits.
+    cache_buf_write(vm, &chunk->caches, (call_cache_t){.global=global, .version=0, .fn=NULL});
+    return chunk->caches.count - 1;
+}
 
+int chunk_add_loop(warp_vm_t *vm, chunk_t *chunk) {
+    ASSERT(vm);
+    ASSERT(chunk);
+    
+    loop_buf_write(vm, &chunk->loops, (hot_loop_t){
+        .hotness=0,
+        .attempts=0,
+        .trace=NULL,
+        .trace_size=0
+    });
+    return chunk->loops.count - 1;
+}
@@ -11,20 +11,88 @@
 #include <warp/warp.h>
 #include "buffers.h"
 
+// Inline cache for a call site whose callee is a global. It stays valid for as long as the global's
+// version matches the one recorded here.
+typedef struct {
+    uint16_t    global;
+    uint32_t    version;
+    warp_fn_t   *fn;
+} call_cache_t;
+
+DECLARE_BUFFER(cache, call_cache_t);
+
+// A loop's back edge, which the VM counts to find hot loops worth tracing. Once a trace has been
+// compiled, taking the back edge runs it instead.
+typedef struct {
+    uint32_t    hotness;
+    uint8_t     attempts;
+    void        *trace;
+    size_t      trace_size;
+} hot_loop_t;
+
+DECLARE_BUFFER(loop, hot_loop_t);
+
+// Line numbers are only needed to report errors and to disassemble code, and many instructions come
+// from the same line: chunks keep the offset where each run of code on the same line starts, rather
+// than a line for every byte.
+typedef struct {
+    int32_t     offset;
+    int32_t     line;
+} line_run_t;
+
+DECLARE_BUFFER(line, line_run_t);
+
+// Code copied in from a function the compiler inlined has no frame of its own when it runs, so
+// errors in it would otherwise be reported against the caller. Its runs in the line table have a
+// line below zero instead: line -1 - i stands for `inlined.data[i]`, which says where it came from.
+typedef struct {
+    int32_t     line;       // Line of the inlined function the code comes from.
+    int32_t     caller;     // Line of the call that was inlined, which can itself be inlined.
+    warp_str_t  *name;      // Name of the inlined function, if it has one.
+} inlined_t;
+
+DECLARE_BUFFER(inlined, inlined_t);
+
 typedef struct chunk_t {
     int capacity;
     int count;
     
-    int *lines;
     uint8_t *code;
+    line_buf_t lines;   // Runs past `count` are left over from code that was dropped.
+    inlined_buf_t inlined;
     
     val_buf_t constants;
+    cache_buf_t caches;
+    loop_buf_t loops;
+    
+    // Whether `code` and `lines` belong to the bytecode file the chunk was loaded from, rather
+    // than to the chunk. See bytecode.h.
+    bool borrowed;
 } chunk_t;
 
 void chunk_init(warp_vm_t *vm, chunk_t *chunk);
 void chunk_fini(warp_vm_t *vm, chunk_t *chunk);
 void chunk_write(warp_vm_t *vm, chunk_t *chunk, uint8_t byte, int line);
 
+// Returns the line the code at `offset` comes from, as recorded: below zero for inlined code.
+int chunk_get_line(const chunk_t *chunk, int offset);
+
+// Returns the line of the source `line` stands for, looking through inlined code.
+static inline int chunk_source_line(const chunk_t *chunk, int line) {
+    return line < 0 ? chunk->inlined.data[-1 - line].line : line;
+}
+
+// Returns the line that stands for `line` of `from`, the body of the function `name`, once it has
+// been copied into `chunk` by a call on `caller`.
+int chunk_inline_line(warp_vm_t *vm, chunk_t *chunk, const chunk_t *from, warp_str_t *name,
+                      int line, int caller);
+
+// Records that the code at `offset`, which is past any offset already recorded, comes from `line`.
+// Only adds a run when the line changes. Runs at or after `offset` are dropped first.
+void chunk_add_line(warp_vm_t *vm, line_buf_t *lines, int offset, int line);
+
 int chunk_add_const(warp_vm_t *vm, chunk_t *chunk, warp_value_t value);
+int chunk_add_cache(warp_vm_t *vm, chunk_t *chunk, uint16_t global);
+int chunk_add_loop(warp_vm_t *vm, chunk_t *chunk);
 
 #endif /* _CHUNK_H_ */
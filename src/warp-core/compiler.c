@@ -13,6 +13,11 @@
 #include "types/obj_impl.h"
 #include "diag_impl.h"
 #include "debug.h"
+#include "peephole.h"
+#include "opt.h"
+#include "verify.h"
+#include "value_impl.h"
+#include "warp_internal.h"
 #include <string.h>
 
 typedef enum {
@@ -31,6 +36,17 @@ typedef enum {
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Largest function body, in bytes of bytecode, that gets inlined at call sites.
+#ifndef WARP_INLINE_MAX_SIZE
+    #define WARP_INLINE_MAX_SIZE (32)
+#endif
+
+// Shortest function, in bytes of source, whose body is left for later when compiling lazily. Short
+// ones take about as long to compile as to skip, and compiling them keeps them inlinable.
+#ifndef WARP_LAZY_MIN_SIZE
+    #define WARP_LAZY_MIN_SIZE (128)
+#endif
+
 typedef struct local_t local_t;
 typedef struct compiler_t compiler_t;
 typedef struct loop_t loop_t;
@@ -50,7 +66,9 @@ struct loop_t {
     int             start;
     int             body;
     int             exit_jmp;
+    int             exit_slots;     // Stack depth when the exit jump is taken.
     int             scope_depth;
+    bool            rotate;         // Whether to move the condition after the body, see rotate_loop().
 };
 
 struct compiler_t {
@@ -69,6 +87,9 @@ struct compiler_t {
     
     int             num_slots;
     int             max_slots;
+    
+    int             last_instr;
+    int             last_target;
 };
 
 typedef void (*parse_fn_t)(compiler_t *comp, bool can_assign);
@@ -101,6 +122,7 @@ static void emit_byte(compiler_t *comp, uint8_t byte) {
 }
 
 static void emit_instr(compiler_t *comp, uint8_t instr) {
+    comp->last_instr = current_chunk(comp)->count;
     if(instr != OP_BLOCK) {
         comp->num_slots += stack_effect[instr];
         if(comp->num_slots > comp->max_slots) {
@@ -126,18 +148,29 @@ static int emit_jump(compiler_t *comp, uint8_t instr) {
     return current_chunk(comp)->count - 2;
 }
 
-static void emit_loop(compiler_t *comp, int start) {
-    emit_instr(comp, OP_LOOP);
-    int jmp = current_chunk(comp)->count - start + 2;
+static void emit_loop(compiler_t *comp, uint8_t instr, int start) {
+    emit_instr(comp, instr);
+    int jmp = current_chunk(comp)->count - start + 4;
     if(jmp > UINT16_MAX) {
         error_at(comp->parser, previous(comp->parser), "too much code to jump over");
     }
     emit_byte(comp, jmp & 0xff);
     emit_byte(comp, (jmp >> 8) & 0xff);
+    
+    int loop = chunk_add_loop(comp->vm, current_chunk(comp));
+    if(loop > UINT16_MAX) {
+        error_at(comp->parser, previous(comp->parser), "too many loops in one function");
+    }
+    emit_byte(comp, loop & 0xff);
+    emit_byte(comp, (loop >> 8) & 0xff);
 }
 
+// Points the jump whose distance is at `offset`, just after the instruction, to the end of the
+// code so far.
 static void patch_jump(compiler_t *comp, int offset) {
-    int jmp = current_chunk(comp)->count - offset - 2;
+    const chunk_t *chunk = current_chunk(comp);
+    int jmp = chunk->count - (offset - 1 + code_size[chunk->code[offset - 1]]);
+    comp->last_target = current_chunk(comp)->count;
     
     if(jmp > UINT16_MAX) {
         error_at(comp->parser, previous(comp->parser), "too much code to jump over");
@@ -159,14 +192,55 @@ static void emit_const(compiler_t *comp, warp_value_t value) {
     }
 }
 
-static inline int add_ident_const(compiler_t *comp, const token_t *name) {
-    int idx = chunk_add_const(
-        comp->vm,
-        current_chunk(comp),
-        WARP_OBJ_VAL(warp_copy_c_str(comp->vm, name->start, name->length))
-    );
-    if(idx >= UINT8_MAX) {
-        error_at(comp->parser, previous(comp->parser), "too many constants in one bytecode unit");
+static void emit_value(compiler_t *comp, warp_value_t value) {
+    if(WARP_IS_NIL(value)) {
+        emit_instr(comp, OP_NIL);
+    } else if(WARP_IS_BOOL(value)) {
+        emit_instr(comp, WARP_AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_const(comp, value);
+    }
+}
+
+static bool should_fold(const compiler_t *comp) {
+    return (comp->vm->passes & WARP_PASS_FOLD) != 0;
+}
+
+// Returns the size of the instruction at `offset` if it pushes a constant, which goes in `out`,
+// or 0 if it doesn't.
+static int const_push(const chunk_t *chunk, int offset, warp_value_t *out) {
+    switch(chunk->code[offset]) {
+    case OP_CONST: *out = chunk->constants.data[chunk->code[offset + 1]]; return 2;
+    case OP_NIL: *out = WARP_NIL_VAL; return 1;
+    case OP_TRUE: *out = WARP_TRUE_VAL; return 1;
+    case OP_FALSE: *out = WARP_FALSE_VAL; return 1;
+    default: return 0;
+    }
+}
+
+// Checks whether the code from `start` on is a single instruction that pushes a constant, with
+// nothing jumping to the end of it. Constant subexpressions always end up like that, once they
+// have been folded.
+static bool emitted_const(const compiler_t *comp, int start, warp_value_t *out) {
+    const chunk_t *chunk = &comp->fn->chunk;
+    if(comp->last_instr != start || comp->last_target == chunk->count) return false;
+    int size = const_push(chunk, start, out);
+    return size > 0 && start + size == chunk->count;
+}
+
+// Throws away the code emitted since `start`, which left `num_slots` values on the stack. We use
+// this to replace constant expressions with their value, and to drop code that can never run.
+static void discard_code(compiler_t *comp, int start, int num_slots) {
+    current_chunk(comp)->count = start;
+    comp->num_slots = num_slots;
+    comp->last_instr = -1;
+}
+
+static int resolve_global(compiler_t *comp, const token_t *name) {
+    warp_str_t *str = warp_copy_c_str(comp->vm, name->start, name->length);
+    int idx = vm_global_slot(comp->vm, str);
+    if(idx > UINT16_MAX) {
+        error_at(comp->parser, name, "too many global variables");
     }
     return idx;
 }
@@ -175,20 +249,33 @@ static void begin_scope(compiler_t *comp) {
     comp->scope_depth += 1;
 }
 
-static int drop_locals(compiler_t *comp, int target_scope_depth) {
+// Counts the locals declared deeper than `target_scope_depth`, which are on the stack above those
+// of that scope.
+static int count_locals(const compiler_t *comp, int target_scope_depth) {
     int num_slots = 0;
-    while(comp->local_count > 0 && comp->locals[comp->local_count-1].depth > target_scope_depth) {
-        comp->local_count -= 1;
+    for(int i = comp->local_count - 1; i >= 0 && comp->locals[i].depth > target_scope_depth; --i) {
         num_slots += 1;
     }
     ASSERT(num_slots < UINT16_MAX);
-    emit_bytes_long(comp, OP_BLOCK, num_slots);
     return num_slots;
 }
 
-static void end_scope(compiler_t *comp) {
+// Drops the locals of scopes deeper than `target_scope_depth`. When the value of the scope is used,
+// it is kept on top of them.
+static int drop_locals(compiler_t *comp, int target_scope_depth, bool keep_value) {
+    int num_slots = count_locals(comp, target_scope_depth);
+    comp->local_count -= num_slots;
+    if(keep_value) {
+        emit_bytes_long(comp, OP_BLOCK, num_slots);
+    } else if(num_slots > 0) {
+        emit_bytes_long(comp, OP_DROP, num_slots);
+    }
+    return num_slots;
+}
+
+static void end_scope(compiler_t *comp, bool keep_value) {
     comp->scope_depth -= 1;
-    comp->num_slots -= drop_locals(comp, comp->scope_depth);
+    comp->num_slots -= drop_locals(comp, comp->scope_depth, keep_value);
 }
 
 static void open_loop(compiler_t *comp, loop_t *loop) {
@@ -198,7 +285,9 @@ static void open_loop(compiler_t *comp, loop_t *loop) {
     loop->start = current_chunk(comp)->count;
     loop->body = -1;
     loop->exit_jmp = -1;
+    loop->exit_slots = 0;
     loop->scope_depth = comp->scope_depth;
+    loop->rotate = false;
     comp->loop = loop;
 }
 
@@ -206,6 +295,7 @@ static void test_loop_jump(compiler_t *comp) {
     ASSERT(comp->loop != NULL);
     ASSERT(comp->loop->exit_jmp == -1);
     comp->loop->exit_jmp = emit_jump(comp, OP_JMP_FALSE);
+    comp->loop->exit_slots = comp->num_slots;
 }
 
 static void start_loop_body(compiler_t *comp) {
@@ -214,6 +304,68 @@ static void start_loop_body(compiler_t *comp) {
     comp->loop->body = current_chunk(comp)->count;
 }
 
+// Checks that the jumps in the code between `start` and `end` all land in there too, or right after
+// it. Breaks are left out: they are only patched once the loop is done.
+static bool jumps_within(const chunk_t *chunk, int start, int end) {
+    for(int i = start; i < end; i += code_size[chunk->code[i]]) {
+        const uint8_t *code = chunk->code + i;
+        if(code[0] != OP_JMP && code[0] != OP_JMP_FALSE && code[0] != OP_GUARD_FN
+           && !warp_jumps_back(code[0])) continue;
+        
+        int next = i + code_size[code[0]];
+        int jmp = code[1] | (code[2] << 8);
+        int target = warp_jumps_back(code[0]) ? next - jmp : next + jmp;
+        if(target < start || target > end) return false;
+    }
+    return true;
+}
+
+// Moves the condition of a loop after its body, so that each trip round only has one branch:
+//
+//          JMP test
+//   body:  ...
+//   test:  <condition>
+//          LOOP_IF body
+//
+// Both are moved as they are, which only works when they don't jump anywhere else. `continue`
+// jumps back to the start, so loops that use it are left alone.
+static bool rotate_loop(compiler_t *comp, loop_t *loop) {
+    chunk_t *chunk = current_chunk(comp);
+    int cond_size = loop->exit_jmp - 1 - loop->start;
+    int body = loop->body + 1;
+    int body_size = chunk->count - body;
+    if(!jumps_within(chunk, loop->start, loop->start + cond_size)) return false;
+    if(!jumps_within(chunk, body, chunk->count)) return false;
+    
+    // The body and the condition are set aside with their lines, and written back in that order
+    // after the jump.
+    int moved_size = body_size + cond_size;
+    uint8_t *moved = ALLOCATE_ARRAY(comp->vm, uint8_t, moved_size);
+    int *lines = ALLOCATE_ARRAY(comp->vm, int, moved_size);
+    for(int i = 0; i < moved_size; ++i) {
+        int offset = i < body_size ? body + i : loop->start + (i - body_size);
+        moved[i] = chunk->code[offset];
+        lines[i] = chunk_get_line(chunk, offset);
+    }
+    
+    int dst = loop->start + code_size[OP_JMP];
+    chunk->count = dst;
+    for(int i = 0; i < moved_size; ++i) {
+        chunk_write(comp->vm, chunk, moved[i], lines[i]);
+    }
+    FREE_ARRAY(comp->vm, moved, uint8_t, moved_size);
+    FREE_ARRAY(comp->vm, lines, int, moved_size);
+    
+    chunk->code[loop->start] = OP_JMP;
+    chunk->code[loop->start + 1] = body_size & 0xff;
+    chunk->code[loop->start + 2] = (body_size >> 8) & 0xff;
+    loop->body = dst;
+    
+    comp->num_slots = loop->exit_slots;
+    emit_loop(comp, OP_LOOP_IF, dst);
+    return true;
+}
+
 static void close_loop(compiler_t *comp) {
     ASSERT(comp->loop != NULL);
     loop_t *loop = comp->loop;
@@ -222,12 +374,14 @@ static void close_loop(compiler_t *comp) {
     ASSERT(loop->exit_jmp >= 0);
     
     comp->loop = loop->enclosing;
-    end_scope(comp);
-    emit_instr(comp, OP_POP);
+    end_scope(comp, false);
     
-    emit_loop(comp, loop->start);
-    patch_jump(comp, loop->exit_jmp);
-    emit_instr(comp, OP_POP);
+    if(!loop->rotate || !rotate_loop(comp, loop)) {
+        emit_loop(comp, OP_LOOP, loop->start);
+        patch_jump(comp, loop->exit_jmp);
+        comp->num_slots = loop->exit_slots;
+        emit_instr(comp, OP_POP);
+    }
     
     // Loops evaluate to nil, unless we `break` out of them (in which case they evaluate to nil
     // or the expression that's break-ed out)
@@ -247,19 +401,21 @@ static void close_loop(compiler_t *comp) {
     }
 }
 
-static void
-compiler_init(compiler_t *compiler, warp_vm_t *vm, parser_t *parser, compiler_kind_t kind) {
+static void compiler_init(compiler_t *compiler, warp_vm_t *vm, parser_t *parser,
+                          compiler_kind_t kind, warp_fn_t *fn) {
     compiler->vm = vm;
     compiler->parser = parser;
+    compiler->enclosing = NULL;
     
     compiler->kind = kind;
-    compiler->fn = NULL;
     
     compiler->local_count = 0;
     compiler->scope_depth = 0;
     compiler->num_slots = 0;
     compiler->max_slots = 0;
-    compiler->fn = warp_fn_new(vm, WARP_FN_BYTECODE);
+    compiler->last_instr = -1;
+    compiler->last_target = -1;
+    compiler->fn = fn;
     
     // Claim stack index 0 for ourselves
     local_t *local = &compiler->locals[compiler->local_count++];
@@ -270,7 +426,8 @@ compiler_init(compiler_t *compiler, warp_vm_t *vm, parser_t *parser, compiler_ki
 
 static void
 compiler_init_nested(compiler_t *compiler, compiler_t *enclosing, compiler_kind_t kind) {
-    compiler_init(compiler, enclosing->vm, enclosing->parser, kind);
+    compiler_init(compiler, enclosing->vm, enclosing->parser, kind,
+                  warp_fn_new(enclosing->vm, WARP_FN_BYTECODE));
     compiler->enclosing = enclosing;
 }
 
@@ -278,6 +435,19 @@ static warp_fn_t *end_compiler(compiler_t *comp) {
     emit_return(comp);
     warp_fn_t *fn = comp->fn;
     
+    // Parameters are never pushed by the function's own code, so we count them on top of the
+    // deepest the stack got, along with the callee in slot 0.
+    fn->max_slots = 1 + fn->arity + comp->max_slots;
+    
+    if(!comp->parser->had_error) {
+        opt_fn(comp->vm, fn, comp->vm->passes);
+        peephole_optimize(comp->vm, &fn->chunk);
+        
+        // The compiler only emits valid code, so anything the verifier rejects is a bug in here.
+        bool verified = verify_fn(comp->vm, fn);
+        ASSERT(verified);
+    }
+    
 #if DEBUG_PRINT_CODE == 1
     if(!comp->parser->had_error) {
         disassemble_chunk(&fn->chunk, fn->name ? fn->name->data : "<script>", stdout);
@@ -287,7 +457,7 @@ static warp_fn_t *end_compiler(compiler_t *comp) {
 }
 
 static void expression(compiler_t *comp);
-static void declaration(compiler_t *comp);
+static void declaration(compiler_t *comp, bool keep_value);
 static const parse_rule_t *get_rule(token_kind_t kind);
 static void parse_precedence(compiler_t *comp, precedence_t prec);
 
@@ -336,6 +506,43 @@ static int resolve_local(compiler_t *comp, const token_t *name) {
     return -1;
 }
 
+// When the expression compiled since `start` is a single arithmetic operation on a local and
+// another local (or a constant), we can drop the stack shuffle and use the register form of the
+// instruction, writing the result straight into the `dst` slot.
+static bool emit_register_op(compiler_t *comp, int start, int num_slots, uint8_t dst) {
+    chunk_t *chunk = current_chunk(comp);
+    if(chunk->count != start + 5) return false;
+    
+    const uint8_t *code = chunk->code + start;
+    if(code[0] != OP_GET_LOCAL) return false;
+    
+    uint8_t instr;
+    switch(code[4]) {
+    case OP_ADD: instr = OP_ADD_RR; break;
+    case OP_SUB: instr = OP_SUB_RR; break;
+    case OP_MUL: instr = OP_MUL_RR; break;
+    case OP_DIV: instr = OP_DIV_RR; break;
+    default: return false;
+    }
+    
+    if(code[2] == OP_CONST) {
+        instr += OP_ADD_RK - OP_ADD_RR;
+    } else if(code[2] != OP_GET_LOCAL) {
+        return false;
+    }
+    
+    uint8_t a = code[1];
+    uint8_t b = code[3];
+    chunk->count = start;
+    comp->num_slots = num_slots;
+    
+    emit_instr(comp, instr);
+    emit_byte(comp, dst);
+    emit_byte(comp, a);
+    emit_byte(comp, b);
+    return true;
+}
+
 static void named_variable(compiler_t *comp, const token_t *name, bool can_assign) {
     
     uint8_t get_op, set_op;
@@ -344,14 +551,27 @@ static void named_variable(compiler_t *comp, const token_t *name, bool can_assig
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
     } else {
-        arg = add_ident_const(comp, name);
+        arg = resolve_global(comp, name);
         get_op = OP_GET_GLOB;
         set_op = OP_SET_GLOB;
     }
     
     if(can_assign && match(comp->parser, TOK_EQUALS)) {
+        int start = current_chunk(comp)->count;
+        int num_slots = comp->num_slots;
         expression(comp);
-        emit_bytes(comp, set_op, (uint8_t)arg);
+        
+        if(set_op == OP_SET_GLOB) {
+            comp->vm->globals.data[arg].inline_fn = NULL;
+            emit_bytes_long(comp, set_op, (uint16_t)arg);
+        } else if(emit_register_op(comp, start, num_slots, (uint8_t)arg)) {
+            // Assignments are expressions too, so the new value still needs to end up on the stack.
+            emit_bytes(comp, OP_GET_LOCAL, (uint8_t)arg);
+        } else {
+            emit_bytes(comp, set_op, (uint8_t)arg);
+        }
+    } else if(get_op == OP_GET_GLOB) {
+        emit_bytes_long(comp, get_op, (uint16_t)arg);
     } else {
         emit_bytes(comp, get_op, (uint8_t)arg);
     }
@@ -369,12 +589,63 @@ static void unary(compiler_t *comp, bool can_assign) {
     UNUSED(can_assign);
     token_t op = *previous(comp->parser);
     
-    expression(comp);    
+    int start = current_chunk(comp)->count;
+    int num_slots = comp->num_slots;
+    expression(comp);
+    
+    uint8_t instr;
     switch(op.kind) {
-    case TOK_MINUS: emit_instr(comp, OP_NEG); break;
-    case TOK_BANG: emit_instr(comp, OP_NOT); break;
-    default: UNREACHABLE(); break;
+    case TOK_MINUS: instr = OP_NEG; break;
+    case TOK_BANG: instr = OP_NOT; break;
+    default: UNREACHABLE(); return;
+    }
+    
+    warp_value_t operand, result;
+    if(should_fold(comp)
+       && emitted_const(comp, start, &operand)
+       && opt_fold_unary(instr, operand, &result)) {
+        discard_code(comp, start, num_slots);
+        emit_value(comp, result);
+        return;
     }
+    emit_instr(comp, instr);
+}
+
+// Folds the binary operation whose left operand starts at `lhs`, and right operand at `rhs`, when
+// both of them are constants.
+static bool fold_binary(compiler_t *comp, token_kind_t op, int lhs, int rhs, int num_slots) {
+    if(lhs < 0) return false;
+    
+    uint8_t instr;
+    bool negate = false;
+    switch(op) {
+    case TOK_PLUS: instr = OP_ADD; break;
+    case TOK_MINUS: instr = OP_SUB; break;
+    case TOK_STAR: instr = OP_MUL; break;
+    case TOK_SLASH: instr = OP_DIV; break;
+    case TOK_LT: instr = OP_LT; break;
+    case TOK_GT: instr = OP_GT; break;
+    case TOK_LTEQ: instr = OP_LTEQ; break;
+    case TOK_GTEQ: instr = OP_GTEQ; break;
+    case TOK_EQEQ: instr = OP_EQ; break;
+    case TOK_BANGEQ: instr = OP_EQ; negate = true; break;
+    default: return false;
+    }
+    
+    warp_value_t a, b, result;
+    if(!emitted_const(comp, rhs, &b)) return false;
+    
+    // The left operand must end where the right one starts. Whether anything jumps there was
+    // checked before the right operand was compiled.
+    int size = const_push(current_chunk(comp), lhs, &a);
+    if(!size || lhs + size != rhs) return false;
+    
+    if(!opt_fold_binary(comp->vm, instr, a, b, &result)) return false;
+    if(negate) result = WARP_BOOL_VAL(!WARP_AS_BOOL(result));
+    
+    discard_code(comp, lhs, num_slots);
+    emit_value(comp, result);
+    return true;
 }
 
 static void binary(compiler_t *comp, bool can_assign) {
@@ -382,8 +653,16 @@ static void binary(compiler_t *comp, bool can_assign) {
     
     token_t op = *previous(comp->parser);
     const parse_rule_t *rule = get_rule(op.kind);
+    
+    // The left operand has already been compiled: it is only a candidate for folding if it is the
+    // last thing we emitted, and no jump lands after it.
+    int rhs = current_chunk(comp)->count;
+    int lhs = should_fold(comp) && comp->last_target != rhs ? comp->last_instr : -1;
+    int num_slots = comp->num_slots - 1;
     parse_precedence(comp, rule->precedence + 1);
     
+    if(fold_binary(comp, op.kind, lhs, rhs, num_slots)) return;
+    
     switch(op.kind) {
     case TOK_PLUS: emit_instr(comp, OP_ADD); break;
     case TOK_MINUS: emit_instr(comp, OP_SUB); break;
@@ -443,23 +722,204 @@ static uint8_t arg_list(compiler_t *comp) {
 }
 
 
+// Returns the global the callee we just compiled comes from, or -1 if it isn't just a global read
+// (for example if a jump lands between the read and the call).
+static int callee_global(compiler_t *comp) {
+    const chunk_t *chunk = current_chunk(comp);
+    if(comp->last_instr < 0 || comp->last_target == chunk->count) return -1;
+    if(chunk->code[comp->last_instr] != OP_GET_GLOB) return -1;
+    return chunk->code[comp->last_instr + 1] | (chunk->code[comp->last_instr + 2] << 8);
+}
+
+static void emit_call_glob(compiler_t *comp, int global, uint8_t arg_count) {
+    int cache = chunk_add_cache(comp->vm, current_chunk(comp), (uint16_t)global);
+    if(cache > UINT16_MAX) {
+        error_at(comp->parser, previous(comp->parser), "too many calls in one bytecode unit");
+    }
+    emit_bytes(comp, OP_CALL_GLOB, arg_count);
+    emit_byte(comp, cache & 0xff);
+    emit_byte(comp, (cache >> 8) & 0xff);
+}
+
+// Returns the stack depth `fn`'s body returns with, if it can be copied into its callers: it must
+// be small, return only at the very end, and not call itself. Returns -1 otherwise.
+static int inline_depth(warp_vm_t *vm, warp_fn_t *fn, int global) {
+    const chunk_t *chunk = &fn->chunk;
+    if(!fn->verified || chunk->count - 1 > WARP_INLINE_MAX_SIZE) return -1;
+    
+    for(int i = 0; i < chunk->count; i += code_size[chunk->code[i]]) {
+        const uint8_t *code = chunk->code + i;
+        if(code[0] == OP_RETURN && i != chunk->count - 1) return -1;
+        if(code[0] == OP_GET_GLOB && (code[1] | (code[2] << 8)) == global) return -1;
+    }
+    
+    ir_fn_t ir;
+    ir_build(vm, &ir, &fn->chunk, fn->arity);
+    int depth = ir.code[ir.count - 1].depth;
+    ir_free(&ir);
+    return depth;
+}
+
+// Copies the body of `fn` to the end of the current chunk, with its slots moved up by `base`. The
+// copy keeps its own lines, with a note that it was inlined from `fn` at the current line.
+static void copy_body(compiler_t *comp, const warp_fn_t *fn, int base) {
+    warp_vm_t *vm = comp->vm;
+    chunk_t *chunk = current_chunk(comp);
+    const chunk_t *body = &fn->chunk;
+    int caller = previous(comp->parser)->line;
+    
+    for(int i = 0; i < body->count - 1; i += code_size[body->code[i]]) {
+        int line = chunk_inline_line(vm, chunk, body, fn->name, chunk_get_line(body, i), caller);
+        uint8_t code[5];
+        memcpy(code, body->code + i, code_size[body->code[i]]);
+        
+        switch(code[0]) {
+        case OP_CONST:
+        case OP_ADD_K:
+        case OP_SUB_K:
+            code[1] = chunk_add_const(vm, chunk, body->constants.data[code[1]]);
+            break;
+        
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_POP_LOCAL:
+            code[1] += base;
+            break;
+        
+        case OP_ADD_LL:
+            code[1] += base;
+            code[2] += base;
+            break;
+        
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK:
+        case OP_DIV_RK:
+            code[1] += base;
+            code[2] += base;
+            code[3] = chunk_add_const(vm, chunk, body->constants.data[code[3]]);
+            break;
+        
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+        case OP_DIV_RR:
+            code[1] += base;
+            code[2] += base;
+            code[3] += base;
+            break;
+        
+        case OP_GUARD_FN:
+            code[3] = chunk_add_const(vm, chunk, body->constants.data[code[3]]);
+            break;
+        
+        case OP_CALL_GLOB: {
+            int cache = chunk_add_cache(vm, chunk, body->caches.data[code[2] | (code[3] << 8)].global);
+            code[2] = cache & 0xff;
+            code[3] = (cache >> 8) & 0xff;
+            break;
+        }
+        
+        // The call's result is now what the inlined body evaluates to.
+        case OP_TAIL_CALL:
+            code[0] = OP_CALL;
+            break;
+        
+        case OP_LOOP:
+        case OP_LOOP_IF:
+        case OP_LT_LOOP_IF: {
+            int loop = chunk_add_loop(vm, chunk);
+            code[3] = loop & 0xff;
+            code[4] = (loop >> 8) & 0xff;
+            break;
+        }
+        
+        default:
+            break;
+        }
+        
+        // Jumps are relative, and everything is copied in one go, so they don't need fixing up.
+        for(int j = 0; j < code_size[code[0]]; ++j) {
+            chunk_write(vm, chunk, code[j], line);
+        }
+    }
+}
+
+// Calls to a global that was declared with a small function get a copy of that function's body,
+// which runs as long as the global still holds that function:
+//
+//      GET_GLOB    f
+//      <arguments>
+//      GUARD_FN    call, f, arg count
+//      <body of f> the callee and arguments are in slots `base` and up.
+//      BLOCK       size of the frame, so that only the result is left
+//      JMP         end
+// call:
+//      CALL_GLOB   f, arg count
+// end:
+//
+// Returns false, having emitted nothing, when the call can't be inlined.
+static bool inline_call(compiler_t *comp, int global, uint8_t arg_count, int num_slots) {
+    if(!(comp->vm->passes & WARP_PASS_INLINE)) return false;
+    warp_fn_t *fn = comp->vm->globals.data[global].inline_fn;
+    if(!fn || fn->arity != arg_count) return false;
+    
+    // Everything the body uses has to fit in the slots and constants one byte can address.
+    int base = 1 + comp->fn->arity + num_slots;
+    const chunk_t *chunk = current_chunk(comp);
+    if(base + (int)fn->max_slots > UINT8_COUNT) return false;
+    if(chunk->constants.count + fn->chunk.constants.count + 1 >= UINT8_MAX) return false;
+    
+    int depth = inline_depth(comp->vm, fn, global);
+    if(depth < 0) return false;
+    
+    int guard = emit_jump(comp, OP_GUARD_FN);
+    emit_byte(comp, chunk_add_const(comp->vm, current_chunk(comp), WARP_OBJ_VAL(fn)));
+    emit_byte(comp, arg_count);
+    
+    copy_body(comp, fn, base);
+    emit_bytes_long(comp, OP_BLOCK, depth - 1);
+    int end_jmp = emit_jump(comp, OP_JMP);
+    
+    patch_jump(comp, guard);
+    emit_call_glob(comp, global, arg_count);
+    patch_jump(comp, end_jmp);
+    
+    comp->num_slots = num_slots + 1;
+    if(num_slots + (int)fn->max_slots > comp->max_slots) {
+        comp->max_slots = num_slots + fn->max_slots;
+    }
+    return true;
+}
+
 static void call(compiler_t *comp, bool can_assign) {
     UNUSED(can_assign);
+    int global = callee_global(comp);
+    int num_slots = comp->num_slots - 1;
     uint8_t arg_count = arg_list(comp);
-    emit_bytes(comp, OP_CALL, arg_count);
+    
+    if(global < 0) {
+        emit_bytes(comp, OP_CALL, arg_count);
+    } else if(!inline_call(comp, global, arg_count, num_slots)) {
+        emit_call_glob(comp, global, arg_count);
+    }
+    // The callee and its arguments are replaced by the result.
+    comp->num_slots = num_slots + 1;
 }
 
 static bool check_end_block(parser_t *parser) {
     return check(parser, TOK_RBRACE) || check(parser, TOK_EOF);
 }
 
-static void block_body(compiler_t *comp) {
+// Compiles the statements of a block. Only the last one leaves its value on the stack, and only
+// when `keep_value` is set: loop bodies, for one, are run for their side effects alone.
+static void block_body(compiler_t *comp, bool keep_value) {
     // If we have an empty block, we must still make sure we return nil from that block;
-    if(check_end_block(comp->parser)) {
+    if(keep_value && check_end_block(comp->parser)) {
         emit_instr(comp, OP_NIL);
     }
     while(!check_end_block(comp->parser)) {
-        declaration(comp);
+        declaration(comp, keep_value);
     }
     consume(comp->parser, TOK_RBRACE, "missing '}' after block");
 }
@@ -467,8 +927,8 @@ static void block_body(compiler_t *comp) {
 static void block(compiler_t *comp, bool can_assign) {
     UNUSED(can_assign);
     begin_scope(comp);
-    block_body(comp);
-    end_scope(comp);
+    block_body(comp, true);
+    end_scope(comp, true);
 }
 
 static void if_(compiler_t *comp, bool can_assign);
@@ -479,8 +939,8 @@ static void if_then_expr(compiler_t *comp, int then_jmp) {
     int else_jmp = emit_jump(comp, OP_JMP);
     patch_jump(comp, then_jmp);
     
+    emit_instr(comp, OP_POP);
     if(match(comp->parser, TOK_ELSE)) {
-        emit_instr(comp, OP_POP);
         expression(comp);
     } else {
         emit_instr(comp, OP_NIL);
@@ -511,9 +971,53 @@ static void if_brace_expr(compiler_t *comp, int then_jmp) {
     patch_jump(comp, else_jmp);
 }
 
+// When the condition is a constant, only the branch it picks is kept. The other one still has to be
+// parsed, and checked for errors, but its code is thrown away.
+static void if_const(compiler_t *comp, bool taken) {
+    int start = current_chunk(comp)->count;
+    int num_slots = comp->num_slots;
+    
+    bool braces = match(comp->parser, TOK_LBRACE);
+    if(braces) {
+        block(comp, false);
+    } else if(match(comp->parser, TOK_THEN)) {
+        expression(comp);
+    } else {
+        error_at(comp->parser, current(comp->parser), "missing expression after 'if'");
+        return;
+    }
+    if(!taken) discard_code(comp, start, num_slots);
+    
+    start = current_chunk(comp)->count;
+    num_slots = comp->num_slots;
+    if(!match(comp->parser, TOK_ELSE)) {
+        emit_instr(comp, OP_NIL);
+    } else if(!braces) {
+        expression(comp);
+    } else if(match(comp->parser, TOK_LBRACE)) {
+        block(comp, false);
+    } else if(match(comp->parser, TOK_IF)) {
+        if_(comp, false);
+    } else {
+        error_at(comp->parser, current(comp->parser), "missing else expression");
+    }
+    if(!braces) consume(comp->parser, TOK_END, "missing 'end' after if-else expression");
+    if(taken) discard_code(comp, start, num_slots);
+}
+
 static void if_(compiler_t *comp, bool can_assign) {
     UNUSED(can_assign);
+    int start = current_chunk(comp)->count;
+    int num_slots = comp->num_slots;
     expression(comp);
+    
+    warp_value_t cond;
+    if(should_fold(comp) && emitted_const(comp, start, &cond)) {
+        discard_code(comp, start, num_slots);
+        if_const(comp, !value_is_falsey(cond));
+        return;
+    }
+    
     int then_jmp = emit_jump(comp, OP_JMP_FALSE);
     
     if(match(comp->parser, TOK_LBRACE)) {
@@ -528,17 +1032,31 @@ static void if_(compiler_t *comp, bool can_assign) {
 static void while_(compiler_t *comp, bool can_assign) {
     UNUSED(can_assign);
     
+    int num_slots = comp->num_slots;
     loop_t loop;
     open_loop(comp, &loop);
     expression(comp);
+    
+    // Constant conditions are better off folded than moved around.
+    warp_value_t cond;
+    bool is_const = emitted_const(comp, loop.start, &cond);
+    bool never_runs = should_fold(comp) && is_const && value_is_falsey(cond);
+    loop.rotate = (comp->vm->passes & WARP_PASS_LOOPS) && !is_const;
+    
     test_loop_jump(comp);
     start_loop_body(comp);
     
     emit_instr(comp, OP_POP);
     consume(comp->parser, TOK_LBRACE, "missing loop body");
-    block_body(comp);
+    block_body(comp, false);
     
     close_loop(comp);
+    
+    // A loop whose body never runs evaluates to nil straight away.
+    if(never_runs) {
+        discard_code(comp, loop.start, num_slots);
+        emit_instr(comp, OP_NIL);
+    }
 }
 
 static void continue_(compiler_t *comp, bool can_assign) {
@@ -546,8 +1064,13 @@ static void continue_(compiler_t *comp, bool can_assign) {
     if(!comp->loop) {
         error_at(comp->parser, previous(comp->parser), "'continue' outside of a loop body");
     }
-    drop_locals(comp, comp->loop->scope_depth - 1);
-    emit_loop(comp, comp->loop->start);
+    // Jumping out of the loop's scopes doesn't close them: the code that follows is still in there,
+    // so we only drop the locals from the stack.
+    int num_slots = count_locals(comp, comp->loop->scope_depth - 1);
+    if(num_slots > 0) {
+        emit_bytes_long(comp, OP_DROP, num_slots);
+    }
+    emit_loop(comp, OP_LOOP, comp->loop->start);
 }
 
 static void break_(compiler_t *comp, bool can_assign) {
@@ -562,7 +1085,7 @@ static void break_(compiler_t *comp, bool can_assign) {
         expression(comp);
     }
     
-    drop_locals(comp, comp->loop->scope_depth - 1);
+    emit_bytes_long(comp, OP_BLOCK, count_locals(comp, comp->loop->scope_depth - 1));
     emit_jump(comp, OP_ENDLOOP);
 }
 
@@ -702,19 +1225,14 @@ static void mark_initialized(compiler_t *comp) {
     comp->locals[comp->local_count - 1].depth = comp->scope_depth;
 }
 
-static void define_variable(compiler_t *comp, int idx, bool param) {
+// Locals live where their initializer left them, globals take it off the stack. Either way, a
+// declaration leaves no value behind: see declaration() for when one is needed.
+static void define_variable(compiler_t *comp, int idx) {
     if(comp->scope_depth > 0) {
         mark_initialized(comp);
-        /*
-        Because we're expression-oriented, every expression must leave its results
-        on top of the stack. This includes variable declarations, which, because of the
-        way the compiler is written, don't. So we need a GET_LOCAL instruction here so
-        we leave the stack as the rest of the language expects it.
-        */
-        if(!param) emit_instr(comp, OP_DUP);
         return;
     }
-    emit_bytes(comp, OP_DEF_GLOB, idx);
+    emit_bytes_long(comp, OP_DEF_GLOB, (uint16_t)idx);
 }
 
 static int parse_variable(compiler_t *comp, const char *msg) {
@@ -723,18 +1241,69 @@ static int parse_variable(compiler_t *comp, const char *msg) {
     declare_variable(comp);
     if(comp->scope_depth > 0) return 0;
     
-    return add_ident_const(comp, previous(comp->parser));
+    return resolve_global(comp, previous(comp->parser));
 }
 
-static void var_decl_stmt(compiler_t *comp) {
+static int var_decl_stmt(compiler_t *comp) {
     int global = parse_variable(comp, "missing variable name");
+    if(comp->scope_depth == 0) comp->vm->globals.data[global].inline_fn = NULL;
     
     consume(comp->parser, TOK_EQUALS, "missing variable initializer");
     expression(comp);
-    define_variable(comp, global, false);
+    define_variable(comp, global);
+    return global;
 }
 
-static void function(compiler_t *comp, const token_t *name, compiler_kind_t kind) {
+// Compiles a function's parameter list, up to the opening brace of its body.
+static void parameters(compiler_t *compiler) {
+    begin_scope(compiler);
+    consume(compiler->parser, TOK_LPAREN, "missing function parameter list");
+    if(!check(compiler->parser, TOK_RPAREN)) {
+        do {
+            compiler->fn->arity += 1;
+            if(compiler->fn->arity > UINT8_MAX) {
+                error_at(compiler->parser, previous(compiler->parser), "too many function parameters");
+            }
+            int idx = parse_variable(compiler, "missing parameter name");
+            define_variable(compiler, idx);
+        } while(match(compiler->parser, TOK_COMMA));
+    }
+    consume(compiler->parser, TOK_RPAREN, "missing ')' after function parameter list");
+    consume(compiler->parser, TOK_LBRACE, "missing function body");
+}
+
+// Skips the body of the function being compiled, whose parameter list starts at `start`, and keeps
+// its source around for compile_body(). Returns false, with the parser where it was, when the body
+// should be compiled right away instead.
+static bool defer_body(compiler_t *compiler, const char *start, int line) {
+    parser_t *parser = compiler->parser;
+    if(parser->had_error) return false;
+    
+    parser_t saved = *parser;
+    if(!skip_block(parser) || previous(parser)->start + 1 - start < WARP_LAZY_MIN_SIZE) {
+        *parser = saved;
+        return false;
+    }
+    
+    const char *line_start = start;
+    while(line_start > parser->source.start && line_start[-1] != '\n') line_start -= 1;
+    size_t length = (size_t)(previous(parser)->start + 1 - line_start);
+    const char *fname = parser->source.fname ? parser->source.fname : "";
+    
+    // The scanner can't read a token that ends right at the end of the source: add a line return.
+    lazy_body_t *body = ALLOCATE_SARRAY(compiler->vm, lazy_body_t, length + 2);
+    body->fname = warp_copy_c_str(compiler->vm, fname, strlen(fname));
+    body->line = line;
+    body->offset = (size_t)(start - line_start);
+    body->length = length + 1;
+    memcpy(body->source, line_start, length);
+    body->source[length] = '\n';
+    body->source[length + 1] = '\0';
+    compiler->fn->lazy = body;
+    return true;
+}
+
+static warp_fn_t *function(compiler_t *comp, const token_t *name, compiler_kind_t kind) {
     compiler_t compiler;
     compiler_init_nested(&compiler, comp, kind);
     
@@ -742,48 +1311,98 @@ static void function(compiler_t *comp, const token_t *name, compiler_kind_t kind
         compiler.fn->name = warp_copy_c_str(comp->vm, name->start, name->length);
     }
     
-    begin_scope(&compiler);
-    consume(compiler.parser, TOK_LPAREN, "missing function parameter list");
-    if(!check(compiler.parser, TOK_RPAREN)) {
-        do {
-            compiler.fn->arity += 1;
-            if(compiler.fn->arity > UINT8_MAX) {
-                error_at(compiler.parser, previous(compiler.parser), "too many function parameters");
-            }
-            uint8_t constant = parse_variable(&compiler, "missing parameter name");
-            define_variable(&compiler, constant, true);
-        } while(match(compiler.parser, TOK_COMMA));
-    }
-    consume(compiler.parser, TOK_RPAREN, "missing ')' after function parameter list");
-    consume(compiler.parser, TOK_LBRACE, "missing function body");
-    block_body(&compiler);
+    const token_t open = *current(comp->parser);
+    parameters(&compiler);
     
-    warp_fn_t *fn = end_compiler(&compiler);
+    warp_fn_t *fn = compiler.fn;
+    if(!comp->vm->lazy || !defer_body(&compiler, open.start, open.line)) {
+        block_body(&compiler, true);
+        fn = end_compiler(&compiler);
+    }
     emit_const(comp, WARP_OBJ_VAL(fn));
+    return fn;
 }
 
-static void fn_decl_stmt(compiler_t *comp) {
+static int fn_decl_stmt(compiler_t *comp) {
     int global = parse_variable(comp, "missing function name");
     mark_initialized(comp);
     
     token_t name = *previous(comp->parser);
     consume(comp->parser, TOK_EQUALS, "missing function initializer");
-    function(comp, &name, COMPILER_FUNC);
-    define_variable(comp, global, false);
+    warp_fn_t *fn = function(comp, &name, COMPILER_FUNC);
+    define_variable(comp, global);
+    
+    // Calls compiled from here on can inline the function, guarded in case the global changes.
+    if(comp->scope_depth == 0 && (comp->vm->passes & WARP_PASS_INLINE)) {
+        bool inline_ok = !comp->parser->had_error && inline_depth(comp->vm, fn, global) >= 0;
+        comp->vm->globals.data[global].inline_fn = inline_ok ? fn : NULL;
+    }
+    return global;
+}
+
+// Gets rid of the value the statement just compiled left on the stack. If it comes from the last
+// instruction, and nothing jumps past it, we can avoid producing it in the first place.
+static void drop_value(compiler_t *comp) {
+    chunk_t *chunk = current_chunk(comp);
+    int last = comp->last_instr;
+    bool at_end = last >= 0 && last + code_size[chunk->code[last]] == chunk->count;
+    if(!at_end || comp->last_target == chunk->count) {
+        emit_instr(comp, OP_POP);
+        return;
+    }
+    
+    switch(chunk->code[last]) {
+    // Loops without a `break` end with a NIL, assignments of arithmetic with a GET_LOCAL.
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_DUP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        discard_code(comp, last, comp->num_slots - 1);
+        break;
+    
+    case OP_SET_LOCAL:
+        chunk->code[last] = OP_POP_LOCAL;
+        comp->num_slots -= 1;
+        break;
+    
+    case OP_SET_GLOB:
+        chunk->code[last] = OP_POP_GLOB;
+        comp->num_slots -= 1;
+        break;
+    
+    default:
+        emit_instr(comp, OP_POP);
+        break;
+    }
 }
 
-static void declaration(compiler_t *comp) {
+// Compiles a statement. Whether it is the last one in its block, and so whether its value is used,
+// is only known once it is parsed: declarations push the variable they declared when it is, and
+// everything else has its value dropped when it isn't.
+static void declaration(compiler_t *comp, bool keep_value) {
+    bool is_decl = true;
+    int global = 0;
     if(match(comp->parser, TOK_VAR)) {
-        var_decl_stmt(comp);
+        global = var_decl_stmt(comp);
     } else if(match(comp->parser, TOK_FN)) {
-        fn_decl_stmt(comp);
+        global = fn_decl_stmt(comp);
     } else {
         expression(comp);
+        is_decl = false;
     }
     consume_terminator(comp->parser, "expected a line return or a semicolon");
     
-    if(!check_end_block(comp->parser)) {
-        emit_instr(comp, OP_POP);
+    bool used = keep_value && check_end_block(comp->parser);
+    if(is_decl && used) {
+        if(comp->scope_depth > 0) {
+            emit_instr(comp, OP_DUP);
+        } else {
+            emit_bytes_long(comp, OP_GET_GLOB, (uint16_t)global);
+        }
+    } else if(!is_decl && !used) {
+        drop_value(comp);
     }
     if(comp->parser->panic) synchronize(comp->parser);
 }
@@ -792,11 +1411,11 @@ warp_fn_t *compile(warp_vm_t *vm, const char *fname, const char *src, size_t len
     compiler_t comp;
     parser_t parser;
     parser_init(&parser, vm, fname, src, length);
-    compiler_init(&comp, vm, &parser, COMPILER_SCRIPT);
+    compiler_init(&comp, vm, &parser, COMPILER_SCRIPT, warp_fn_new(vm, WARP_FN_BYTECODE));
     
     advance(comp.parser);
     while(!match(comp.parser, TOK_EOF)) {
-        declaration(&comp);
+        declaration(&comp, true);
     }
     consume(comp.parser, TOK_EOF, "expected end of expression");
     warp_fn_t *fn = end_compiler(&comp);
@@ -804,3 +1423,35 @@ warp_fn_t *compile(warp_vm_t *vm, const char *fname, const char *src, size_t len
     return !parser.had_error ? fn : NULL;
 }
 
+bool compile_body(warp_vm_t *vm, warp_fn_t *fn) {
+    ASSERT(vm);
+    ASSERT(fn);
+    ASSERT(fn->lazy);
+    
+    // The body is compiled the way function() would have, parameters and all, but straight into
+    // `fn`: the constants and globals that refer to it already have it.
+    lazy_body_t *body = fn->lazy;
+    parser_t parser;
+    parser_init(&parser, vm, body->fname->data, body->source, body->length);
+    parser_seek(&parser, body->source + body->offset, body->line);
+    
+    compiler_t compiler;
+    compiler_init(&compiler, vm, &parser, COMPILER_FUNC, fn);
+    fn->lazy = NULL;
+    fn->arity = 0;
+    
+    advance(&parser);
+    parameters(&compiler);
+    block_body(&compiler, true);
+    end_compiler(&compiler);
+    
+    if(parser.had_error) {
+        chunk_fini(vm, &fn->chunk);
+        chunk_init(vm, &fn->chunk);
+        fn->lazy = body;
+        return false;
+    }
+    DEALLOCATE_SARRAY(vm, body, lazy_body_t, char, body->length + 1);
+    return true;
+}
+
@@ -10,4 +10,10 @@
 #include <warp/warp.h>
 #include "chunk.h"
 
+// Compiles a script. When the VM compiles function bodies lazily, those that are long enough are
+// only scanned for their end, and left for compile_body().
 warp_fn_t *compile(warp_vm_t *vm, const char *fname, const char *src, size_t length);
+
+// Compiles the body of `fn`, which the compiler skipped. Errors are reported as they would have
+// been when the script was compiled, and leave `fn` to be compiled again.
+bool compile_body(warp_vm_t *vm, warp_fn_t *fn);
@@ -52,10 +52,11 @@ int disassemble_instr(chunk_t *chunk, int offset, FILE *out) {
     ASSERT(offset < chunk->count);
     
     fprintf(out, "%04x: ", offset);
-    if(offset > 0 && chunk->lines[offset-1] == chunk->lines[offset]) {
+    int line = chunk_get_line(chunk, offset);
+    if(offset > 0 && chunk_get_line(chunk, offset-1) == line) {
         fprintf(out, "   | ");
     } else {
-        fprintf(out, "%4d ", chunk->lines[offset]);
+        fprintf(out, "%4d ", chunk_source_line(chunk, line));
     }
     
     uint8_t op = chunk->code[offset];
@@ -70,7 +71,7 @@ int disassemble_instr(chunk_t *chunk, int offset, FILE *out) {
         break;
     case 1:
         fprintf(out, "%-16s %02hhx", instr_data[op].name, chunk->code[offset+1]);
-        if(op == OP_CONST || op == OP_DEF_GLOB || op == OP_GET_GLOB || op == OP_SET_GLOB) {
+        if(op == OP_CONST || op == OP_ADD_K || op == OP_SUB_K) {
             uint8_t value_idx = chunk->code[offset+1];
             fprintf(out, "  (");
             warp_print_value(chunk->constants.data[value_idx], out);
@@ -80,8 +81,45 @@ int disassemble_instr(chunk_t *chunk, int offset, FILE *out) {
         }
         break;
     case 2:
+        if(op == OP_ADD_LL) {
+            fprintf(out, "%-16s r%d r%d\n", instr_data[op].name, chunk->code[offset+1], chunk->code[offset+2]);
+            break;
+        }
+        if(op == OP_DEF_GLOB || op == OP_GET_GLOB || op == OP_SET_GLOB || op == OP_POP_GLOB) {
+            fprintf(out, "%-16s g%d\n", instr_data[op].name, chunk->code[offset+1] | (chunk->code[offset+2] << 8));
+            break;
+        }
         fprintf(out, "%-16s %02hhx %02hhx\n", instr_data[op].name, chunk->code[offset+2], chunk->code[offset+1]);
         break;
+    case 3:
+        if(op == OP_CALL_GLOB) {
+            fprintf(out, "%-16s %02hhx  (cache %d)\n", instr_data[op].name, chunk->code[offset+1],
+                    chunk->code[offset+2] | (chunk->code[offset+3] << 8));
+            break;
+        }
+        fprintf(out, "%-16s r%d r%d", instr_data[op].name, chunk->code[offset+1], chunk->code[offset+2]);
+        if(op >= OP_ADD_RK && op <= OP_DIV_RK) {
+            uint8_t value_idx = chunk->code[offset+3];
+            fprintf(out, " k%d  (", value_idx);
+            warp_print_value(chunk->constants.data[value_idx], out);
+            fprintf(out, ")\n");
+        } else {
+            fprintf(out, " r%d\n", chunk->code[offset+3]);
+        }
+        break;
+    case 4:
+        if(op == OP_GUARD_FN) {
+            uint8_t value_idx = chunk->code[offset+3];
+            fprintf(out, "%-16s %02hhx %02hhx  (", instr_data[op].name,
+                    chunk->code[offset+2], chunk->code[offset+1]);
+            warp_print_value(chunk->constants.data[value_idx], out);
+            fprintf(out, ", %d args)\n", chunk->code[offset+4]);
+            break;
+        }
+        fprintf(out, "%-16s %02hhx %02hhx  (loop %d)\n", instr_data[op].name,
+                chunk->code[offset+2], chunk->code[offset+1],
+                chunk->code[offset+3] | (chunk->code[offset+4] << 8));
+        break;
     default:
         UNREACHABLE();
         break;
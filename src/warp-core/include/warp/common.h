@@ -26,6 +26,26 @@ extern "C" {
 #define DEBUG_PRINT_CODE 0
 #define DEBUG_TRACE_EXEC 0
 #define WARP_USE_NAN
+
+// Threaded dispatch needs the labels-as-values extension, so we fall back to the switch-based
+// interpreter loop on compilers that don't have it.
+#ifndef WARP_COMPUTED_GOTO
+    #define WARP_COMPUTED_GOTO 1
+#endif
+#if WARP_COMPUTED_GOTO && !defined(__GNUC__)
+    #undef WARP_COMPUTED_GOTO
+    #define WARP_COMPUTED_GOTO 0
+#endif
+
+// The baseline JIT emits x86-64 code for the System V ABI, and bakes NaN-boxed values straight
+// into the instruction stream. Anywhere else, everything runs in the interpreter.
+#ifndef WARP_JIT
+    #define WARP_JIT 0
+#endif
+#if WARP_JIT && !(defined(__x86_64__) && defined(__linux__) && defined(WARP_USE_NAN))
+    #undef WARP_JIT
+    #define WARP_JIT 0
+#endif
     
 #ifndef NDEBUG
     #define ASSERT(expr) UNUSED(expr)
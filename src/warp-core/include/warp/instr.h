@@ -7,6 +7,8 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +20,11 @@ typedef enum {
 } warp_opcode_t;
 #undef WARP_OP
 
+// Loop instructions jump back by the distance in their first operand, other jumps forward.
+static inline bool warp_jumps_back(uint8_t op) {
+    return op == OP_LOOP || op == OP_LOOP_IF || op == OP_LT_LOOP_IF;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
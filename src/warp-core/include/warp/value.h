@@ -54,22 +54,36 @@ static inline warp_value_t double2value(double value) {
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+
+// Numbers that fit in 32 bits can also be stored as ints, with this bit set on top of the quiet NaN
+// and the int in the low 32 bits. Ints and doubles are both numbers as far as the language goes.
+#define INT_BIT ((uint64_t)0x0002000000000000)
+#define INT_MASK (SIGN_BIT | QNAN | INT_BIT)
     
 #define WARP_NIL_VAL        ((warp_value_t)(QNAN | TAG_NIL))
 #define WARP_FALSE_VAL      ((warp_value_t)(QNAN | TAG_FALSE))
 #define WARP_TRUE_VAL       ((warp_value_t)(QNAN | TAG_TRUE))
 #define WARP_BOOL_VAL(val)  ((val) ? WARP_TRUE_VAL : WARP_FALSE_VAL)
 #define WARP_NUM_VAL(val)   (double2value(val))
+#define WARP_INT_VAL(val)   ((warp_value_t)(QNAN | INT_BIT | (uint32_t)(warp_int_t)(val)))
 #define WARP_OBJ_VAL(val)   (SIGN_BIT | QNAN | (uint64_t)((uintptr_t)(val)))
     
 #define WARP_AS_BOOL(val)   ((val) == WARP_TRUE_VAL)
-#define WARP_AS_NUM(val)    (value2double(val))
+#define WARP_AS_NUM(val)    (WARP_IS_INT(val) ? (double)WARP_AS_INT(val) : value2double(val))
+#define WARP_AS_INT(val)    ((warp_int_t)(uint32_t)(val))
 #define WARP_AS_OBJ(val)    ((warp_obj_t *)(uintptr_t)((val) & ~(SIGN_BIT | QNAN)))
 
 #define WARP_IS_NIL(val)    ((val) == WARP_NIL_VAL)
 #define WARP_IS_BOOL(val)   (((val) | 1) == WARP_TRUE_VAL)
-#define WARP_IS_NUM(val)    (((val) & QNAN) != QNAN)
+#define WARP_IS_DOUBLE(val) (((val) & QNAN) != QNAN)
+#define WARP_IS_INT(val)    (((val) & INT_MASK) == (QNAN | INT_BIT))
+#define WARP_IS_NUM(val)    (WARP_IS_DOUBLE(val) | WARP_IS_INT(val))
 #define WARP_IS_OBJ(val)    (((val) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+
+// Check both tags with a single branch, for the numeric fast paths in the VM. Two ints are checked
+// for first: arithmetic on them is what the fast paths are for.
+#define WARP_ARE_INTS(a, b) (WARP_IS_INT(a) & WARP_IS_INT(b))
+#define WARP_ARE_NUMS(a, b) (WARP_ARE_INTS(a, b) || (WARP_IS_NUM(a) & WARP_IS_NUM(b)))
     
 #else
     
@@ -87,15 +101,22 @@ struct warp_value_t {
 #define WARP_IS_NIL(val)    ((val).kind == VAL_NIL)
 #define WARP_IS_BOOL(val)   ((val).kind == VAL_BOOL)
 #define WARP_IS_NUM(val)    ((val).kind == VAL_NUM)
+#define WARP_IS_DOUBLE(val) WARP_IS_NUM(val)
+#define WARP_IS_INT(val)    (false)
 #define WARP_IS_OBJ(val)    ((val).kind == VAL_OBJ)
 
+#define WARP_ARE_INTS(a, b) (false)
+#define WARP_ARE_NUMS(a, b) (((a).kind == VAL_NUM) & ((b).kind == VAL_NUM))
+
 #define WARP_AS_BOOL(val)   ((val).as.boolean)
 #define WARP_AS_NUM(val)    ((val).as.num)
+#define WARP_AS_INT(val)    ((warp_int_t)(val).as.num)
 #define WARP_AS_OBJ(val)    ((val).as.obj)
 
 #define WARP_NIL_VAL        ((warp_value_t){VAL_NIL, {.num=0}})
 #define WARP_BOOL_VAL(val)  ((warp_value_t){VAL_BOOL, {.boolean=!!(val)}})
 #define WARP_NUM_VAL(val)   ((warp_value_t){VAL_NUM, {.num=(val)}})
+#define WARP_INT_VAL(val)   WARP_NUM_VAL((double)(val))
 #define WARP_OBJ_VAL(val)   ((warp_value_t){VAL_NUM, {.obj=(warp_obj_t *)(val)}})
     
 #endif
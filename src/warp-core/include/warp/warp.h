@@ -17,16 +17,42 @@
 extern "C" {
 #endif
     
-#ifndef WARP_STACK_MAX
-#define WARP_STACK_MAX (256)
-#endif
-
 typedef enum {
     WARP_OK,
     WARP_COMPILE_ERROR,
     WARP_RUNTIME_ERROR,
+    WARP_IO_ERROR,      // A bytecode file couldn't be written, or read back.
 } warp_result_t;
 
+// The ways a function can be run. Functions start out interpreted, and move up once they are hot.
+typedef enum {
+    WARP_TIER_INTERPRETED,
+    WARP_TIER_COMPILED,
+} warp_tier_t;
+
+// How much work the compiler puts into the code it emits. Each level runs the passes of the one
+// below it, and then some. Optimizations are opt-in: a configuration that doesn't pick a level gets
+// the bytecode the parser emits.
+typedef enum {
+    WARP_OPT_DEFAULT,   // Same as WARP_OPT_NONE.
+    WARP_OPT_NONE,      // The bytecode the parser emits, with only peephole rewrites.
+    WARP_OPT_BASIC,     // Constant folding and dead code elimination.
+    WARP_OPT_FULL,      // Copy propagation, dead stores, inlining, types and loops on top.
+} warp_opt_level_t;
+
+// The passes the compiler can run over a function before it emits its bytecode. None of them
+// changes what a script does. Calls that were inlined don't get frames when they run, but errors in
+// them still list them in the stack trace, with the line they failed on.
+typedef enum {
+    WARP_PASS_FOLD          = 1 << 0,
+    WARP_PASS_COPY_PROP     = 1 << 1,
+    WARP_PASS_DEAD_STORES   = 1 << 2,
+    WARP_PASS_DEAD_CODE     = 1 << 3,
+    WARP_PASS_INLINE        = 1 << 4,   // Small global functions, at the calls that follow them.
+    WARP_PASS_NUM_TYPES     = 1 << 5,   // Unchecked arithmetic on values proven to be numbers.
+    WARP_PASS_LOOPS         = 1 << 6,   // Loop rotation, invariant code motion, strength reduction.
+} warp_pass_t;
+
 typedef struct warp_cfg_t {
     void *(*allocator)(void *, size_t);
     struct {
@@ -34,8 +60,52 @@ typedef struct warp_cfg_t {
         void (*runtime_diag)(const char *message, void *);
         void *user_info;
     } diagnostics;
+    
+    // When to move a function to the next tier. Thresholds left at zero use the defaults. Lower
+    // thresholds reach peak speed sooner, at the cost of compiling functions that don't need it.
+    struct {
+        uint32_t call_threshold;        // Number of calls.
+        uint32_t backedge_threshold;    // Number of loop iterations, across all of its loops.
+        void (*transition)(const char *name, warp_tier_t from, warp_tier_t to, void *);
+        void *user_info;
+    } tiering;
+    
+    // How much room running code gets, in values and in calls. The value stack starts out with
+    // `initial_slots` and doubles whenever a call needs more, up to `max_slots`. Running out of
+    // either is a stack overflow. Sizes left at zero use the defaults.
+    struct {
+        uint32_t initial_slots;
+        uint32_t max_slots;
+        uint32_t max_frames;
+    } stack;
+    
+    // Which optimization passes the compiler runs. Passes in `disabled_passes` (WARP_PASS_* flags)
+    // are skipped whatever the level.
+    //
+    // With `lazy` set, function bodies are only compiled the first time the function is called, and
+    // errors in them are reported then, as a runtime error of the call. warp_check() compiles all
+    // of a script to find them up front.
+    //
+    // With a `cache_dir`, warp_interpret() keeps the code it compiles there, and loads it back
+    // instead of compiling the same source again. The directory can be shared by any number of
+    // processes, and is trimmed down to `cache_size` bytes (64MB if left at zero) as it fills up.
+    struct {
+        warp_opt_level_t level;
+        uint32_t disabled_passes;
+        bool lazy;
+        const char *cache_dir;
+        size_t cache_size;
+    } compiler;
 } warp_cfg_t;
 
+// What the compile cache did for a VM. The hit rate is `hits / (hits + misses)`.
+typedef struct {
+    uint32_t hits;          // Scripts loaded from the cache.
+    uint32_t misses;        // Scripts compiled because the cache didn't have them.
+    uint32_t writes;        // Scripts added to the cache.
+    uint32_t evictions;     // Entries deleted to keep the cache within its size.
+} warp_cache_stats_t;
+
 /**
  * Creates and resets a new Warp virtual machine.
  *
@@ -55,7 +125,74 @@ void warp_vm_destroy(warp_vm_t *vm);
 void warp_register_native(warp_vm_t *vm, const char *name, uint8_t arity, warp_native_f fn);
 warp_result_t warp_run(warp_vm_t *vm);
 warp_result_t warp_interpret(warp_vm_t *vm, const char *fname, const char *source, size_t length);
+
+/**
+ * Compiles a script, function bodies included whether the VM compiles them lazily or not, without
+ * running it. Errors are reported to the VM's diagnostics.
+ *
+ * @param vm The VM to compile with.
+ * @param fname The name of the script, used in diagnostics.
+ * @param source The source code of the script.
+ * @param length The length of the source code.
+ * @return WARP_OK if the script compiles, WARP_COMPILE_ERROR otherwise.
+ */
+warp_result_t warp_check(warp_vm_t *vm, const char *fname, const char *source, size_t length);
+
+/**
+ * Compiles a script and saves its bytecode to a .warpc file, without running it.
+ *
+ * @param vm The VM to compile with. Its optimization options apply to the saved code.
+ * @param fname The name of the script, used in diagnostics.
+ * @param source The source code of the script.
+ * @param length The length of the source code.
+ * @param out_path Where to write the bytecode file.
+ * @return WARP_OK if the file was written, WARP_COMPILE_ERROR or WARP_IO_ERROR otherwise.
+ */
+warp_result_t warp_compile_file(warp_vm_t *vm, const char *fname, const char *source, size_t length,
+                                const char *out_path);
+
+/**
+ * Runs a script from a .warpc file, written by warp_compile_file() with the same version of Warp.
+ * The file is mapped into memory rather than read, and stays mapped until the VM is destroyed.
+ *
+ * @param vm The VM to run the script in.
+ * @param path The bytecode file to run.
+ * @return The result of running the script, or WARP_IO_ERROR if the file could not be loaded.
+ */
+warp_result_t warp_run_file(warp_vm_t *vm, const char *path);
+
+/**
+ * Saves the state of a VM to an image file: its globals, and the strings and functions they refer
+ * to. What is on the stack isn't saved. Native functions are saved by name and arity only.
+ *
+ * @param vm The VM to save, usually after it has run its prelude scripts.
+ * @param path Where to write the image.
+ * @return WARP_OK if the image was written, WARP_IO_ERROR otherwise.
+ */
+warp_result_t warp_save_image(warp_vm_t *vm, const char *path);
+
+/**
+ * Restores the globals saved in an image by warp_save_image() with the same version of Warp. Call
+ * it on a new VM, once the natives the image refers to are registered: they are bound by name. As
+ * with warp_run_file(), the image is mapped into memory, and code is used from it in place.
+ *
+ * @param vm The VM to load the image into.
+ * @param path The image file to load.
+ * @return WARP_OK if the image was loaded, WARP_IO_ERROR otherwise.
+ */
+warp_result_t warp_load_image(warp_vm_t *vm, const char *path);
+
+/**
+ * Reads what the compile cache has done since the VM was created. Without a cache directory, or
+ * when Warp is built without the cache, every count stays at zero.
+ *
+ * @param vm The VM to read the counts of.
+ * @param out Where to write the counts.
+ */
+void warp_get_cache_stats(warp_vm_t *vm, warp_cache_stats_t *out);
+
 bool warp_get_slot(warp_vm_t *vm, int slot, warp_value_t *out);
+bool warp_get_global(warp_vm_t *vm, const char *name, warp_value_t *out);
 
 #ifdef __cplusplus
 } // extern "C"
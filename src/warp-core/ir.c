@@ -0,0 +1,342 @@
+//===--------------------------------------------------------------------------------------------===
+// ir.c - Basic-block representation of a function's bytecode
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "ir.h"
+#include "buffers.h"
+#include <string.h>
+
+#define WARP_OP(code, op_size, _) [OP_##code] = op_size+1,
+static const int code_size[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+static inline int read_16(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+void ir_build(warp_vm_t *vm, ir_fn_t *ir, chunk_t *chunk, int arity) {
+    ASSERT(vm);
+    ASSERT(ir);
+    ASSERT(chunk);
+
+    ir->vm = vm;
+    ir->chunk = chunk;
+    ir->arity = arity;
+    ir->count = 0;
+    ir->blocks = NULL;
+    ir->block_count = 0;
+
+    int *index = ALLOCATE_ARRAY(vm, int, chunk->count + 1);
+    for(int i = 0; i < chunk->count; i += code_size[chunk->code[i]]) {
+        index[i] = ir->count++;
+    }
+    index[chunk->count] = ir->count;
+
+    ir->code = ALLOCATE_ARRAY(vm, ir_instr_t, ir->count);
+    for(int i = 0, n = 0; i < chunk->count; i += code_size[chunk->code[i]], ++n) {
+        ir_instr_t *instr = &ir->code[n];
+        const uint8_t *code = chunk->code + i;
+
+        instr->op = code[0];
+        for(int j = 0; j < 4; ++j) {
+            instr->args[j] = j + 1 < code_size[code[0]] ? code[j + 1] : 0;
+        }
+        instr->line = chunk_get_line(chunk, i);
+        instr->target = -1;
+        instr->depth = -1;
+        instr->block = -1;
+        instr->removed = false;
+
+        if(ir_is_jump(code[0])) {
+            int next = i + code_size[code[0]];
+            int jmp = read_16(code + 1);
+            instr->target = index[warp_jumps_back(code[0]) ? next - jmp : next + jmp];
+        }
+    }
+    FREE_ARRAY(vm, index, int, chunk->count + 1);
+    ir_update(ir);
+}
+
+void ir_free(ir_fn_t *ir) {
+    ASSERT(ir);
+    FREE_ARRAY(ir->vm, ir->code, ir_instr_t, ir->count);
+    FREE_ARRAY(ir->vm, ir->blocks, ir_block_t, ir->count);
+    ir->code = NULL;
+    ir->blocks = NULL;
+    ir->count = 0;
+    ir->block_count = 0;
+}
+
+int ir_next(const ir_fn_t *ir, int idx) {
+    do {
+        idx += 1;
+    } while(idx < ir->count && ir->code[idx].removed);
+    return idx;
+}
+
+int ir_prev_in_block(const ir_fn_t *ir, int idx) {
+    const ir_block_t *block = &ir->blocks[ir->code[idx].block];
+    for(int i = idx - 1; i >= block->start; --i) {
+        if(!ir->code[i].removed) return i;
+    }
+    return -1;
+}
+
+int ir_insert(ir_fn_t *ir, int idx, int count) {
+    ASSERT(ir);
+    ASSERT(idx >= 0 && idx <= ir->count);
+    FREE_ARRAY(ir->vm, ir->blocks, ir_block_t, ir->count);
+    ir->blocks = NULL;
+    ir->block_count = 0;
+    
+    int line = idx < ir->count ? ir->code[idx].line : (idx > 0 ? ir->code[idx-1].line : 0);
+    ir->code = GROW_ARRAY(ir->vm, ir->code, ir_instr_t, ir->count, (ir->count + count));
+    memmove(&ir->code[idx + count], &ir->code[idx], (ir->count - idx) * sizeof(ir_instr_t));
+    ir->count += count;
+    
+    for(int i = 0; i < ir->count; ++i) {
+        if(ir->code[i].target >= idx) ir->code[i].target += count;
+    }
+    for(int i = idx; i < idx + count; ++i) {
+        ir->code[i] = (ir_instr_t){.op=OP_POP, .line=line, .target=-1, .depth=-1, .block=-1};
+    }
+    return idx;
+}
+
+ir_stack_use_t ir_stack_use(const ir_instr_t *instr) {
+    switch(instr->op) {
+    case OP_CONST:
+    case OP_GET_GLOB:
+    case OP_GET_LOCAL:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        return (ir_stack_use_t){.reads=0, .pops=0, .pushes=1};
+
+    case OP_DUP:
+        return (ir_stack_use_t){.reads=1, .pops=0, .pushes=1};
+
+    case OP_SET_GLOB:
+    case OP_SET_LOCAL:
+    case OP_PRINT:
+    case OP_JMP_FALSE:
+        return (ir_stack_use_t){.reads=1, .pops=0, .pushes=0};
+
+    case OP_DEF_GLOB:
+    case OP_POP_GLOB:
+    case OP_POP_LOCAL:
+    case OP_LOOP_IF:
+        return (ir_stack_use_t){.reads=1, .pops=1, .pushes=0};
+
+    case OP_POP:
+        return (ir_stack_use_t){.reads=0, .pops=1, .pushes=0};
+
+    case OP_NEG:
+    case OP_NOT:
+    case OP_ADD_K:
+    case OP_SUB_K:
+        return (ir_stack_use_t){.reads=1, .pops=1, .pushes=1};
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POW:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_EQ:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+        return (ir_stack_use_t){.reads=2, .pops=2, .pushes=1};
+
+    case OP_LT_JMP_FALSE:
+    case OP_LT_LOOP_IF:
+        return (ir_stack_use_t){.reads=2, .pops=2, .pushes=0};
+
+    case OP_ADD_LL:
+        return (ir_stack_use_t){.reads=0, .pops=0, .pushes=1};
+
+    // The value on top is kept, over the locals that are dropped from under it.
+    case OP_BLOCK: {
+        int count = read_16(instr->args);
+        return (ir_stack_use_t){.reads=1, .pops=count + 1, .pushes=1};
+    }
+
+    case OP_DROP:
+        return (ir_stack_use_t){.reads=0, .pops=read_16(instr->args), .pushes=0};
+
+    case OP_CALL:
+    case OP_CALL_GLOB:
+    case OP_TAIL_CALL:
+        return (ir_stack_use_t){.reads=instr->args[0] + 1, .pops=instr->args[0] + 1, .pushes=1};
+
+    case OP_GUARD_FN:
+        return (ir_stack_use_t){.reads=instr->args[3] + 1, .pops=0, .pushes=0};
+
+    case OP_RETURN:
+        return (ir_stack_use_t){.reads=1, .pops=1, .pushes=0};
+
+    default:
+        return (ir_stack_use_t){.reads=0, .pops=0, .pushes=0};
+    }
+}
+
+// A jump to an instruction that has been removed ends up at whatever follows it.
+static int live_target(const ir_fn_t *ir, int target) {
+    while(target < ir->count && ir->code[target].removed) target += 1;
+    return target;
+}
+
+static bool ends_block(uint8_t op) {
+    return ir_is_jump(op) || op == OP_RETURN;
+}
+
+static void find_blocks(ir_fn_t *ir) {
+    bool *leader = ALLOCATE_ARRAY(ir->vm, bool, ir->count + 1);
+    for(int i = 0; i <= ir->count; ++i) {
+        leader[i] = false;
+    }
+
+    bool after_jump = true;
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+        if(after_jump) leader[i] = true;
+        after_jump = ends_block(instr->op);
+        if(instr->target >= 0) {
+            instr->target = live_target(ir, instr->target);
+            leader[instr->target] = true;
+        }
+    }
+
+    ir->block_count = 0;
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(leader[i] && !instr->removed) {
+            if(ir->block_count > 0) ir->blocks[ir->block_count - 1].end = i;
+            ir->blocks[ir->block_count++] = (ir_block_t){.start=i, .end=ir->count, .succ={-1, -1}};
+        }
+        instr->block = ir->block_count - 1;
+    }
+
+    for(int b = 0; b < ir->block_count; ++b) {
+        ir_block_t *block = &ir->blocks[b];
+        int last = block->end - 1;
+        while(ir->code[last].removed) last -= 1;
+
+        const ir_instr_t *instr = &ir->code[last];
+        int next = b + 1 < ir->block_count ? b + 1 : -1;
+        switch(instr->op) {
+        case OP_RETURN:
+            break;
+        case OP_JMP:
+        case OP_LOOP:
+            block->succ[0] = ir->code[instr->target].block;
+            break;
+        case OP_JMP_FALSE:
+        case OP_LT_JMP_FALSE:
+        case OP_GUARD_FN:
+        case OP_LOOP_IF:
+        case OP_LT_LOOP_IF:
+            block->succ[0] = next;
+            block->succ[1] = ir->code[instr->target].block;
+            break;
+        default:
+            block->succ[0] = next;
+            break;
+        }
+    }
+    FREE_ARRAY(ir->vm, leader, bool, ir->count + 1);
+}
+
+static void find_depths(ir_fn_t *ir) {
+    for(int i = 0; i < ir->count; ++i) {
+        ir->code[i].depth = -1;
+    }
+    if(ir->block_count == 0) return;
+
+    i32_buf_t work;
+    i32_buf_init(&work);
+    ir->code[ir->blocks[0].start].depth = 1 + ir->arity;
+    i32_buf_write(ir->vm, &work, 0);
+
+    while(work.count > 0) {
+        const ir_block_t *block = &ir->blocks[work.data[--work.count]];
+        int depth = ir->code[block->start].depth;
+
+        for(int i = block->start; i < block->end; ++i) {
+            ir_instr_t *instr = &ir->code[i];
+            if(instr->removed) continue;
+            instr->depth = depth;
+            ir_stack_use_t use = ir_stack_use(instr);
+            depth += use.pushes - use.pops;
+        }
+
+        for(int i = 0; i < 2; ++i) {
+            if(block->succ[i] < 0) continue;
+            ir_instr_t *first = &ir->code[ir->blocks[block->succ[i]].start];
+            if(first->depth >= 0) continue;
+            first->depth = depth;
+            i32_buf_write(ir->vm, &work, block->succ[i]);
+        }
+    }
+    i32_buf_fini(ir->vm, &work);
+}
+
+void ir_update(ir_fn_t *ir) {
+    ASSERT(ir);
+    if(!ir->blocks) ir->blocks = ALLOCATE_ARRAY(ir->vm, ir_block_t, ir->count);
+    find_blocks(ir);
+    find_depths(ir);
+}
+
+void ir_lower(ir_fn_t *ir) {
+    ASSERT(ir);
+    chunk_t *chunk = ir->chunk;
+
+    int *offset = ALLOCATE_ARRAY(ir->vm, int, ir->count + 1);
+    int size = 0;
+    for(int i = 0; i < ir->count; ++i) {
+        offset[i] = size;
+        if(!ir->code[i].removed) size += code_size[ir->code[i].op];
+    }
+    offset[ir->count] = size;
+
+    chunk->count = 0;
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+
+        if(instr->target >= 0) {
+            int next = offset[i] + code_size[instr->op];
+            int target = offset[live_target(ir, instr->target)];
+            int jmp = warp_jumps_back(instr->op) ? next - target : target - next;
+            ASSERT(jmp >= 0 && jmp <= UINT16_MAX);
+            instr->args[0] = jmp & 0xff;
+            instr->args[1] = (jmp >> 8) & 0xff;
+        }
+
+        chunk_write(ir->vm, chunk, instr->op, instr->line);
+        for(int j = 1; j < code_size[instr->op]; ++j) {
+            chunk_write(ir->vm, chunk, instr->args[j - 1], instr->line);
+        }
+    }
+    ASSERT(chunk->count == size);
+    FREE_ARRAY(ir->vm, offset, int, ir->count + 1);
+}
@@ -0,0 +1,86 @@
+//===--------------------------------------------------------------------------------------------===
+// ir.h - Basic-block representation of a function's bytecode
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include <warp/instr.h>
+#include "chunk.h"
+
+// One instruction, with its operands decoded. Jumps refer to the instruction they go to by index
+// rather than by offset, so passes can rewrite and drop instructions without fixing up any jumps.
+typedef struct {
+    uint8_t     op;
+    uint8_t     args[4];
+    int         line;
+    int         target;     // Index of the instruction a jump goes to, or -1.
+    int         depth;      // Stack depth before the instruction runs, or -1 if it never runs.
+    int         block;      // Index of the basic block the instruction is in.
+    bool        removed;
+} ir_instr_t;
+
+// A run of instructions that is only ever entered at the top and left at the bottom.
+typedef struct {
+    int         start;      // First instruction.
+    int         end;        // One past the last instruction.
+    int         succ[2];    // Blocks control can go to afterwards, or -1.
+} ir_block_t;
+
+typedef struct {
+    warp_vm_t   *vm;
+    chunk_t     *chunk;
+    int         arity;
+
+    ir_instr_t  *code;
+    int         count;
+
+    ir_block_t  *blocks;
+    int         block_count;
+} ir_fn_t;
+
+// How an instruction uses the stack, when it runs with `depth` values on it: it reads the top
+// `reads` values, drops the top `pops` and then pushes `pushes` new ones.
+typedef struct {
+    int         reads;
+    int         pops;
+    int         pushes;
+} ir_stack_use_t;
+
+// Decodes `chunk`, which must be complete (no unpatched breaks) and valid, into `ir`.
+void ir_build(warp_vm_t *vm, ir_fn_t *ir, chunk_t *chunk, int arity);
+
+// Recomputes the basic blocks and stack depths, once a pass has changed the instructions. Code that
+// can't be reached is left with a depth of -1.
+void ir_update(ir_fn_t *ir);
+
+// Encodes the instructions that are left back into the chunk `ir` was built from.
+void ir_lower(ir_fn_t *ir);
+
+void ir_free(ir_fn_t *ir);
+
+ir_stack_use_t ir_stack_use(const ir_instr_t *instr);
+
+// Makes room for `count` new instructions before `idx`, and returns the index of the first one.
+// Jumps to `idx` still go to the instruction that was there. The new instructions are left as POPs
+// for the caller to fill in, before it calls ir_update().
+int ir_insert(ir_fn_t *ir, int idx, int count);
+
+// Returns the next instruction after `idx` that hasn't been removed, or `ir->count`.
+int ir_next(const ir_fn_t *ir, int idx);
+
+// Returns the instruction before `idx` in the same block that hasn't been removed, or -1.
+int ir_prev_in_block(const ir_fn_t *ir, int idx);
+
+static inline bool ir_is_jump(uint8_t op) {
+    return op == OP_JMP
+        || op == OP_JMP_FALSE
+        || op == OP_LOOP
+        || op == OP_LOOP_IF
+        || op == OP_LT_JMP_FALSE
+        || op == OP_LT_LOOP_IF
+        || op == OP_GUARD_FN;
+}
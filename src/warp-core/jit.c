@@ -0,0 +1,1617 @@
+//===--------------------------------------------------------------------------------------------===
+// jit.c - Baseline x86-64 compiler for Warp functions
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include "buffers.h"
+#include "tier.h"
+#include "value_impl.h"
+#include "types/obj_impl.h"
+#include <warp/instr.h>
+#include <sys/mman.h>
+#include <string.h>
+
+// This is a baseline compiler: every bytecode instruction turns into a fixed sequence of machine
+// code, with no analysis across instructions. Stack shuffling, locals, branches and arithmetic on
+// numbers are emitted inline. Everything else -- and the slow paths of the inline instructions --
+// call back into jit_helper(), which does what the interpreter would.
+//
+// The same templates compile traces of hot loops. A trace is one iteration of the loop as the
+// recorder saw it run: branches only go the way they went then, and arithmetic only handles the
+// kind of operands it had then. Anything else leaves the trace through a side exit, and the
+// interpreter picks up from the instruction the trace couldn't handle.
+
+#define WARP_OP(code, op_size, _) [OP_##code] = op_size+1,
+static const int code_size[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+// Registers, numbered the way instructions encode them.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1 };
+
+// Condition codes, for jcc and cmovcc.
+enum {
+    CC_O = 0x0, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+};
+
+// The top half of an int value, tag and all.
+#define INT_TAG_HI  ((int32_t)((QNAN | INT_BIT) >> 32))
+
+// Compiled code keeps the VM, the frame, the top of the stack and the frame's slots in callee-saved
+// registers. The stack pointer is written back to the VM around every helper call.
+#define REG_VM      RBX
+#define REG_FRAME   R12
+#define REG_SP      R13
+#define REG_SLOTS   R14
+
+#define OFFSET(T, field) ((int32_t)offsetof(T, field))
+
+#define VM_SP           OFFSET(warp_vm_t, sp)
+#define VM_STACK_END    OFFSET(warp_vm_t, stack_end)
+#define VM_FRAME_COUNT  OFFSET(warp_vm_t, frame_count)
+#define VM_MAX_FRAMES   OFFSET(warp_vm_t, max_frames)
+#define VM_GLOBALS      (OFFSET(warp_vm_t, globals) + OFFSET(global_buf_t, data))
+#define FRAME_FN        OFFSET(call_frame_t, fn)
+#define FRAME_IP        OFFSET(call_frame_t, ip)
+#define FRAME_SLOTS     OFFSET(call_frame_t, slots)
+#define FN_CODE         (OFFSET(warp_fn_t, chunk) + OFFSET(chunk_t, code))
+#define FN_JIT          OFFSET(warp_fn_t, jit)
+#define FN_MAX_SLOTS    OFFSET(warp_fn_t, max_slots)
+#define CACHE_VERSION   OFFSET(call_cache_t, version)
+#define CACHE_FN        OFFSET(call_cache_t, fn)
+#define GLOBAL_VERSION  OFFSET(global_t, version)
+
+typedef jit_status_t (*jit_entry_t)(warp_vm_t *vm, call_frame_t *frame);
+typedef int (*trace_entry_t)(warp_vm_t *vm, call_frame_t *frame);
+
+// What the recorder saw when an instruction ran.
+#define SEEN_NUMS   (1 << 0)    // All of the instruction's operands were numbers.
+#define SEEN_INTS   (1 << 1)    // ... and they were all ints.
+
+typedef enum {
+    NUM_ADD,
+    NUM_SUB,
+    NUM_MUL,
+    NUM_DIV,
+    NUM_LT,
+    NUM_GT,
+    NUM_LTEQ,
+    NUM_GTEQ,
+} num_op_t;
+
+typedef struct {
+    warp_vm_t       *vm;
+    const chunk_t   *chunk;
+    u8_buf_t        code;
+    
+    int             *labels;    // Native offset of each instruction, by bytecode offset.
+    i32_buf_t       jumps;      // Pairs of (offset of a rel32 to patch, bytecode offset of target).
+    i32_buf_t       exits;      // Offsets of the rel32s taken when a helper doesn't continue.
+    i32_buf_t       side_exits; // Offsets of the rel32s that leave a trace.
+    
+    // Only used when compiling a trace.
+    bool            trace;
+    uint8_t         seen;       // What the recorder saw when the current instruction ran.
+    int             next;       // Offset of the instruction that ran after the current one.
+} jit_t;
+
+// MARK: - Runtime helpers
+
+// The slow path for any instruction. `operands` packs the bytes that follow the opcode, `offset` is
+// where the instruction is in the chunk, so runtime errors point at the right line.
+static jit_status_t jit_helper(
+    warp_vm_t *vm,
+    call_frame_t *frame,
+    int op,
+    uint32_t operands,
+    int offset
+) {
+    frame->ip = frame->fn->chunk.code + offset + 1;
+    warp_value_t *consts = frame->fn->chunk.constants.data;
+    warp_value_t *slots = frame->slots;
+    uint8_t a = operands & 0xff;
+    uint8_t b = (operands >> 8) & 0xff;
+    uint8_t c = (operands >> 16) & 0xff;
+    uint16_t u16 = operands & 0xffff;
+
+#define PUSH(value) (*vm->sp++ = (value))
+#define POP() (*(--vm->sp))
+#define PEEK(offset) (vm->sp[-1 - (offset)])
+
+#define RUNTIME_ERROR(...)                                                                         \
+    do {                                                                                           \
+        vm_runtime_error(vm, __VA_ARGS__);                                                         \
+        return JIT_ERROR;                                                                          \
+    } while(0)
+
+#define BINARY(fn, op)                                                                             \
+    do {                                                                                           \
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {                                                     \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        warp_value_t rhs = POP();                                                                  \
+        warp_value_t lhs = POP();                                                                  \
+        PUSH(value_##fn(lhs, rhs));                                                                \
+    } while(0)
+
+#define COMPARE(op)                                                                                \
+    do {                                                                                           \
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {                                                     \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        warp_value_t rhs = POP();                                                                  \
+        warp_value_t lhs = POP();                                                                  \
+        PUSH(WARP_BOOL_VAL(VALUE_COMPARE(lhs, op, rhs)));                                          \
+    } while(0)
+
+#define REGISTER_BINARY(fn, op, operand)                                                           \
+    do {                                                                                           \
+        warp_value_t lhs = slots[b];                                                               \
+        warp_value_t rhs = (operand);                                                              \
+        if(!WARP_ARE_NUMS(lhs, rhs)) {                                                             \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        slots[a] = value_##fn(lhs, rhs);                                                           \
+    } while(0)
+
+#define GENERIC_ADD(dst, lhs, rhs)                                                                 \
+    do {                                                                                           \
+        if(WARP_ARE_NUMS(lhs, rhs)) {                                                              \
+            (dst) = value_add(lhs, rhs);                                                           \
+        } else if(WARP_IS_STR(lhs) && WARP_IS_STR(rhs)) {                                          \
+            (dst) = WARP_OBJ_VAL(warp_concat_str(vm, WARP_AS_STR(lhs), WARP_AS_STR(rhs)));         \
+        } else {                                                                                   \
+            RUNTIME_ERROR("invalid operands to `+'");                                              \
+        }                                                                                          \
+    } while(0)
+    
+    switch((warp_opcode_t)op) {
+    case OP_DEF_GLOB: {
+        global_t *global = &vm->globals.data[u16];
+        global->value = POP();
+        global->version += 1;
+        global->defined = true;
+        break;
+    }
+    
+    case OP_GET_GLOB: {
+        global_t *global = &vm->globals.data[u16];
+        if(!global->defined) {
+            RUNTIME_ERROR("undefined global variable '%s'", global->name->data);
+        }
+        PUSH(global->value);
+        break;
+    }
+    
+    case OP_SET_GLOB: {
+        global_t *global = &vm->globals.data[u16];
+        if(!global->defined) {
+            RUNTIME_ERROR("undefined global variable '%s'", global->name->data);
+        }
+        global->value = PEEK(0);
+        global->version += 1;
+        break;
+    }
+    
+    case OP_NEG: {
+        if(!WARP_IS_NUM(PEEK(0))) {
+            RUNTIME_ERROR("invalid operands to `-'");
+        }
+        PEEK(0) = value_neg(PEEK(0));
+        break;
+    }
+    
+    case OP_NOT: {
+        warp_value_t val = POP();
+        PUSH(WARP_BOOL_VAL(value_is_falsey(val)));
+        break;
+    }
+    
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR: {
+        warp_value_t rhs = POP();
+        warp_value_t lhs = PEEK(0);
+        GENERIC_ADD(PEEK(0), lhs, rhs);
+        break;
+    }
+    
+    case OP_SUB: BINARY(sub, -); break;
+    case OP_MUL: BINARY(mul, *); break;
+    case OP_DIV: BINARY(div, /); break;
+    case OP_LT: COMPARE(<); break;
+    case OP_GT: COMPARE(>); break;
+    case OP_LTEQ: COMPARE(<=); break;
+    case OP_GTEQ: COMPARE(>=); break;
+    
+    case OP_EQ: {
+        warp_value_t rhs = POP();
+        warp_value_t lhs = POP();
+        PUSH(WARP_BOOL_VAL(value_equals(lhs, rhs)));
+        break;
+    }
+    
+    case OP_ADD_RR: GENERIC_ADD(slots[a], slots[b], slots[c]); break;
+    case OP_ADD_RK: GENERIC_ADD(slots[a], slots[b], consts[c]); break;
+    case OP_SUB_RR: REGISTER_BINARY(sub, -, slots[c]); break;
+    case OP_MUL_RR: REGISTER_BINARY(mul, *, slots[c]); break;
+    case OP_DIV_RR: REGISTER_BINARY(div, /, slots[c]); break;
+    case OP_SUB_RK: REGISTER_BINARY(sub, -, consts[c]); break;
+    case OP_MUL_RK: REGISTER_BINARY(mul, *, consts[c]); break;
+    case OP_DIV_RK: REGISTER_BINARY(div, /, consts[c]); break;
+    
+    case OP_ADD_LL: {
+        warp_value_t result = WARP_NIL_VAL;
+        GENERIC_ADD(result, slots[a], slots[b]);
+        PUSH(result);
+        break;
+    }
+    
+    case OP_ADD_K: {
+        warp_value_t lhs = PEEK(0);
+        GENERIC_ADD(PEEK(0), lhs, consts[a]);
+        break;
+    }
+    
+    case OP_SUB_K:
+        if(!WARP_ARE_NUMS(PEEK(0), consts[a])) {
+            RUNTIME_ERROR("Invalid operands to - operator");
+        }
+        PEEK(0) = value_sub(PEEK(0), consts[a]);
+        break;
+    
+    case OP_PRINT:
+        warp_print_value(PEEK(0), stdout);
+        break;
+    
+    case OP_CALL:
+        if(!vm_call_value(vm, PEEK(a), a)) return JIT_ERROR;
+        break;
+    
+    case OP_CALL_GLOB: {
+        call_cache_t *cache = &frame->fn->chunk.caches.data[operands >> 8];
+        global_t *global = &vm->globals.data[cache->global];
+        if(cache->version == global->version) {
+            if(!vm_call_fn(vm, cache->fn, a)) return JIT_ERROR;
+            break;
+        }
+        
+        warp_value_t callee = PEEK(a);
+        if(WARP_IS_FN(callee)
+           && WARP_AS_FN(callee)->arity == a
+           && value_equals(callee, global->value)) {
+            cache->version = global->version;
+            cache->fn = WARP_AS_FN(callee);
+        }
+        if(!vm_call_value(vm, callee, a)) return JIT_ERROR;
+        break;
+    }
+    
+    case OP_TAIL_CALL: {
+        warp_value_t callee = PEEK(a);
+        if(!WARP_IS_FN(callee) || WARP_AS_FN(callee)->arity != a) {
+            if(!vm_call_value(vm, callee, a)) return JIT_ERROR;
+            break;
+        }
+        
+        warp_fn_t *fn = WARP_AS_FN(callee);
+        if(!vm_check_call(vm, slots, fn)) return JIT_ERROR;
+        slots = frame->slots;
+        memmove(slots, vm->sp - (a + 1), (a + 1) * sizeof(warp_value_t));
+        frame->fn = fn;
+        frame->ip = fn->chunk.code;
+        vm->sp = slots + a + 1;
+        tier_count_call(vm, fn);
+        return JIT_TAIL_CALL;
+    }
+    
+    default:
+        UNREACHABLE();
+        break;
+    }
+    return JIT_CONTINUE;
+
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef BINARY
+#undef COMPARE
+#undef REGISTER_BINARY
+#undef GENERIC_ADD
+}
+
+// Compiled calls go straight to the callee's native code. This picks up when it didn't return
+// normally: there is nothing left to do after an error, but after a tail call the callee's frame
+// still needs to be run to completion.
+static jit_status_t jit_finish_call(warp_vm_t *vm, jit_status_t status) {
+    if(status == JIT_ERROR) return JIT_ERROR;
+    ASSERT(status == JIT_TAIL_CALL);
+    return vm_execute_frame(vm) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+// MARK: - Machine code emission
+
+static void emit_8(jit_t *jit, uint8_t byte) {
+    u8_buf_write(jit->vm, &jit->code, byte);
+}
+
+static void emit_32(jit_t *jit, uint32_t val) {
+    for(int i = 0; i < 4; ++i) {
+        emit_8(jit, (val >> (i * 8)) & 0xff);
+    }
+}
+
+static void emit_64(jit_t *jit, uint64_t val) {
+    emit_32(jit, val & 0xffffffff);
+    emit_32(jit, val >> 32);
+}
+
+static void patch_rel32(jit_t *jit, int at, int target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    for(int i = 0; i < 4; ++i) {
+        jit->code.data[at + i] = (rel >> (i * 8)) & 0xff;
+    }
+}
+
+static void patch_here(jit_t *jit, int at) {
+    patch_rel32(jit, at, jit->code.count);
+}
+
+// Operations on 32-bit registers only need a REX prefix to get to r8-r15.
+static void emit_rex(jit_t *jit, bool wide, int reg, int rm) {
+    uint8_t rex = (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if(rex) emit_8(jit, 0x40 | rex);
+}
+
+static void emit_rex_w(jit_t *jit, int reg, int rm) {
+    emit_rex(jit, true, reg, rm);
+}
+
+static void emit_modrm_reg(jit_t *jit, int reg, int rm) {
+    emit_8(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + disp32]. rsp and r12 can only be used as a base through a SIB byte.
+static void emit_modrm_mem(jit_t *jit, int reg, int base, int32_t disp) {
+    emit_8(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if((base & 7) == RSP) emit_8(jit, 0x24);
+    emit_32(jit, (uint32_t)disp);
+}
+
+static void emit_push(jit_t *jit, int reg) {
+    if(reg & 8) emit_8(jit, 0x41);
+    emit_8(jit, 0x50 + (reg & 7));
+}
+
+static void emit_pop(jit_t *jit, int reg) {
+    if(reg & 8) emit_8(jit, 0x41);
+    emit_8(jit, 0x58 + (reg & 7));
+}
+
+static void emit_mov(jit_t *jit, int dst, int src) {
+    emit_rex_w(jit, src, dst);
+    emit_8(jit, 0x89);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_load(jit_t *jit, int dst, int base, int32_t disp) {
+    emit_rex_w(jit, dst, base);
+    emit_8(jit, 0x8b);
+    emit_modrm_mem(jit, dst, base, disp);
+}
+
+static void emit_store(jit_t *jit, int base, int32_t disp, int src) {
+    emit_rex_w(jit, src, base);
+    emit_8(jit, 0x89);
+    emit_modrm_mem(jit, src, base, disp);
+}
+
+static void emit_load32(jit_t *jit, int dst, int base, int32_t disp) {
+    emit_rex(jit, false, dst, base);
+    emit_8(jit, 0x8b);
+    emit_modrm_mem(jit, dst, base, disp);
+}
+
+static void emit_store32(jit_t *jit, int base, int32_t disp, int src) {
+    emit_rex(jit, false, src, base);
+    emit_8(jit, 0x89);
+    emit_modrm_mem(jit, src, base, disp);
+}
+
+static void emit_lea(jit_t *jit, int dst, int base, int32_t disp) {
+    emit_rex_w(jit, dst, base);
+    emit_8(jit, 0x8d);
+    emit_modrm_mem(jit, dst, base, disp);
+}
+
+// movzx dst32, byte [base + disp32]
+static void emit_load_u8(jit_t *jit, int dst, int base, int32_t disp) {
+    ASSERT(dst < R8 && base < R8);
+    emit_8(jit, 0x0f);
+    emit_8(jit, 0xb6);
+    emit_modrm_mem(jit, dst, base, disp);
+}
+
+static void emit_mov_imm64(jit_t *jit, int dst, uint64_t imm) {
+    emit_8(jit, 0x48 | ((dst & 8) ? 0x01 : 0));
+    emit_8(jit, 0xb8 + (dst & 7));
+    emit_64(jit, imm);
+}
+
+static void emit_mov_imm32(jit_t *jit, int dst, uint32_t imm) {
+    if(dst & 8) emit_8(jit, 0x41);
+    emit_8(jit, 0xb8 + (dst & 7));
+    emit_32(jit, imm);
+}
+
+static void emit_add_imm(jit_t *jit, int dst, int32_t imm) {
+    emit_rex_w(jit, 0, dst);
+    emit_8(jit, 0x81);
+    emit_modrm_reg(jit, 0, dst);
+    emit_32(jit, (uint32_t)imm);
+}
+
+static void emit_add(jit_t *jit, int dst, int src) {
+    emit_rex_w(jit, src, dst);
+    emit_8(jit, 0x01);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_add32_imm(jit_t *jit, int dst, int32_t imm) {
+    emit_rex(jit, false, 0, dst);
+    emit_8(jit, 0x81);
+    emit_modrm_reg(jit, 0, dst);
+    emit_32(jit, (uint32_t)imm);
+}
+
+static void emit_add32(jit_t *jit, int dst, int src) {
+    emit_rex(jit, false, src, dst);
+    emit_8(jit, 0x01);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_sub32(jit_t *jit, int dst, int src) {
+    emit_rex(jit, false, src, dst);
+    emit_8(jit, 0x29);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_or(jit_t *jit, int dst, int src) {
+    emit_rex_w(jit, src, dst);
+    emit_8(jit, 0x09);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_shl_imm(jit_t *jit, int dst, uint8_t imm) {
+    emit_rex_w(jit, 0, dst);
+    emit_8(jit, 0xc1);
+    emit_modrm_reg(jit, 4, dst);
+    emit_8(jit, imm);
+}
+
+static void emit_shr_imm(jit_t *jit, int dst, uint8_t imm) {
+    emit_rex_w(jit, 0, dst);
+    emit_8(jit, 0xc1);
+    emit_modrm_reg(jit, 5, dst);
+    emit_8(jit, imm);
+}
+
+static void emit_and(jit_t *jit, int dst, int src) {
+    emit_rex_w(jit, src, dst);
+    emit_8(jit, 0x21);
+    emit_modrm_reg(jit, src, dst);
+}
+
+static void emit_cmp(jit_t *jit, int a, int b) {
+    emit_rex_w(jit, b, a);
+    emit_8(jit, 0x39);
+    emit_modrm_reg(jit, b, a);
+}
+
+// cmp reg, [base + disp32]
+static void emit_cmp_mem(jit_t *jit, int reg, int base, int32_t disp) {
+    emit_rex_w(jit, reg, base);
+    emit_8(jit, 0x3b);
+    emit_modrm_mem(jit, reg, base, disp);
+}
+
+static void emit_cmp32_mem(jit_t *jit, int reg, int base, int32_t disp) {
+    emit_rex(jit, false, reg, base);
+    emit_8(jit, 0x3b);
+    emit_modrm_mem(jit, reg, base, disp);
+}
+
+static void emit_cmp32(jit_t *jit, int a, int b) {
+    emit_rex(jit, false, b, a);
+    emit_8(jit, 0x39);
+    emit_modrm_reg(jit, b, a);
+}
+
+static void emit_cmp32_imm(jit_t *jit, int reg, int32_t imm) {
+    emit_rex(jit, false, 0, reg);
+    emit_8(jit, 0x81);
+    emit_modrm_reg(jit, 7, reg);
+    emit_32(jit, (uint32_t)imm);
+}
+
+static void emit_test(jit_t *jit, int reg) {
+    emit_rex_w(jit, reg, reg);
+    emit_8(jit, 0x85);
+    emit_modrm_reg(jit, reg, reg);
+}
+
+static void emit_test32(jit_t *jit, int reg) {
+    emit_rex(jit, false, reg, reg);
+    emit_8(jit, 0x85);
+    emit_modrm_reg(jit, reg, reg);
+}
+
+static void emit_cmov(jit_t *jit, int cc, int dst, int src) {
+    emit_rex_w(jit, dst, src);
+    emit_8(jit, 0x0f);
+    emit_8(jit, 0x40 | cc);
+    emit_modrm_reg(jit, dst, src);
+}
+
+static void emit_call_reg(jit_t *jit, int reg) {
+    emit_rex(jit, false, 0, reg);
+    emit_8(jit, 0xff);
+    emit_modrm_reg(jit, 2, reg);
+}
+
+static void emit_call(jit_t *jit, uint64_t addr) {
+    emit_mov_imm64(jit, RAX, addr);
+    emit_call_reg(jit, RAX);
+}
+
+// Jumps return the offset of their rel32, to be patched once the target is known.
+static int emit_jmp(jit_t *jit) {
+    emit_8(jit, 0xe9);
+    int at = jit->code.count;
+    emit_32(jit, 0);
+    return at;
+}
+
+static int emit_jcc(jit_t *jit, int cc) {
+    emit_8(jit, 0x0f);
+    emit_8(jit, 0x80 | cc);
+    int at = jit->code.count;
+    emit_32(jit, 0);
+    return at;
+}
+
+static void emit_movq_to_xmm(jit_t *jit, int xmm, int reg) {
+    emit_8(jit, 0x66);
+    emit_rex_w(jit, 0, reg);
+    emit_8(jit, 0x0f);
+    emit_8(jit, 0x6e);
+    emit_modrm_reg(jit, xmm, reg);
+}
+
+static void emit_movq_from_xmm(jit_t *jit, int reg, int xmm) {
+    emit_8(jit, 0x66);
+    emit_rex_w(jit, 0, reg);
+    emit_8(jit, 0x0f);
+    emit_8(jit, 0x7e);
+    emit_modrm_reg(jit, xmm, reg);
+}
+
+static void emit_sse(jit_t *jit, uint8_t prefix, uint8_t op, int dst, int src) {
+    emit_8(jit, prefix);
+    emit_8(jit, 0x0f);
+    emit_8(jit, op);
+    emit_modrm_reg(jit, dst, src);
+}
+
+// MARK: - Instruction templates
+
+static void emit_jump_to(jit_t *jit, int rel32, int target) {
+    i32_buf_write(jit->vm, &jit->jumps, rel32);
+    i32_buf_write(jit->vm, &jit->jumps, target);
+}
+
+static void emit_push_reg(jit_t *jit, int reg) {
+    emit_store(jit, REG_SP, 0, reg);
+    emit_add_imm(jit, REG_SP, sizeof(warp_value_t));
+}
+
+static void emit_push_imm(jit_t *jit, warp_value_t val) {
+    emit_mov_imm64(jit, RAX, val);
+    emit_push_reg(jit, RAX);
+}
+
+static int32_t slot_disp(int slot) {
+    return slot * (int32_t)sizeof(warp_value_t);
+}
+
+static int32_t stack_disp(int depth) {
+    return -(depth + 1) * (int32_t)sizeof(warp_value_t);
+}
+
+// Calls jit_helper() for the instruction at `offset`, and leaves the compiled code with whatever it
+// returns if that isn't JIT_CONTINUE.
+static void emit_helper(jit_t *jit, uint8_t op, int offset) {
+    uint32_t operands = 0;
+    for(int i = code_size[jit->chunk->code[offset]] - 1; i > 0; --i) {
+        operands = (operands << 8) | jit->chunk->code[offset + i];
+    }
+    
+    emit_store(jit, REG_VM, VM_SP, REG_SP);
+    emit_mov(jit, RDI, REG_VM);
+    emit_mov(jit, RSI, REG_FRAME);
+    emit_mov_imm32(jit, RDX, op);
+    emit_mov_imm32(jit, RCX, operands);
+    emit_mov_imm32(jit, R8, (uint32_t)offset);
+    emit_call(jit, (uint64_t)(uintptr_t)&jit_helper);
+    emit_load(jit, REG_SP, REG_VM, VM_SP);
+    emit_load(jit, REG_SLOTS, REG_FRAME, FRAME_SLOTS);
+    emit_test32(jit, RAX);
+    i32_buf_write(jit->vm, &jit->exits, emit_jcc(jit, CC_NE));
+}
+
+// Checks that rax and rcx both hold numbers, and moves them to xmm0 and xmm1. Anything else jumps
+// to the two rel32s left in `slow`.
+// Jumps to the returned rel32 if `reg` doesn't hold an int. Clobbers r8.
+static int emit_int_guard(jit_t *jit, int reg) {
+    emit_mov(jit, R8, reg);
+    emit_shr_imm(jit, R8, 32);
+    emit_cmp32_imm(jit, R8, INT_TAG_HI);
+    return emit_jcc(jit, CC_NE);
+}
+
+// Moves the number in `reg` to `xmm` as a double. Expects QNAN in rdx, and returns the rel32 taken
+// when `reg` isn't a number.
+static int emit_to_double(jit_t *jit, int xmm, int reg) {
+    emit_mov(jit, R8, reg);
+    emit_and(jit, R8, RDX);
+    emit_cmp(jit, R8, RDX);
+    int is_double = emit_jcc(jit, CC_NE);
+    int slow = emit_int_guard(jit, reg);
+    emit_sse(jit, 0xf2, 0x2a, xmm, reg); // cvtsi2sd xmm, reg32
+    int done = emit_jmp(jit);
+    patch_here(jit, is_double);
+    emit_movq_to_xmm(jit, xmm, reg);
+    patch_here(jit, done);
+    return slow;
+}
+
+static void emit_num_guard(jit_t *jit, int slow[2]) {
+    emit_mov_imm64(jit, RDX, QNAN);
+    slow[0] = emit_to_double(jit, XMM0, RAX);
+    slow[1] = emit_to_double(jit, XMM1, RCX);
+}
+
+// Computes `xmm0 op xmm1` into rax. ucomisd sets CF and ZF when either side is NaN, so comparing
+// the other way around and testing for "above" gets every comparison with NaN to be false.
+static void emit_num_op(jit_t *jit, num_op_t op) {
+    int cc = CC_A;
+    switch(op) {
+    case NUM_ADD: emit_sse(jit, 0xf2, 0x58, XMM0, XMM1); break;
+    case NUM_SUB: emit_sse(jit, 0xf2, 0x5c, XMM0, XMM1); break;
+    case NUM_MUL: emit_sse(jit, 0xf2, 0x59, XMM0, XMM1); break;
+    case NUM_DIV: emit_sse(jit, 0xf2, 0x5e, XMM0, XMM1); break;
+    case NUM_LT: emit_sse(jit, 0x66, 0x2e, XMM1, XMM0); cc = CC_A; break;
+    case NUM_GT: emit_sse(jit, 0x66, 0x2e, XMM0, XMM1); cc = CC_A; break;
+    case NUM_LTEQ: emit_sse(jit, 0x66, 0x2e, XMM1, XMM0); cc = CC_AE; break;
+    case NUM_GTEQ: emit_sse(jit, 0x66, 0x2e, XMM0, XMM1); cc = CC_AE; break;
+    }
+    
+    if(op <= NUM_DIV) {
+        emit_movq_from_xmm(jit, RAX, XMM0);
+    } else {
+        emit_mov_imm64(jit, RAX, WARP_FALSE_VAL);
+        emit_mov_imm64(jit, RCX, WARP_TRUE_VAL);
+        emit_cmov(jit, cc, RAX, RCX);
+    }
+}
+
+// Leaves the trace, for the interpreter to carry on at `offset`.
+static void emit_side_exit(jit_t *jit, int offset) {
+    emit_store(jit, REG_VM, VM_SP, REG_SP);
+    emit_mov_imm32(jit, RAX, (uint32_t)offset);
+    i32_buf_write(jit->vm, &jit->side_exits, emit_jmp(jit));
+}
+
+// Condition codes come in pairs, and flipping the low bit negates them.
+static void emit_side_exit_if(jit_t *jit, int cc, int offset) {
+    int skip = emit_jcc(jit, cc ^ 1);
+    emit_side_exit(jit, offset);
+    patch_here(jit, skip);
+}
+
+// Compiled functions fall back on the helper when the fast path doesn't apply. Traces only have
+// the fast path, and hand the instruction back to the interpreter instead.
+static void emit_slow(jit_t *jit, uint8_t op, int offset) {
+    if(jit->trace) {
+        emit_side_exit(jit, offset);
+    } else {
+        emit_helper(jit, op, offset);
+    }
+}
+
+// The slow path goes after the fast one, and the fast one jumps over it.
+static void emit_slow_path(jit_t *jit, int slow[2], uint8_t op, int offset) {
+    int done = emit_jmp(jit);
+    patch_here(jit, slow[0]);
+    patch_here(jit, slow[1]);
+    emit_slow(jit, op, offset);
+    patch_here(jit, done);
+}
+
+// Arithmetic on the numbers in rax and rcx, leaving the result in rax. Two ints are added,
+// subtracted and compared as ints, the way the interpreter does it, so that loop counters stay
+// ints. Anything else -- including results that overflow -- is done on doubles. Traces skip the
+// int path where the recorder saw doubles: values don't go back to being ints once they are not.
+static void emit_arith(jit_t *jit, num_op_t op, int slow[2]) {
+    bool ints = op != NUM_MUL && op != NUM_DIV && (!jit->trace || (jit->seen & SEEN_INTS));
+    if(!ints) {
+        emit_num_guard(jit, slow);
+        emit_num_op(jit, op);
+        return;
+    }
+    
+    int not_ints[3];
+    int count = 0;
+    not_ints[count++] = emit_int_guard(jit, RAX);
+    not_ints[count++] = emit_int_guard(jit, RCX);
+    if(op == NUM_ADD || op == NUM_SUB) {
+        emit_mov(jit, R8, RAX);
+        if(op == NUM_ADD) {
+            emit_add32(jit, R8, RCX);
+        } else {
+            emit_sub32(jit, R8, RCX);
+        }
+        not_ints[count++] = emit_jcc(jit, CC_O);
+        emit_mov_imm64(jit, RAX, QNAN | INT_BIT);
+        emit_or(jit, RAX, R8);
+    } else {
+        static const int cc[] = {
+            [NUM_LT] = CC_L, [NUM_GT] = CC_G, [NUM_LTEQ] = CC_LE, [NUM_GTEQ] = CC_GE,
+        };
+        emit_cmp32(jit, RAX, RCX);
+        emit_mov_imm64(jit, RAX, WARP_FALSE_VAL);
+        emit_mov_imm64(jit, RCX, WARP_TRUE_VAL);
+        emit_cmov(jit, cc[op], RAX, RCX);
+    }
+    
+    int done = emit_jmp(jit);
+    for(int i = 0; i < count; ++i) {
+        patch_here(jit, not_ints[i]);
+    }
+    emit_num_guard(jit, slow);
+    emit_num_op(jit, op);
+    patch_here(jit, done);
+}
+
+static void emit_stack_binary(jit_t *jit, uint8_t op, num_op_t num_op, int offset) {
+    int slow[2];
+    emit_load(jit, RAX, REG_SP, stack_disp(1));
+    emit_load(jit, RCX, REG_SP, stack_disp(0));
+    emit_arith(jit, num_op, slow);
+    emit_store(jit, REG_SP, stack_disp(1), RAX);
+    emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+    emit_slow_path(jit, slow, op, offset);
+}
+
+static void emit_register_binary(jit_t *jit, num_op_t num_op, bool konst, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    int slow[2];
+    emit_load(jit, RAX, REG_SLOTS, slot_disp(code[2]));
+    if(konst) {
+        emit_mov_imm64(jit, RCX, jit->chunk->constants.data[code[3]]);
+    } else {
+        emit_load(jit, RCX, REG_SLOTS, slot_disp(code[3]));
+    }
+    emit_arith(jit, num_op, slow);
+    emit_store(jit, REG_SLOTS, slot_disp(code[1]), RAX);
+    emit_slow_path(jit, slow, code[0], offset);
+}
+
+static void emit_const_binary(jit_t *jit, num_op_t num_op, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    int slow[2];
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_mov_imm64(jit, RCX, jit->chunk->constants.data[code[1]]);
+    emit_arith(jit, num_op, slow);
+    emit_store(jit, REG_SP, stack_disp(0), RAX);
+    emit_slow_path(jit, slow, code[0], offset);
+}
+
+static void emit_get_glob(jit_t *jit, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    int32_t global = (code[1] | (code[2] << 8)) * (int32_t)sizeof(global_t);
+    
+    emit_load(jit, RAX, REG_VM, VM_GLOBALS);
+    emit_load_u8(jit, RCX, RAX, global + (int32_t)offsetof(global_t, defined));
+    emit_test32(jit, RCX);
+    int slow = emit_jcc(jit, CC_E);
+    emit_load(jit, RCX, RAX, global + (int32_t)offsetof(global_t, value));
+    emit_push_reg(jit, RCX);
+    int done = emit_jmp(jit);
+    patch_here(jit, slow);
+    emit_slow(jit, OP_GET_GLOB, offset);
+    patch_here(jit, done);
+}
+
+static void emit_set_glob(jit_t *jit, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    int32_t global = (code[1] | (code[2] << 8)) * (int32_t)sizeof(global_t);
+    
+    emit_load(jit, RAX, REG_VM, VM_GLOBALS);
+    emit_load_u8(jit, RCX, RAX, global + (int32_t)offsetof(global_t, defined));
+    emit_test32(jit, RCX);
+    int slow = emit_jcc(jit, CC_E);
+    emit_load(jit, RCX, REG_SP, stack_disp(0));
+    emit_store(jit, RAX, global + (int32_t)offsetof(global_t, value), RCX);
+    emit_load32(jit, RCX, RAX, global + GLOBAL_VERSION);
+    emit_add32_imm(jit, RCX, 1);
+    emit_store32(jit, RAX, global + GLOBAL_VERSION, RCX);
+    int done = emit_jmp(jit);
+    patch_here(jit, slow);
+    emit_slow(jit, OP_SET_GLOB, offset);
+    patch_here(jit, done);
+}
+
+static void emit_jmp_false(jit_t *jit, int target) {
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_mov_imm64(jit, RCX, WARP_NIL_VAL);
+    emit_cmp(jit, RAX, RCX);
+    emit_jump_to(jit, emit_jcc(jit, CC_E), target);
+    emit_mov_imm64(jit, RCX, WARP_FALSE_VAL);
+    emit_cmp(jit, RAX, RCX);
+    emit_jump_to(jit, emit_jcc(jit, CC_E), target);
+}
+
+// The fast path branches straight on the flags from ucomisd. The slow path lets the helper push
+// the result of a plain LT, then branches on that.
+// LT_JMP_FALSE jumps when the first operand isn't less than the second, LT_LOOP_IF when it is.
+static void emit_lt_branch(jit_t *jit, int offset, int target, bool if_less) {
+    int slow[2];
+    emit_load(jit, RAX, REG_SP, stack_disp(1));
+    emit_load(jit, RCX, REG_SP, stack_disp(0));
+    int not_int = emit_int_guard(jit, RAX);
+    int not_ints = emit_int_guard(jit, RCX);
+    emit_add_imm(jit, REG_SP, -2 * (int32_t)sizeof(warp_value_t));
+    emit_cmp32(jit, RAX, RCX);
+    emit_jump_to(jit, emit_jcc(jit, if_less ? CC_L : CC_GE), target);
+    int ints_done = emit_jmp(jit);
+    
+    patch_here(jit, not_int);
+    patch_here(jit, not_ints);
+    emit_num_guard(jit, slow);
+    emit_add_imm(jit, REG_SP, -2 * (int32_t)sizeof(warp_value_t));
+    emit_sse(jit, 0x66, 0x2e, XMM1, XMM0);
+    emit_jump_to(jit, emit_jcc(jit, if_less ? CC_A : CC_BE), target);
+    int done = emit_jmp(jit);
+    
+    patch_here(jit, slow[0]);
+    patch_here(jit, slow[1]);
+    emit_helper(jit, OP_LT, offset);
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+    emit_mov_imm64(jit, RCX, WARP_TRUE_VAL);
+    emit_cmp(jit, RAX, RCX);
+    emit_jump_to(jit, emit_jcc(jit, if_less ? CC_E : CC_NE), target);
+    patch_here(jit, done);
+    patch_here(jit, ints_done);
+}
+
+static void emit_loop_if(jit_t *jit, int target) {
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+    emit_mov_imm64(jit, RCX, WARP_NIL_VAL);
+    emit_cmp(jit, RAX, RCX);
+    int is_nil = emit_jcc(jit, CC_E);
+    emit_mov_imm64(jit, RCX, WARP_FALSE_VAL);
+    emit_cmp(jit, RAX, RCX);
+    int is_false = emit_jcc(jit, CC_E);
+    emit_jump_to(jit, emit_jmp(jit), target);
+    patch_here(jit, is_nil);
+    patch_here(jit, is_false);
+}
+
+// When the call site's cache is still good and the callee has been compiled, we push its frame and
+// call its native code right here. Anything else -- including stack overflows, which need to be
+// reported, and calls that need the value stack to grow -- goes through the helper.
+static void emit_call_glob(jit_t *jit, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    int arg_count = code[1];
+    call_cache_t *cache = &jit->chunk->caches.data[code[2] | (code[3] << 8)];
+    int32_t global = cache->global * (int32_t)sizeof(global_t);
+    int slow[5];
+    
+    emit_mov_imm64(jit, RAX, (uint64_t)(uintptr_t)cache);
+    emit_load(jit, RCX, REG_VM, VM_GLOBALS);
+    emit_load32(jit, RDX, RAX, CACHE_VERSION);
+    emit_load32(jit, R8, RCX, global + GLOBAL_VERSION);
+    emit_cmp32(jit, RDX, R8);
+    slow[0] = emit_jcc(jit, CC_NE);
+    
+    emit_load(jit, RDX, RAX, CACHE_FN);
+    emit_load(jit, R8, RDX, FN_JIT);
+    emit_test(jit, R8);
+    slow[1] = emit_jcc(jit, CC_E);
+    
+    emit_load32(jit, RCX, REG_VM, VM_FRAME_COUNT);
+    emit_cmp32_mem(jit, RCX, REG_VM, VM_MAX_FRAMES);
+    slow[2] = emit_jcc(jit, CC_AE);
+    
+    // r9 = the callee's slots, which must have room for fn->max_slots values.
+    emit_lea(jit, R9, REG_SP, stack_disp(arg_count));
+    emit_load32(jit, R10, RDX, FN_MAX_SLOTS);
+    emit_shl_imm(jit, R10, 3);
+    emit_add(jit, R10, R9);
+    emit_cmp_mem(jit, R10, REG_VM, VM_STACK_END);
+    slow[3] = emit_jcc(jit, CC_A);
+    
+    // Our frame is on top of the call stack, so the callee's goes right after it.
+    emit_lea(jit, RSI, REG_FRAME, sizeof(call_frame_t));
+    emit_add32_imm(jit, RCX, 1);
+    emit_store32(jit, REG_VM, VM_FRAME_COUNT, RCX);
+    
+    emit_store(jit, RSI, FRAME_FN, RDX);
+    emit_store(jit, RSI, FRAME_SLOTS, R9);
+    emit_load(jit, R9, RDX, FN_CODE);
+    emit_store(jit, RSI, FRAME_IP, R9);
+    emit_store(jit, REG_VM, VM_SP, REG_SP);
+    emit_mov(jit, RDI, REG_VM);
+    emit_call_reg(jit, R8);
+    emit_load(jit, REG_SP, REG_VM, VM_SP);
+    
+    emit_cmp32_imm(jit, RAX, JIT_RETURNED);
+    int done = emit_jcc(jit, CC_E);
+    emit_mov(jit, RDI, REG_VM);
+    emit_mov(jit, RSI, RAX);
+    emit_call(jit, (uint64_t)(uintptr_t)&jit_finish_call);
+    emit_load(jit, REG_SP, REG_VM, VM_SP);
+    emit_test32(jit, RAX);
+    i32_buf_write(jit->vm, &jit->exits, emit_jcc(jit, CC_NE));
+    
+    // The callee may have grown the stack, which moves our slots.
+    patch_here(jit, done);
+    emit_load(jit, REG_SLOTS, REG_FRAME, FRAME_SLOTS);
+    slow[4] = emit_jmp(jit);
+    
+    patch_here(jit, slow[0]);
+    patch_here(jit, slow[1]);
+    patch_here(jit, slow[2]);
+    patch_here(jit, slow[3]);
+    emit_helper(jit, OP_CALL_GLOB, offset);
+    patch_here(jit, slow[4]);
+}
+
+// The result replaces the callee and its arguments on the caller's stack.
+static void emit_return(jit_t *jit) {
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_store(jit, REG_SLOTS, 0, RAX);
+    emit_lea(jit, REG_SP, REG_SLOTS, sizeof(warp_value_t));
+    emit_store(jit, REG_VM, VM_SP, REG_SP);
+    emit_load32(jit, RCX, REG_VM, VM_FRAME_COUNT);
+    emit_add32_imm(jit, RCX, -1);
+    emit_store32(jit, REG_VM, VM_FRAME_COUNT, RCX);
+    emit_mov_imm32(jit, RAX, JIT_RETURNED);
+    i32_buf_write(jit->vm, &jit->exits, emit_jmp(jit));
+}
+
+static int jump_target(const uint8_t *code, int offset) {
+    uint8_t instr = code[offset];
+    int jmp = code[offset+1] | (code[offset+2] << 8);
+    int next = offset + code_size[instr];
+    return warp_jumps_back(instr) ? next - jmp : next + jmp;
+}
+
+// In a trace, a conditional branch is a guard that the condition goes the same way it did while
+// recording.
+static void emit_trace_jmp_false(jit_t *jit, int offset) {
+    int target = jump_target(jit->chunk->code, offset);
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    if(jit->next == target) {
+        emit_mov_imm64(jit, RCX, WARP_NIL_VAL);
+        emit_cmp(jit, RAX, RCX);
+        int is_nil = emit_jcc(jit, CC_E);
+        emit_mov_imm64(jit, RCX, WARP_FALSE_VAL);
+        emit_cmp(jit, RAX, RCX);
+        int is_false = emit_jcc(jit, CC_E);
+        emit_side_exit(jit, offset + code_size[OP_JMP_FALSE]);
+        patch_here(jit, is_nil);
+        patch_here(jit, is_false);
+    } else {
+        emit_mov_imm64(jit, RCX, WARP_NIL_VAL);
+        emit_cmp(jit, RAX, RCX);
+        emit_side_exit_if(jit, CC_E, target);
+        emit_mov_imm64(jit, RCX, WARP_FALSE_VAL);
+        emit_cmp(jit, RAX, RCX);
+        emit_side_exit_if(jit, CC_E, target);
+    }
+}
+
+// Compares the callee under the arguments with the inlined function, leaving the flags set.
+static void emit_cmp_callee(jit_t *jit, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    emit_load(jit, RAX, REG_SP, stack_disp(code[4]));
+    emit_mov_imm64(jit, RCX, jit->chunk->constants.data[code[3]]);
+    emit_cmp(jit, RAX, RCX);
+}
+
+static void emit_trace_guard_fn(jit_t *jit, int offset) {
+    int target = jump_target(jit->chunk->code, offset);
+    emit_cmp_callee(jit, offset);
+    if(jit->next == target) {
+        emit_side_exit_if(jit, CC_E, offset + code_size[OP_GUARD_FN]);
+    } else {
+        emit_side_exit_if(jit, CC_NE, target);
+    }
+}
+
+// Guards that `a < b` is `less`, like it was while recording, or leaves the trace for `exit`. lea
+// leaves the flags alone, so the operands can be popped between the compare and the guard.
+static void emit_trace_lt(jit_t *jit, int offset, bool less, int exit) {
+    int slow[2];
+    int done = -1;
+    emit_load(jit, RAX, REG_SP, stack_disp(1));
+    emit_load(jit, RCX, REG_SP, stack_disp(0));
+    if(jit->seen & SEEN_INTS) {
+        int not_int = emit_int_guard(jit, RAX);
+        int not_ints = emit_int_guard(jit, RCX);
+        emit_cmp32(jit, RAX, RCX);
+        emit_lea(jit, REG_SP, REG_SP, -2 * (int32_t)sizeof(warp_value_t));
+        emit_side_exit_if(jit, less ? CC_GE : CC_L, exit);
+        done = emit_jmp(jit);
+        patch_here(jit, not_int);
+        patch_here(jit, not_ints);
+    }
+    emit_num_guard(jit, slow);
+    emit_sse(jit, 0x66, 0x2e, XMM1, XMM0);
+    emit_lea(jit, REG_SP, REG_SP, -2 * (int32_t)sizeof(warp_value_t));
+    emit_side_exit_if(jit, less ? CC_BE : CC_A, exit);
+    emit_slow_path(jit, slow, OP_LT, offset);
+    if(done >= 0) patch_here(jit, done);
+}
+
+static void emit_trace_lt_jmp_false(jit_t *jit, int offset) {
+    int target = jump_target(jit->chunk->code, offset);
+    if(jit->next == target) {
+        emit_trace_lt(jit, offset, false, offset + code_size[OP_LT_JMP_FALSE]);
+    } else {
+        emit_trace_lt(jit, offset, true, target);
+    }
+}
+
+// Traces only ever record rotated loops going back round, so leaving them is the side exit.
+static void emit_trace_loop_if(jit_t *jit, int offset) {
+    int exit = offset + code_size[OP_LOOP_IF];
+    emit_load(jit, RAX, REG_SP, stack_disp(0));
+    emit_lea(jit, REG_SP, REG_SP, -(int32_t)sizeof(warp_value_t));
+    emit_mov_imm64(jit, RCX, WARP_NIL_VAL);
+    emit_cmp(jit, RAX, RCX);
+    emit_side_exit_if(jit, CC_E, exit);
+    emit_mov_imm64(jit, RCX, WARP_FALSE_VAL);
+    emit_cmp(jit, RAX, RCX);
+    emit_side_exit_if(jit, CC_E, exit);
+}
+
+// Instructions that also work on things other than numbers. When the recorder saw them run on
+// something else, the trace calls the helper for them.
+static bool is_generic(uint8_t instr) {
+    switch(instr) {
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_ADD_LL:
+    case OP_ADD_K:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool emit_instr(jit_t *jit, int offset) {
+    const uint8_t *code = jit->chunk->code + offset;
+    warp_opcode_t instr = code[0];
+    
+    if(jit->trace) {
+        if(is_generic(instr) && !(jit->seen & SEEN_NUMS)) {
+            emit_helper(jit, instr, offset);
+            return true;
+        }
+        switch(instr) {
+        case OP_JMP:
+            // The trace is laid out in the order it ran, so we are already where the jump goes.
+            return true;
+        case OP_JMP_FALSE:
+            emit_trace_jmp_false(jit, offset);
+            return true;
+        case OP_LT_JMP_FALSE:
+            emit_trace_lt_jmp_false(jit, offset);
+            return true;
+        case OP_GUARD_FN:
+            emit_trace_guard_fn(jit, offset);
+            return true;
+        case OP_LOOP:
+            emit_jump_to(jit, emit_jmp(jit), jit->next);
+            return true;
+        case OP_LOOP_IF:
+            emit_trace_loop_if(jit, offset);
+            emit_jump_to(jit, emit_jmp(jit), jit->next);
+            return true;
+        case OP_LT_LOOP_IF:
+            emit_trace_lt(jit, offset, true, offset + code_size[OP_LT_LOOP_IF]);
+            emit_jump_to(jit, emit_jmp(jit), jit->next);
+            return true;
+        default:
+            break;
+        }
+    }
+    
+    switch(instr) {
+    case OP_CONST: emit_push_imm(jit, jit->chunk->constants.data[code[1]]); break;
+    case OP_NIL: emit_push_imm(jit, WARP_NIL_VAL); break;
+    case OP_TRUE: emit_push_imm(jit, WARP_TRUE_VAL); break;
+    case OP_FALSE: emit_push_imm(jit, WARP_FALSE_VAL); break;
+    
+    case OP_GET_LOCAL:
+        emit_load(jit, RAX, REG_SLOTS, slot_disp(code[1]));
+        emit_push_reg(jit, RAX);
+        break;
+    
+    case OP_SET_LOCAL:
+        emit_load(jit, RAX, REG_SP, stack_disp(0));
+        emit_store(jit, REG_SLOTS, slot_disp(code[1]), RAX);
+        break;
+    
+    case OP_POP_LOCAL:
+        emit_load(jit, RAX, REG_SP, stack_disp(0));
+        emit_store(jit, REG_SLOTS, slot_disp(code[1]), RAX);
+        emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+        break;
+    
+    case OP_DUP:
+        emit_load(jit, RAX, REG_SP, stack_disp(0));
+        emit_push_reg(jit, RAX);
+        break;
+    
+    case OP_POP:
+        emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+        break;
+    
+    case OP_BLOCK: {
+        int count = code[1] | (code[2] << 8);
+        emit_load(jit, RAX, REG_SP, stack_disp(0));
+        emit_add_imm(jit, REG_SP, -count * (int32_t)sizeof(warp_value_t));
+        emit_store(jit, REG_SP, stack_disp(0), RAX);
+        break;
+    }
+    
+    case OP_DROP:
+        emit_add_imm(jit, REG_SP, -(code[1] | (code[2] << 8)) * (int32_t)sizeof(warp_value_t));
+        break;
+    
+    case OP_GET_GLOB: emit_get_glob(jit, offset); break;
+    case OP_SET_GLOB: emit_set_glob(jit, offset); break;
+    case OP_POP_GLOB:
+        emit_set_glob(jit, offset);
+        emit_add_imm(jit, REG_SP, -(int32_t)sizeof(warp_value_t));
+        break;
+    
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR: emit_stack_binary(jit, OP_ADD, NUM_ADD, offset); break;
+    case OP_SUB: emit_stack_binary(jit, OP_SUB, NUM_SUB, offset); break;
+    case OP_MUL: emit_stack_binary(jit, OP_MUL, NUM_MUL, offset); break;
+    case OP_DIV: emit_stack_binary(jit, OP_DIV, NUM_DIV, offset); break;
+    case OP_LT: emit_stack_binary(jit, OP_LT, NUM_LT, offset); break;
+    case OP_GT: emit_stack_binary(jit, OP_GT, NUM_GT, offset); break;
+    case OP_LTEQ: emit_stack_binary(jit, OP_LTEQ, NUM_LTEQ, offset); break;
+    case OP_GTEQ: emit_stack_binary(jit, OP_GTEQ, NUM_GTEQ, offset); break;
+    
+    // Numbers can still be ints or doubles, so the unchecked forms compile like the others. Their
+    // slow path is just never taken.
+    case OP_ADD_NN: emit_stack_binary(jit, OP_ADD, NUM_ADD, offset); break;
+    case OP_SUB_NN: emit_stack_binary(jit, OP_SUB, NUM_SUB, offset); break;
+    case OP_MUL_NN: emit_stack_binary(jit, OP_MUL, NUM_MUL, offset); break;
+    case OP_DIV_NN: emit_stack_binary(jit, OP_DIV, NUM_DIV, offset); break;
+    case OP_LT_NN: emit_stack_binary(jit, OP_LT, NUM_LT, offset); break;
+    case OP_GT_NN: emit_stack_binary(jit, OP_GT, NUM_GT, offset); break;
+    case OP_LTEQ_NN: emit_stack_binary(jit, OP_LTEQ, NUM_LTEQ, offset); break;
+    case OP_GTEQ_NN: emit_stack_binary(jit, OP_GTEQ, NUM_GTEQ, offset); break;
+    
+    case OP_ADD_RR: emit_register_binary(jit, NUM_ADD, false, offset); break;
+    case OP_SUB_RR: emit_register_binary(jit, NUM_SUB, false, offset); break;
+    case OP_MUL_RR: emit_register_binary(jit, NUM_MUL, false, offset); break;
+    case OP_DIV_RR: emit_register_binary(jit, NUM_DIV, false, offset); break;
+    case OP_ADD_RK: emit_register_binary(jit, NUM_ADD, true, offset); break;
+    case OP_SUB_RK: emit_register_binary(jit, NUM_SUB, true, offset); break;
+    case OP_MUL_RK: emit_register_binary(jit, NUM_MUL, true, offset); break;
+    case OP_DIV_RK: emit_register_binary(jit, NUM_DIV, true, offset); break;
+    
+    case OP_ADD_K: emit_const_binary(jit, NUM_ADD, offset); break;
+    case OP_SUB_K: emit_const_binary(jit, NUM_SUB, offset); break;
+    
+    case OP_ADD_LL: {
+        int slow[2];
+        emit_load(jit, RAX, REG_SLOTS, slot_disp(code[1]));
+        emit_load(jit, RCX, REG_SLOTS, slot_disp(code[2]));
+        emit_arith(jit, NUM_ADD, slow);
+        emit_push_reg(jit, RAX);
+        emit_slow_path(jit, slow, OP_ADD_LL, offset);
+        break;
+    }
+    
+    case OP_JMP:
+    case OP_LOOP:
+        emit_jump_to(jit, emit_jmp(jit), jump_target(jit->chunk->code, offset));
+        break;
+    
+    case OP_JMP_FALSE:
+        emit_jmp_false(jit, jump_target(jit->chunk->code, offset));
+        break;
+    
+    case OP_LT_JMP_FALSE:
+        emit_lt_branch(jit, offset, jump_target(jit->chunk->code, offset), false);
+        break;
+    
+    case OP_LT_LOOP_IF:
+        emit_lt_branch(jit, offset, jump_target(jit->chunk->code, offset), true);
+        break;
+    
+    case OP_LOOP_IF:
+        emit_loop_if(jit, jump_target(jit->chunk->code, offset));
+        break;
+    
+    case OP_GUARD_FN:
+        emit_cmp_callee(jit, offset);
+        emit_jump_to(jit, emit_jcc(jit, CC_NE), jump_target(jit->chunk->code, offset));
+        break;
+    
+    case OP_CALL_GLOB: emit_call_glob(jit, offset); break;
+    case OP_RETURN: emit_return(jit); break;
+    
+    case OP_DEF_GLOB:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_EQ:
+    case OP_PRINT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        emit_helper(jit, instr, offset);
+        break;
+    
+    default:
+        return false;
+    }
+    return true;
+}
+
+// MARK: - Compiler interface
+
+static void jit_init(jit_t *jit, warp_vm_t *vm, const chunk_t *chunk, bool trace) {
+    jit->vm = vm;
+    jit->chunk = chunk;
+    u8_buf_init(&jit->code);
+    i32_buf_init(&jit->jumps);
+    i32_buf_init(&jit->exits);
+    i32_buf_init(&jit->side_exits);
+    jit->labels = ALLOCATE_ARRAY(vm, int, chunk->count);
+    for(int i = 0; i < chunk->count; ++i) {
+        jit->labels[i] = -1;
+    }
+    jit->trace = trace;
+    jit->seen = 0;
+    jit->next = -1;
+    
+    // System V wants the stack 16-byte aligned at calls: the return address and five pushes get
+    // us there.
+    emit_push(jit, RBX);
+    emit_push(jit, R12);
+    emit_push(jit, R13);
+    emit_push(jit, R14);
+    emit_push(jit, R15);
+    emit_mov(jit, REG_VM, RDI);
+    emit_mov(jit, REG_FRAME, RSI);
+    emit_load(jit, REG_SP, REG_VM, VM_SP);
+    emit_load(jit, REG_SLOTS, REG_FRAME, FRAME_SLOTS);
+}
+
+static void jit_fini(jit_t *jit) {
+    FREE_ARRAY(jit->vm, jit->labels, int, jit->chunk->count);
+    i32_buf_fini(jit->vm, &jit->side_exits);
+    i32_buf_fini(jit->vm, &jit->exits);
+    i32_buf_fini(jit->vm, &jit->jumps);
+    u8_buf_fini(jit->vm, &jit->code);
+}
+
+// Emits the way out of compiled code, resolves jumps, and copies the code to executable memory.
+// Returns NULL if that didn't work out.
+static void *jit_finish(jit_t *jit, size_t *size) {
+    // Compiled functions return the helper's status as is. Traces return the offset to resume at,
+    // which side exits have already loaded, or -1 when a helper reported an error.
+    int error = jit->code.count;
+    if(jit->trace) emit_mov_imm32(jit, RAX, (uint32_t)-1);
+    
+    int epilogue = jit->code.count;
+    emit_pop(jit, R15);
+    emit_pop(jit, R14);
+    emit_pop(jit, R13);
+    emit_pop(jit, R12);
+    emit_pop(jit, RBX);
+    emit_8(jit, 0xc3);
+    
+    for(int i = 0; i < jit->jumps.count; i += 2) {
+        int target = jit->labels[jit->jumps.data[i+1]];
+        ASSERT(target >= 0);
+        patch_rel32(jit, jit->jumps.data[i], target);
+    }
+    for(int i = 0; i < jit->exits.count; ++i) {
+        patch_rel32(jit, jit->exits.data[i], error);
+    }
+    for(int i = 0; i < jit->side_exits.count; ++i) {
+        patch_rel32(jit, jit->side_exits.data[i], epilogue);
+    }
+    
+    *size = (size_t)jit->code.count;
+    void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return NULL;
+    
+    memcpy(mem, jit->code.data, *size);
+    if(mprotect(mem, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, *size);
+        return NULL;
+    }
+    return mem;
+}
+
+bool jit_compile(warp_vm_t *vm, warp_fn_t *fn) {
+    ASSERT(vm);
+    ASSERT(fn);
+    ASSERT(fn->verified);
+    
+    jit_t jit;
+    jit_init(&jit, vm, &fn->chunk, false);
+    
+    bool ok = true;
+    const uint8_t *code = fn->chunk.code;
+    for(int offset = 0; ok && offset < fn->chunk.count; offset += code_size[code[offset]]) {
+        jit.labels[offset] = jit.code.count;
+        ok = emit_instr(&jit, offset);
+    }
+    if(ok) fn->jit = jit_finish(&jit, &fn->jit_size);
+    
+    jit_fini(&jit);
+    return fn->jit != NULL;
+}
+
+// A trace never goes backwards until its final LOOP, so each instruction shows up in it once, and
+// the labels can still be indexed by bytecode offset.
+static bool compile_trace(warp_vm_t *vm, const chunk_t *chunk, recorder_t *rec) {
+    jit_t jit;
+    jit_init(&jit, vm, chunk, true);
+    
+    bool ok = true;
+    const int32_t *trace = rec->trace.data;
+    for(int i = 0; ok && i < rec->trace.count; i += 2) {
+        int offset = trace[i];
+        jit.seen = trace[i+1];
+        jit.next = i + 2 < rec->trace.count ? trace[i+2] : rec->start;
+        jit.labels[offset] = jit.code.count;
+        ok = emit_instr(&jit, offset);
+    }
+    if(ok) rec->loop->trace = jit_finish(&jit, &rec->loop->trace_size);
+    
+    jit_fini(&jit);
+    return rec->loop->trace != NULL;
+}
+
+jit_status_t jit_run(warp_vm_t *vm, call_frame_t *frame) {
+    ASSERT(vm);
+    ASSERT(frame && frame->fn->jit);
+    
+    // ISO C has no cast from object to function pointers, but copying the bits over is fine.
+    jit_entry_t entry;
+    memcpy(&entry, &frame->fn->jit, sizeof(entry));
+    return entry(vm, frame);
+}
+
+int jit_run_trace(warp_vm_t *vm, call_frame_t *frame, hot_loop_t *loop) {
+    ASSERT(vm);
+    ASSERT(frame);
+    ASSERT(loop && loop->trace);
+    
+    trace_entry_t entry;
+    memcpy(&entry, &loop->trace, sizeof(entry));
+    return entry(vm, frame);
+}
+
+void jit_free(warp_vm_t *vm, warp_fn_t *fn) {
+    UNUSED(vm);
+    ASSERT(fn);
+    
+    for(int i = 0; i < fn->chunk.loops.count; ++i) {
+        hot_loop_t *loop = &fn->chunk.loops.data[i];
+        if(!loop->trace) continue;
+        munmap(loop->trace, loop->trace_size);
+        loop->trace = NULL;
+        loop->trace_size = 0;
+    }
+    
+    if(!fn->jit) return;
+    munmap(fn->jit, fn->jit_size);
+    fn->jit = NULL;
+    fn->jit_size = 0;
+}
+
+// MARK: - Trace recording
+
+static uint8_t observe(
+    const chunk_t *chunk,
+    const uint8_t *ip,
+    const warp_value_t *sp,
+    const warp_value_t *slots
+) {
+    const warp_value_t *consts = chunk->constants.data;
+    warp_value_t a = WARP_NIL_VAL;
+    warp_value_t b = WARP_NIL_VAL;
+    
+    switch(*ip) {
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_LT_JMP_FALSE:
+    case OP_LT_LOOP_IF:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+        a = sp[-2];
+        b = sp[-1];
+        break;
+    
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+        a = slots[ip[2]];
+        b = slots[ip[3]];
+        break;
+    
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        a = slots[ip[2]];
+        b = consts[ip[3]];
+        break;
+    
+    case OP_ADD_LL:
+        a = slots[ip[1]];
+        b = slots[ip[2]];
+        break;
+    
+    case OP_ADD_K:
+    case OP_SUB_K:
+        a = sp[-1];
+        b = consts[ip[1]];
+        break;
+    
+    default:
+        return 0;
+    }
+    if(WARP_ARE_INTS(a, b)) return SEEN_NUMS | SEEN_INTS;
+    return WARP_ARE_NUMS(a, b) ? SEEN_NUMS : 0;
+}
+
+// Checks whether the loop instruction at `ip` is about to jump back, with the stack at `sp`.
+static bool loops_back(const uint8_t *ip, const warp_value_t *sp) {
+    switch(*ip) {
+    case OP_LOOP_IF:
+        return !value_is_falsey(sp[-1]);
+    case OP_LT_LOOP_IF:
+        return WARP_ARE_NUMS(sp[-2], sp[-1]) && VALUE_COMPARE(sp[-2], <, sp[-1]);
+    default:
+        return true;
+    }
+}
+
+bool jit_record_start(warp_vm_t *vm, hot_loop_t *loop, int start, int end) {
+    ASSERT(vm);
+    ASSERT(loop);
+    
+    recorder_t *rec = &vm->recorder;
+    if(rec->active || loop->attempts >= WARP_TRACE_ATTEMPTS) return false;
+    
+    rec->active = true;
+    rec->frame = vm->frame_count - 1;
+    rec->loop = loop;
+    rec->start = start;
+    rec->end = end;
+    rec->trace.count = 0;
+    return true;
+}
+
+void jit_record_abort(warp_vm_t *vm) {
+    ASSERT(vm);
+    recorder_t *rec = &vm->recorder;
+    if(!rec->active) return;
+    
+    rec->active = false;
+    rec->loop->hotness = 0;
+    rec->loop->attempts += 1;
+}
+
+bool jit_record(
+    warp_vm_t *vm,
+    const uint8_t *ip,
+    const warp_value_t *sp,
+    const warp_value_t *slots
+) {
+    ASSERT(vm);
+    recorder_t *rec = &vm->recorder;
+    if(!rec->active) return false;
+    
+    // Functions called from the loop aren't part of the trace, which just calls them.
+    int depth = vm->frame_count - 1;
+    if(depth > rec->frame) return true;
+    
+    const chunk_t *chunk = &vm->frames[depth].fn->chunk;
+    int offset = (int)(ip - chunk->code);
+    bool in_loop = depth == rec->frame && offset >= rec->start && offset <= rec->end;
+    if(!in_loop || rec->trace.count >= 2 * WARP_TRACE_MAX) {
+        jit_record_abort(vm);
+        return false;
+    }
+    
+    switch(*ip) {
+    case OP_RETURN:
+    case OP_TAIL_CALL:
+    case OP_ENDLOOP:
+    case OP_POW:
+        jit_record_abort(vm);
+        return false;
+    
+    case OP_LOOP:
+    case OP_LOOP_IF:
+    case OP_LT_LOOP_IF:
+        // Inner loops get their own traces: we only close the loop we started on, and only when it
+        // goes back round.
+        if(jump_target(chunk->code, offset) != rec->start || !loops_back(ip, sp)) {
+            jit_record_abort(vm);
+            return false;
+        }
+        i32_buf_write(vm, &rec->trace, offset);
+        i32_buf_write(vm, &rec->trace, observe(chunk, ip, sp, slots));
+        rec->active = false;
+        if(!compile_trace(vm, chunk, rec)) {
+            rec->loop->hotness = 0;
+            rec->loop->attempts += 1;
+        }
+        return false;
+    
+    default:
+        break;
+    }
+    
+    i32_buf_write(vm, &rec->trace, offset);
+    i32_buf_write(vm, &rec->trace, observe(chunk, ip, sp, slots));
+    return true;
+}
@@ -0,0 +1,62 @@
+//===--------------------------------------------------------------------------------------------===
+// jit.h - Baseline x86-64 compiler for Warp functions
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "warp_internal.h"
+
+#if WARP_JIT
+
+// Number of times a loop's back edge is taken before we record a trace of it.
+#ifndef WARP_TRACE_THRESHOLD
+    #define WARP_TRACE_THRESHOLD (50)
+#endif
+
+// How many times we try recording a loop before giving up on it.
+#define WARP_TRACE_ATTEMPTS (4)
+
+// Longest trace we are willing to record, in instructions.
+#define WARP_TRACE_MAX (1024)
+
+typedef enum {
+    JIT_CONTINUE,       // Only used between compiled code and its helpers.
+    JIT_RETURNED,       // The frame returned, and its result is on top of the caller's stack.
+    JIT_ERROR,          // A runtime error was reported.
+    JIT_TAIL_CALL,      // The frame now holds another function, which should be run in its place.
+} jit_status_t;
+
+// Compiles `fn`'s bytecode to native code. When this fails, `fn` simply stays interpreted.
+bool jit_compile(warp_vm_t *vm, warp_fn_t *fn);
+
+// Runs the compiled code of `frame`'s function. `frame` must be on top of the call stack.
+jit_status_t jit_run(warp_vm_t *vm, call_frame_t *frame);
+
+// Frees `fn`'s compiled code, along with the traces of its loops.
+void jit_free(warp_vm_t *vm, warp_fn_t *fn);
+
+// Starts recording one iteration of `loop`, from its header at `start` to the LOOP at `end`, in the
+// function on top of the call stack. Returns false if we have given up on this loop.
+bool jit_record_start(warp_vm_t *vm, hot_loop_t *loop, int start, int end);
+
+// Reports the instruction at `ip`, about to be run with the given stack and slots. Returns false
+// once recording has stopped, because the trace was compiled or because it was abandoned.
+bool jit_record(
+    warp_vm_t *vm,
+    const uint8_t *ip,
+    const warp_value_t *sp,
+    const warp_value_t *slots
+);
+
+// Stops recording without compiling anything, and counts that as a failed attempt.
+void jit_record_abort(warp_vm_t *vm);
+
+// Runs `loop`'s trace in `frame`, from the loop header. Returns the offset at which the interpreter
+// should resume, or -1 if a runtime error was reported.
+int jit_run_trace(warp_vm_t *vm, call_frame_t *frame, hot_loop_t *loop);
+
+#endif
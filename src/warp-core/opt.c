@@ -0,0 +1,1481 @@
+//===--------------------------------------------------------------------------------------------===
+// opt.c - Optimization passes over the basic-block representation
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "opt.h"
+#include "value_impl.h"
+#include "warp_internal.h"
+#include <math.h>
+#include <string.h>
+
+// Passes open up work for each other (propagating a constant lets it be folded, folding a branch
+// leaves dead code behind), so they are run again until nothing changes, or for this many rounds.
+#define OPT_MAX_ROUNDS (4)
+
+// Locals are addressed with a single byte, so those are the only slots passes keep track of.
+#define OPT_SLOTS (UINT8_MAX + 1)
+
+uint32_t opt_passes(const warp_cfg_t *cfg) {
+    ASSERT(cfg);
+
+    uint32_t passes = 0;
+    switch(cfg->compiler.level) {
+    case WARP_OPT_FULL:
+        passes |= WARP_PASS_COPY_PROP | WARP_PASS_DEAD_STORES | WARP_PASS_INLINE;
+        passes |= WARP_PASS_NUM_TYPES | WARP_PASS_LOOPS;
+        // fallthrough
+    case WARP_OPT_BASIC:
+        passes |= WARP_PASS_FOLD | WARP_PASS_DEAD_CODE;
+        // fallthrough
+    case WARP_OPT_DEFAULT:
+    case WARP_OPT_NONE:
+        break;
+    }
+    return passes & ~cfg->compiler.disabled_passes;
+}
+
+// The most values `ir` ever has on the stack, or `least` if that's more.
+static int max_depth(const ir_fn_t *ir, int least) {
+    for(int i = 0; i < ir->count; ++i) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->removed || instr->depth < 0) continue;
+        ir_stack_use_t use = ir_stack_use(instr);
+        int after = instr->depth - use.pops + use.pushes;
+        if(instr->depth > least) least = instr->depth;
+        if(after > least) least = after;
+    }
+    return least;
+}
+
+void opt_fn(warp_vm_t *vm, warp_fn_t *fn, uint32_t passes) {
+    ASSERT(vm);
+    ASSERT(fn);
+    // Inlining happens as calls are compiled, not in here.
+    if(!(passes & ~WARP_PASS_INLINE)) return;
+
+    ir_fn_t ir;
+    ir_build(vm, &ir, &fn->chunk, fn->arity);
+    for(int round = 0; round < OPT_MAX_ROUNDS; ++round) {
+        bool changed = false;
+        if(passes & WARP_PASS_FOLD) changed |= opt_fold_constants(&ir);
+        if(passes & WARP_PASS_COPY_PROP) changed |= opt_propagate_copies(&ir);
+        if(passes & WARP_PASS_DEAD_STORES) changed |= opt_remove_dead_stores(&ir);
+        if(passes & WARP_PASS_DEAD_CODE) changed |= opt_remove_dead_code(&ir);
+        if(!changed) break;
+    }
+    if(passes & WARP_PASS_NUM_TYPES) opt_specialize_numbers(&ir);
+    if((passes & WARP_PASS_LOOPS) && opt_optimize_loops(&ir)) {
+        fn->max_slots = max_depth(&ir, fn->max_slots);
+    }
+    ir_lower(&ir);
+    ir_free(&ir);
+}
+
+// MARK: - Constant folding
+
+static bool const_value(const ir_fn_t *ir, int idx, warp_value_t *out) {
+    if(idx < 0) return false;
+    const ir_instr_t *instr = &ir->code[idx];
+    switch(instr->op) {
+    case OP_CONST: *out = ir->chunk->constants.data[instr->args[0]]; return true;
+    case OP_NIL: *out = WARP_NIL_VAL; return true;
+    case OP_TRUE: *out = WARP_TRUE_VAL; return true;
+    case OP_FALSE: *out = WARP_FALSE_VAL; return true;
+    default: return false;
+    }
+}
+
+// Turns `instr` into an instruction that pushes `value`. Fails when the constant table is full.
+static bool set_const(ir_fn_t *ir, ir_instr_t *instr, warp_value_t value) {
+    if(WARP_IS_NIL(value)) {
+        instr->op = OP_NIL;
+    } else if(WARP_IS_BOOL(value)) {
+        instr->op = WARP_AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    } else {
+        int idx = chunk_add_const(ir->vm, ir->chunk, value);
+        if(idx >= UINT8_MAX) return false;
+        instr->op = OP_CONST;
+        instr->args[0] = (uint8_t)idx;
+    }
+    return true;
+}
+
+static bool is_foldable_binary(uint8_t op) {
+    switch(op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_EQ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool opt_fold_binary(warp_vm_t *vm, uint8_t op, warp_value_t a, warp_value_t b, warp_value_t *out) {
+    ASSERT(vm);
+    ASSERT(out);
+    
+    if(op == OP_EQ) {
+        *out = WARP_BOOL_VAL(value_equals(a, b));
+        return true;
+    }
+    if(op == OP_ADD && WARP_IS_STR(a) && WARP_IS_STR(b)) {
+        *out = WARP_OBJ_VAL(warp_concat_str(vm, WARP_AS_STR(a), WARP_AS_STR(b)));
+        return true;
+    }
+    if(!WARP_ARE_NUMS(a, b)) return false;
+
+    switch(op) {
+    case OP_ADD: *out = value_add(a, b); return true;
+    case OP_SUB: *out = value_sub(a, b); return true;
+    case OP_MUL: *out = value_mul(a, b); return true;
+    case OP_DIV: *out = value_div(a, b); return true;
+    case OP_LT: *out = WARP_BOOL_VAL(VALUE_COMPARE(a, <, b)); return true;
+    case OP_GT: *out = WARP_BOOL_VAL(VALUE_COMPARE(a, >, b)); return true;
+    case OP_LTEQ: *out = WARP_BOOL_VAL(VALUE_COMPARE(a, <=, b)); return true;
+    case OP_GTEQ: *out = WARP_BOOL_VAL(VALUE_COMPARE(a, >=, b)); return true;
+    default: return false;
+    }
+}
+
+bool opt_fold_unary(uint8_t op, warp_value_t a, warp_value_t *out) {
+    ASSERT(out);
+    
+    switch(op) {
+    case OP_NEG:
+        if(!WARP_IS_NUM(a)) return false;
+        *out = value_neg(a);
+        return true;
+    case OP_NOT:
+        *out = WARP_BOOL_VAL(value_is_falsey(a));
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool opt_fold_constants(ir_fn_t *ir) {
+    ASSERT(ir);
+    bool changed = false;
+
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed || instr->depth < 0) continue;
+
+        int b = ir_prev_in_block(ir, i);
+        warp_value_t vb;
+        if(!const_value(ir, b, &vb)) continue;
+
+        warp_value_t result;
+        switch(instr->op) {
+        case OP_NEG:
+        case OP_NOT:
+            if(!opt_fold_unary(instr->op, vb, &result) || !set_const(ir, instr, result)) break;
+            ir->code[b].removed = true;
+            changed = true;
+            break;
+
+        // The condition stays on the stack either way, we only need to know where we go next.
+        case OP_JMP_FALSE:
+            if(value_is_falsey(vb)) {
+                instr->op = OP_JMP;
+            } else {
+                instr->removed = true;
+            }
+            changed = true;
+            break;
+
+        default:
+            if(is_foldable_binary(instr->op)) {
+                int a = ir_prev_in_block(ir, b);
+                warp_value_t va;
+                if(!const_value(ir, a, &va)) break;
+                if(!opt_fold_binary(ir->vm, instr->op, va, vb, &result)) break;
+                if(!set_const(ir, instr, result)) break;
+                ir->code[a].removed = true;
+                ir->code[b].removed = true;
+                changed = true;
+            }
+            break;
+        }
+    }
+
+    if(changed) ir_update(ir);
+    return changed;
+}
+
+// MARK: - Copy propagation
+
+typedef enum {
+    KNOWN_NOTHING,
+    KNOWN_CONST,    // The slot holds a constant.
+    KNOWN_LOCAL,    // The slot holds the same value as another local.
+} known_kind_t;
+
+typedef struct {
+    known_kind_t    kind;
+    int             slot;
+    warp_value_t    value;
+} known_t;
+
+// Forgets what we knew about `slot`, and about any slot that was a copy of it.
+static void forget_slot(known_t *known, int slot) {
+    if(slot >= OPT_SLOTS) return;
+    known[slot].kind = KNOWN_NOTHING;
+    for(int i = 0; i < OPT_SLOTS; ++i) {
+        if(known[i].kind == KNOWN_LOCAL && known[i].slot == slot) known[i].kind = KNOWN_NOTHING;
+    }
+}
+
+static known_t slot_value(const known_t *known, int slot) {
+    if(slot >= OPT_SLOTS) return (known_t){.kind=KNOWN_NOTHING};
+    return known[slot];
+}
+
+// Checks whether the instruction at `idx` pushes a constant, or a local we know the value of.
+static bool is_known_const(const ir_fn_t *ir, const known_t *known, int idx) {
+    warp_value_t value;
+    if(idx < 0 || idx >= ir->count) return false;
+    if(const_value(ir, idx, &value)) return true;
+    return ir->code[idx].op == OP_GET_LOCAL && known[ir->code[idx].args[0]].kind == KNOWN_CONST;
+}
+
+// Reading a local is just as cheap as pushing a constant, and the peephole pass has better
+// superinstructions for locals. We only swap one for the other when it lets the value be folded.
+static bool feeds_fold(const ir_fn_t *ir, const known_t *known, int idx) {
+    int block = ir->code[idx].block;
+    int next = ir_next(ir, idx);
+    if(next >= ir->count || ir->code[next].block != block) return false;
+
+    switch(ir->code[next].op) {
+    case OP_NEG:
+    case OP_NOT:
+    case OP_JMP_FALSE:
+        return true;
+    default:
+        break;
+    }
+    if(is_foldable_binary(ir->code[next].op)) {
+        return is_known_const(ir, known, ir_prev_in_block(ir, idx));
+    }
+
+    int after = ir_next(ir, next);
+    return is_known_const(ir, known, next)
+        && after < ir->count
+        && ir->code[after].block == block
+        && is_foldable_binary(ir->code[after].op);
+}
+
+static bool propagate_in_block(ir_fn_t *ir, const ir_block_t *block, known_t *known) {
+    bool changed = false;
+    for(int i = 0; i < OPT_SLOTS; ++i) {
+        known[i].kind = KNOWN_NOTHING;
+    }
+
+    for(int i = block->start; i < block->end; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed || instr->depth < 0) continue;
+        int depth = instr->depth;
+
+        if(instr->op == OP_GET_LOCAL) {
+            known_t value = known[instr->args[0]];
+            if(value.kind == KNOWN_CONST) {
+                changed |= feeds_fold(ir, known, i) && set_const(ir, instr, value.value);
+            } else if(value.kind == KNOWN_LOCAL) {
+                instr->args[0] = (uint8_t)value.slot;
+                changed = true;
+            }
+        }
+
+        // What the instruction leaves behind, worked out before anything it writes is forgotten.
+        known_t result = {.kind=KNOWN_NOTHING};
+        warp_value_t value;
+        if(const_value(ir, i, &value)) {
+            result = (known_t){.kind=KNOWN_CONST, .value=value};
+        } else if(instr->op == OP_GET_LOCAL && known[instr->args[0]].kind == KNOWN_CONST) {
+            result = known[instr->args[0]];
+        } else if(instr->op == OP_GET_LOCAL) {
+            result = (known_t){.kind=KNOWN_LOCAL, .slot=instr->args[0]};
+        } else if(instr->op == OP_DUP || instr->op == OP_SET_LOCAL || instr->op == OP_POP_LOCAL) {
+            result = slot_value(known, depth - 1);
+        }
+
+        ir_stack_use_t use = ir_stack_use(instr);
+        int written = depth - use.pops;
+        for(int slot = written; slot < written + use.pushes; ++slot) {
+            forget_slot(known, slot);
+        }
+
+        switch(instr->op) {
+        case OP_SET_LOCAL:
+        case OP_POP_LOCAL:
+            forget_slot(known, instr->args[0]);
+            if(result.kind == KNOWN_LOCAL && result.slot == instr->args[0]) break;
+            known[instr->args[0]] = result;
+            break;
+
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+        case OP_DIV_RR:
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK:
+        case OP_DIV_RK:
+            forget_slot(known, instr->args[0]);
+            break;
+
+        default:
+            if(use.pushes == 1 && written < OPT_SLOTS) known[written] = result;
+            break;
+        }
+    }
+    return changed;
+}
+
+bool opt_propagate_copies(ir_fn_t *ir) {
+    ASSERT(ir);
+    known_t *known = ALLOCATE_ARRAY(ir->vm, known_t, OPT_SLOTS);
+
+    bool changed = false;
+    for(int b = 0; b < ir->block_count; ++b) {
+        changed |= propagate_in_block(ir, &ir->blocks[b], known);
+    }
+
+    FREE_ARRAY(ir->vm, known, known_t, OPT_SLOTS);
+    return changed;
+}
+
+// MARK: - Dead store elimination
+
+typedef struct {
+    uint64_t        bits[OPT_SLOTS / 64];
+} slot_set_t;
+
+static inline void slot_add(slot_set_t *set, int slot) {
+    if(slot < OPT_SLOTS) set->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static inline void slot_remove(slot_set_t *set, int slot) {
+    if(slot < OPT_SLOTS) set->bits[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+static inline bool slot_has(const slot_set_t *set, int slot) {
+    return slot < OPT_SLOTS && (set->bits[slot / 64] & ((uint64_t)1 << (slot % 64)));
+}
+
+// Steps liveness backward over `instr`: the slots it writes aren't live before it, unless it reads
+// them too.
+static void step_liveness(const ir_instr_t *instr, slot_set_t *live) {
+    ir_stack_use_t use = ir_stack_use(instr);
+    int depth = instr->depth;
+    int written = depth - use.pops;
+
+    for(int slot = written; slot < written + use.pushes; ++slot) {
+        slot_remove(live, slot);
+    }
+    switch(instr->op) {
+    case OP_SET_LOCAL:
+    case OP_POP_LOCAL:
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        slot_remove(live, instr->args[0]);
+        break;
+    default:
+        break;
+    }
+
+    for(int slot = depth - use.reads; slot < depth; ++slot) {
+        slot_add(live, slot);
+    }
+    switch(instr->op) {
+    case OP_GET_LOCAL:
+        slot_add(live, instr->args[0]);
+        break;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+        slot_add(live, instr->args[2]);
+        // fallthrough
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        slot_add(live, instr->args[1]);
+        break;
+    case OP_ADD_LL:
+        slot_add(live, instr->args[0]);
+        slot_add(live, instr->args[1]);
+        break;
+    default:
+        break;
+    }
+}
+
+// Computes the slots that are live at the end of `block`, from what is live at the start of the
+// blocks it leads to.
+static slot_set_t live_out(const ir_fn_t *ir, const slot_set_t *live_in, int block) {
+    slot_set_t live = {{0}};
+    for(int s = 0; s < 2; ++s) {
+        int succ = ir->blocks[block].succ[s];
+        if(succ < 0) continue;
+        for(int i = 0; i < OPT_SLOTS / 64; ++i) {
+            live.bits[i] |= live_in[succ].bits[i];
+        }
+    }
+    return live;
+}
+
+bool opt_remove_dead_stores(ir_fn_t *ir) {
+    ASSERT(ir);
+    if(ir->block_count == 0) return false;
+
+    slot_set_t *live_in = ALLOCATE_ARRAY(ir->vm, slot_set_t, ir->block_count);
+    for(int b = 0; b < ir->block_count; ++b) {
+        live_in[b] = (slot_set_t){{0}};
+    }
+
+    // Liveness only ever grows, so this settles after a few sweeps. Going backward gets there
+    // sooner, since that's the direction it flows in.
+    bool growing = true;
+    while(growing) {
+        growing = false;
+        for(int b = ir->block_count - 1; b >= 0; --b) {
+            slot_set_t live = live_out(ir, live_in, b);
+            for(int i = ir->blocks[b].end - 1; i >= ir->blocks[b].start; --i) {
+                const ir_instr_t *instr = &ir->code[i];
+                if(instr->removed || instr->depth < 0) continue;
+                step_liveness(instr, &live);
+            }
+            for(int i = 0; i < OPT_SLOTS / 64; ++i) {
+                if(live.bits[i] == live_in[b].bits[i]) continue;
+                live_in[b].bits[i] = live.bits[i];
+                growing = true;
+            }
+        }
+    }
+
+    // SET_LOCAL leaves its value on the stack, so dropping one doesn't change anything else.
+    // POP_LOCAL still has to pop it.
+    bool changed = false;
+    for(int b = 0; b < ir->block_count; ++b) {
+        slot_set_t live = live_out(ir, live_in, b);
+        for(int i = ir->blocks[b].end - 1; i >= ir->blocks[b].start; --i) {
+            ir_instr_t *instr = &ir->code[i];
+            if(instr->removed || instr->depth < 0) continue;
+            if(instr->op == OP_SET_LOCAL && !slot_has(&live, instr->args[0])) {
+                instr->removed = true;
+                changed = true;
+                continue;
+            }
+            if(instr->op == OP_POP_LOCAL && !slot_has(&live, instr->args[0])) {
+                instr->op = OP_POP;
+                changed = true;
+                continue;
+            }
+            step_liveness(instr, &live);
+        }
+    }
+
+    FREE_ARRAY(ir->vm, live_in, slot_set_t, ir->block_count);
+    if(changed) ir_update(ir);
+    return changed;
+}
+
+// MARK: - Dead code elimination
+
+// Instructions that can't fail and have no effect beyond the stack.
+static bool is_pure(uint8_t op) {
+    switch(op) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_DUP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQ:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Drops whatever computed the value the POP at `idx` throws away, if it can be.
+static bool remove_popped_value(ir_fn_t *ir, int idx) {
+    bool changed = false;
+    for(;;) {
+        int prev = ir_prev_in_block(ir, idx);
+        if(prev < 0 || !is_pure(ir->code[prev].op)) return changed;
+
+        ir_instr_t *instr = &ir->code[prev];
+        ir_stack_use_t use = ir_stack_use(instr);
+        changed = true;
+        if(use.pops == 0) {
+            // A push that is popped straight away.
+            instr->removed = true;
+            ir->code[idx].removed = true;
+            return true;
+        }
+
+        // The operands are popped instead of the result. NOT takes one, which the POP takes care
+        // of. EQ takes two, so it becomes a POP of its own.
+        if(use.pops == 1) {
+            instr->removed = true;
+        } else {
+            instr->op = OP_POP;
+            idx = prev;
+        }
+    }
+}
+
+bool opt_remove_dead_code(ir_fn_t *ir) {
+    ASSERT(ir);
+    bool changed = false;
+
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+
+        if(instr->depth < 0) {
+            instr->removed = true;
+            changed = true;
+            continue;
+        }
+
+        // Jumps to a jump can go straight to where the second one goes. Plain jumps only ever go
+        // forward, so this can't go round in circles.
+        if(instr->op == OP_JMP || instr->op == OP_JMP_FALSE) {
+            while(ir->code[instr->target].op == OP_JMP && instr->target != i) {
+                instr->target = ir->code[instr->target].target;
+                changed = true;
+            }
+            if(instr->target == ir_next(ir, i)) {
+                instr->removed = true;
+                changed = true;
+            }
+            continue;
+        }
+
+        // Blocks that don't declare any locals have nothing to clean up.
+        bool drops_locals = instr->op == OP_BLOCK || instr->op == OP_DROP;
+        if(drops_locals && instr->args[0] == 0 && instr->args[1] == 0) {
+            instr->removed = true;
+            changed = true;
+            continue;
+        }
+
+        if(instr->op == OP_POP) {
+            changed |= remove_popped_value(ir, i);
+        }
+    }
+
+    if(changed) ir_update(ir);
+    return changed;
+}
+
+// MARK: - Type inference
+
+// What we know about the value in a slot. Slots that haven't been reached yet are TYPE_NONE, and
+// slots that can hold more than one kind of value are TYPE_ANY.
+typedef enum {
+    TYPE_NONE,
+    TYPE_NUM,
+    TYPE_BOOL,
+    TYPE_STR,
+    TYPE_ANY,
+} type_t;
+
+typedef struct {
+    uint8_t         slot[OPT_SLOTS];
+} slot_types_t;
+
+static type_t join_type(type_t a, type_t b) {
+    if(a == b || b == TYPE_NONE) return a;
+    if(a == TYPE_NONE) return b;
+    return TYPE_ANY;
+}
+
+static type_t value_type(warp_value_t value) {
+    if(WARP_IS_NUM(value)) return TYPE_NUM;
+    if(WARP_IS_BOOL(value)) return TYPE_BOOL;
+    if(WARP_IS_STR(value)) return TYPE_STR;
+    return TYPE_ANY;
+}
+
+// `+` is the only operator that works on something other than numbers.
+static type_t add_type(type_t a, type_t b) {
+    if(a == TYPE_NUM && b == TYPE_NUM) return TYPE_NUM;
+    if(a == TYPE_STR && b == TYPE_STR) return TYPE_STR;
+    return TYPE_ANY;
+}
+
+static type_t slot_type(const slot_types_t *types, int slot) {
+    return slot >= 0 && slot < OPT_SLOTS ? types->slot[slot] : TYPE_ANY;
+}
+
+static void set_slot_type(slot_types_t *types, int slot, type_t type) {
+    if(slot >= 0 && slot < OPT_SLOTS) types->slot[slot] = type;
+}
+
+static uint8_t unchecked_op(uint8_t op) {
+    switch(op) {
+    case OP_ADD:
+    case OP_ADD_NUM_NUM: return OP_ADD_NN;
+    case OP_SUB: return OP_SUB_NN;
+    case OP_MUL: return OP_MUL_NN;
+    case OP_DIV: return OP_DIV_NN;
+    case OP_LT: return OP_LT_NN;
+    case OP_GT: return OP_GT_NN;
+    case OP_LTEQ: return OP_LTEQ_NN;
+    case OP_GTEQ: return OP_GTEQ_NN;
+    default: return op;
+    }
+}
+
+// Steps the slot types forward over `instr`. Checked arithmetic only carries on with numbers, so
+// whatever it leaves behind is a number.
+static void step_types(const ir_fn_t *ir, const ir_instr_t *instr, slot_types_t *types) {
+    const warp_value_t *consts = ir->chunk->constants.data;
+    int depth = instr->depth;
+    type_t top = slot_type(types, depth - 1);
+    type_t under = slot_type(types, depth - 2);
+
+    type_t result = TYPE_ANY;
+    switch(instr->op) {
+    case OP_CONST: result = value_type(consts[instr->args[0]]); break;
+    case OP_GET_LOCAL: result = slot_type(types, instr->args[0]); break;
+
+    case OP_DUP:
+    case OP_BLOCK:
+        result = top;
+        break;
+
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQ:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+        result = TYPE_BOOL;
+        break;
+
+    case OP_NEG:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_SUB_K:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+        result = TYPE_NUM;
+        break;
+
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+        result = add_type(under, top);
+        break;
+
+    case OP_ADD_K:
+        result = add_type(top, value_type(consts[instr->args[0]]));
+        break;
+
+    case OP_ADD_LL:
+        result = add_type(slot_type(types, instr->args[0]), slot_type(types, instr->args[1]));
+        break;
+
+    default:
+        break;
+    }
+
+    ir_stack_use_t use = ir_stack_use(instr);
+    int written = depth - use.pops;
+    for(int slot = written; slot < written + use.pushes; ++slot) {
+        set_slot_type(types, slot, result);
+    }
+
+    const uint8_t *args = instr->args;
+    switch(instr->op) {
+    case OP_SET_LOCAL:
+    case OP_POP_LOCAL:
+        set_slot_type(types, args[0], top);
+        break;
+    case OP_ADD_RR:
+        set_slot_type(types, args[0], add_type(slot_type(types, args[1]), slot_type(types, args[2])));
+        break;
+    case OP_ADD_RK:
+        set_slot_type(types, args[0], add_type(slot_type(types, args[1]), value_type(consts[args[2]])));
+        break;
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        set_slot_type(types, args[0], TYPE_NUM);
+        break;
+    default:
+        break;
+    }
+}
+
+// Merges `types` into what we know at the start of `block`. Returns whether that changed.
+static bool join_types(slot_types_t *entry, const slot_types_t *types) {
+    bool changed = false;
+    for(int i = 0; i < OPT_SLOTS; ++i) {
+        type_t type = join_type(entry->slot[i], types->slot[i]);
+        if(type == entry->slot[i]) continue;
+        entry->slot[i] = type;
+        changed = true;
+    }
+    return changed;
+}
+
+bool opt_specialize_numbers(ir_fn_t *ir) {
+    ASSERT(ir);
+    if(ir->block_count == 0) return false;
+
+    slot_types_t *entry = ALLOCATE_ARRAY(ir->vm, slot_types_t, ir->block_count);
+    for(int b = 0; b < ir->block_count; ++b) {
+        for(int i = 0; i < OPT_SLOTS; ++i) {
+            entry[b].slot[i] = TYPE_NONE;
+        }
+    }
+    // The callee and the parameters could be anything.
+    for(int i = 0; i <= ir->arity && i < OPT_SLOTS; ++i) {
+        entry[0].slot[i] = TYPE_ANY;
+    }
+
+    // Types only ever get less precise, so this settles after a few trips round each loop.
+    i32_buf_t work;
+    i32_buf_init(&work);
+    i32_buf_write(ir->vm, &work, 0);
+    while(work.count > 0) {
+        int b = work.data[--work.count];
+        const ir_block_t *block = &ir->blocks[b];
+        slot_types_t types = entry[b];
+
+        for(int i = block->start; i < block->end; ++i) {
+            const ir_instr_t *instr = &ir->code[i];
+            if(instr->removed || instr->depth < 0) continue;
+            step_types(ir, instr, &types);
+        }
+        for(int s = 0; s < 2; ++s) {
+            int succ = block->succ[s];
+            if(succ >= 0 && join_types(&entry[succ], &types)) i32_buf_write(ir->vm, &work, succ);
+        }
+    }
+    i32_buf_fini(ir->vm, &work);
+
+    bool changed = false;
+    for(int b = 0; b < ir->block_count; ++b) {
+        const ir_block_t *block = &ir->blocks[b];
+        slot_types_t types = entry[b];
+
+        for(int i = block->start; i < block->end; ++i) {
+            ir_instr_t *instr = &ir->code[i];
+            if(instr->removed || instr->depth < 0) continue;
+
+            uint8_t op = unchecked_op(instr->op);
+            if(op != instr->op
+               && slot_type(&types, instr->depth - 1) == TYPE_NUM
+               && slot_type(&types, instr->depth - 2) == TYPE_NUM) {
+                instr->op = op;
+                changed = true;
+            }
+            step_types(ir, instr, &types);
+        }
+    }
+
+    FREE_ARRAY(ir->vm, entry, slot_types_t, ir->block_count);
+    return changed;
+}
+
+// MARK: - Loop optimization
+
+// Each value moved out of a loop takes up a new slot, so we stop at this many.
+#define OPT_MAX_TEMPS (16)
+
+// A loop, the way the compiler lays them out: everything from `entry` to `tail` runs as part of the
+// loop, and every way out of it ends up at `exit`, past the POP and NIL that leave its value.
+typedef struct {
+    int             head;       // Where the back edge goes.
+    int             tail;       // The back edge.
+    int             entry;      // The head, or the JMP down to the test of a rotated loop.
+    int             first;      // The block that runs first every time the loop is entered.
+    int             exit;
+    int             depth;      // Stack depth on the way in, which is where new slots go.
+    bool            has_calls;
+    slot_set_t      written;    // Locals set from inside the loop.
+} loop_t;
+
+// A jump to an instruction that has been removed ends up at whatever follows it.
+static int live_index(const ir_fn_t *ir, int idx) {
+    return idx < ir->count && ir->code[idx].removed ? ir_next(ir, idx) : idx;
+}
+
+static bool is_call(uint8_t op) {
+    return op == OP_CALL || op == OP_CALL_GLOB || op == OP_TAIL_CALL;
+}
+
+static bool writes_slot(uint8_t op) {
+    switch(op) {
+    case OP_SET_LOCAL:
+    case OP_POP_LOCAL:
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Works out the shape of the loop closed by the back edge at `tail`, and checks that it's one we
+// can add slots to: entered only at the top, left only for `exit`, and with room on the stack.
+static bool find_loop(const ir_fn_t *ir, int tail, loop_t *loop) {
+    int head = live_index(ir, ir->code[tail].target);
+    if(head >= tail || ir->code[head].depth < 0) return false;
+
+    // `continue` jumps back to the head too: the last back edge is the one that closes the loop.
+    for(int i = ir_next(ir, tail); i < ir->count; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(warp_jumps_back(instr->op) && live_index(ir, instr->target) == head) return false;
+    }
+
+    loop->head = head;
+    loop->tail = tail;
+    loop->entry = head;
+    loop->has_calls = false;
+    loop->written = (slot_set_t){{0}};
+
+    int first = head;
+    for(int i = head - 1; i >= 0; --i) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+        int target = instr->op == OP_JMP ? live_index(ir, instr->target) : -1;
+        if(target > head && target <= tail) {
+            loop->entry = i;
+            first = target;
+        }
+        break;
+    }
+    loop->first = ir->code[first].block;
+    loop->depth = ir->code[loop->entry].depth;
+    if(loop->depth <= 0) return false;
+
+    bool is_conditional = ir->code[tail].op != OP_LOOP;
+    loop->exit = is_conditional ? ir_next(ir, tail) : -1;
+    for(int i = loop->entry; i <= tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->depth < 0) continue;
+        if(instr->depth < loop->depth || instr->depth >= UINT8_MAX - 2) return false;
+
+        if(is_call(instr->op)) loop->has_calls = true;
+        if(writes_slot(instr->op)) slot_add(&loop->written, instr->args[0]);
+        if(!ir_is_jump(instr->op)) continue;
+
+        int target = live_index(ir, instr->target);
+        if(target < loop->entry) return false;
+        if(target > tail && target > loop->exit) loop->exit = target;
+    }
+    if(loop->exit < 0 || loop->exit >= ir->count) return false;
+
+    int exit_depth = ir->code[loop->exit].depth;
+    if(exit_depth != loop->depth && exit_depth != loop->depth + 1) return false;
+
+    // Between the back edge and the exit, there's only the loop leaving its value behind.
+    for(int i = ir_next(ir, tail); i < loop->exit; i = ir_next(ir, i)) {
+        uint8_t op = ir->code[i].op;
+        if(op != OP_POP && op != OP_NIL) return false;
+    }
+
+    // Nothing else jumps into the middle of the loop, or to the way out of it.
+    for(int i = 0; i < ir->count; ++i) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->removed || !ir_is_jump(instr->op)) continue;
+        if(i >= loop->entry && i <= tail) continue;
+        int raw = instr->target;
+        int target = live_index(ir, raw);
+        if(raw > loop->entry && raw < loop->exit) return false;
+        if(target > loop->entry && target < loop->exit) return false;
+    }
+    return true;
+}
+
+// Whether anything other than the code right before the loop can get into it.
+static bool is_entered_from_elsewhere(const ir_fn_t *ir, const loop_t *loop) {
+    for(int i = 0; i < ir->count; ++i) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->removed || !ir_is_jump(instr->op)) continue;
+        if(i >= loop->entry && i <= loop->tail) continue;
+        if(live_index(ir, instr->target) == loop->entry) return true;
+    }
+    return false;
+}
+
+// Makes room for a new local in slot `loop->depth`, by moving the loop's own locals up one.
+static void open_temp(ir_fn_t *ir, const loop_t *loop) {
+    int temp = loop->depth;
+    for(int i = loop->entry; i <= loop->tail; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+
+        int count = 0;
+        switch(instr->op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_POP_LOCAL:
+            count = 1;
+            break;
+        case OP_ADD_RK:
+        case OP_SUB_RK:
+        case OP_MUL_RK:
+        case OP_DIV_RK:
+        case OP_ADD_LL:
+            count = 2;
+            break;
+        case OP_ADD_RR:
+        case OP_SUB_RR:
+        case OP_MUL_RR:
+        case OP_DIV_RR:
+            count = 3;
+            break;
+        default:
+            break;
+        }
+        for(int a = 0; a < count; ++a) {
+            if(instr->args[a] >= temp) instr->args[a] += 1;
+        }
+    }
+}
+
+// Adds the code that drops the new local once the loop is done, and sends the ways out of the loop
+// through it. The loop's value, if it left one, stays on top.
+static void close_temp(ir_fn_t *ir, const loop_t *loop) {
+    bool has_value = ir->code[loop->exit].depth > loop->depth;
+    int idx = ir_insert(ir, loop->exit, 1);
+    ir_instr_t *drop = &ir->code[idx];
+    if(has_value) {
+        drop->op = OP_BLOCK;
+        drop->args[0] = 1;
+        drop->args[1] = 0;
+    } else {
+        drop->op = OP_POP;
+    }
+
+    for(int i = loop->entry; i <= loop->tail; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(!instr->removed && ir_is_jump(instr->op) && instr->target == idx + 1) instr->target = idx;
+    }
+}
+
+// Puts `count` instructions that compute the new local's first value in front of the loop, which
+// now ends at `tail`. Only code coming from outside the loop runs them.
+static void init_temp(ir_fn_t *ir, const loop_t *loop, const ir_instr_t *code, int count, int tail) {
+    int idx = ir_insert(ir, loop->entry, count);
+    for(int i = 0; i < count; ++i) {
+        ir_instr_t *instr = &ir->code[idx + i];
+        instr->op = code[i].op;
+        instr->line = code[i].line;
+        memcpy(instr->args, code[i].args, sizeof(instr->args));
+    }
+
+    int start = idx + count;
+    for(int i = 0; i < ir->count; ++i) {
+        ir_instr_t *instr = &ir->code[i];
+        if(i >= start && i <= tail + count) continue;
+        if(!instr->removed && ir_is_jump(instr->op) && instr->target == start) instr->target = idx;
+    }
+}
+
+// MARK: Invariant code motion
+
+static bool is_hoistable(uint8_t op) {
+    switch(op) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOB:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_EQ:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POW:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+    case OP_ADD_LL:
+    case OP_ADD_K:
+    case OP_SUB_K:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Instructions that can't fail, and that do nothing anyone could see if the code after them fails.
+// Code can only be moved ahead of the loop when it can't fail, or when it's the first thing that
+// could in the code that runs every time the loop is entered: otherwise the error changes, or
+// happens when it wouldn't have.
+static bool is_quiet(uint8_t op) {
+    switch(op) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_POP_LOCAL:
+    case OP_DUP:
+    case OP_POP:
+    case OP_BLOCK:
+    case OP_DROP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQ:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+    case OP_JMP:
+    case OP_JMP_FALSE:
+    case OP_LOOP:
+    case OP_LOOP_IF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool stores_global(const ir_fn_t *ir, const loop_t *loop, const uint8_t *name) {
+    for(int i = loop->entry; i <= loop->tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        switch(instr->op) {
+        case OP_DEF_GLOB:
+        case OP_SET_GLOB:
+        case OP_POP_GLOB:
+            if(instr->args[0] == name[0] && instr->args[1] == name[1]) return true;
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+// Whether `instr` gives the same value every time round the loop, given that its operands do.
+static bool is_invariant(const ir_fn_t *ir, const loop_t *loop, const ir_instr_t *instr) {
+    if(!is_hoistable(instr->op)) return false;
+    const uint8_t *args = instr->args;
+    switch(instr->op) {
+    case OP_GET_LOCAL:
+        return args[0] < loop->depth && !slot_has(&loop->written, args[0]);
+    case OP_ADD_LL:
+        return args[0] < loop->depth && !slot_has(&loop->written, args[0])
+            && args[1] < loop->depth && !slot_has(&loop->written, args[1]);
+    case OP_GET_GLOB:
+        return !loop->has_calls && !stores_global(ir, loop, args);
+    default:
+        return true;
+    }
+}
+
+// Moves the instructions from `start` to `end`, which compute a single value, out in front of the
+// loop. The loop reads that value from a new slot instead.
+static void hoist(ir_fn_t *ir, const loop_t *loop, int start, int end) {
+    int count = 0;
+    for(int i = start; i <= end; ++i) {
+        if(!ir->code[i].removed) count += 1;
+    }
+    ir_instr_t *code = ALLOCATE_ARRAY(ir->vm, ir_instr_t, count);
+    for(int i = start, n = 0; i <= end; ++i) {
+        if(!ir->code[i].removed) code[n++] = ir->code[i];
+    }
+
+    open_temp(ir, loop);
+    for(int i = start; i < end; ++i) {
+        ir->code[i].removed = true;
+    }
+    ir->code[end].op = OP_GET_LOCAL;
+    ir->code[end].args[0] = (uint8_t)loop->depth;
+
+    close_temp(ir, loop);
+    init_temp(ir, loop, code, count, loop->tail);
+    FREE_ARRAY(ir->vm, code, ir_instr_t, count);
+}
+
+// Looks for the first invariant expression in the loop worth moving out of it, and moves it.
+static bool hoist_invariant(ir_fn_t *ir, const loop_t *loop) {
+    // For each value on the stack: whether it's invariant, where the code computing it starts and
+    // ends, and whether any of that code could fail.
+    bool invariant[OPT_SLOTS];
+    bool fails[OPT_SLOTS];
+    int from[OPT_SLOTS];
+    int to[OPT_SLOTS];
+
+    int first = ir->code[loop->entry].block;
+    int last = ir->code[loop->tail].block;
+    for(int b = first; b <= last; ++b) {
+        const ir_block_t *block = &ir->blocks[b];
+        bool clean = b == loop->first;
+        for(int i = 0; i < OPT_SLOTS; ++i) {
+            invariant[i] = false;
+            fails[i] = false;
+        }
+
+        // The block with the JMP down to the test of a rotated loop starts before the loop.
+        int start = block->start > loop->entry ? block->start : loop->entry;
+        for(int i = start; i < block->end; ++i) {
+            const ir_instr_t *instr = &ir->code[i];
+            if(instr->removed || instr->depth < 0) continue;
+
+            ir_stack_use_t use = ir_stack_use(instr);
+            int depth = instr->depth;
+            int base = depth - use.pops;
+            bool quiet = is_quiet(instr->op);
+
+            bool inputs = true, inputs_fail = false;
+            for(int s = depth - use.reads; s < depth; ++s) {
+                inputs &= invariant[s];
+                inputs_fail |= fails[s];
+            }
+
+            if(inputs && is_invariant(ir, loop, instr) && (quiet || clean)) {
+                invariant[base] = true;
+                fails[base] = inputs_fail || !quiet;
+                from[base] = use.pops > 0 ? from[base] : i;
+                to[base] = i;
+                continue;
+            }
+
+            // Whatever uses an invariant value without being invariant itself is where we stop
+            // and move the value out, if it's more than a single read of a local or constant.
+            bool is_drop = instr->op == OP_POP || instr->op == OP_BLOCK || instr->op == OP_DROP;
+            for(int s = depth - use.reads; s < depth; ++s) {
+                if(!invariant[s]) continue;
+                int start = from[s], end = to[s];
+                bool worth = start != end || ir->code[end].op == OP_GET_GLOB;
+                // Code that could fail can't jump ahead of other code that could, still waiting
+                // lower on the stack.
+                for(int p = loop->depth; p < s && fails[s]; ++p) {
+                    if(invariant[p] && fails[p]) worth = false;
+                }
+                if(worth && !is_drop) {
+                    hoist(ir, loop, start, end);
+                    return true;
+                }
+                if(fails[s]) clean = false;
+            }
+            if(!quiet) clean = false;
+            for(int s = base; s < base + use.pushes; ++s) {
+                invariant[s] = false;
+            }
+        }
+    }
+    return false;
+}
+
+// MARK: Strength reduction
+
+// Strength reduction builds `counter * constant` up by adding, which only gives the same result as
+// multiplying as long as every sum is exact: whole numbers this far from zero always are.
+#define OPT_MAX_REDUCED ((double)INT32_MAX)
+
+static bool is_integral(warp_value_t value) {
+    if(WARP_IS_INT(value)) return true;
+    if(!WARP_IS_NUM(value)) return false;
+    double num = WARP_AS_NUM(value);
+    return num == floor(num) && fabs(num) <= OPT_MAX_REDUCED;
+}
+
+// Finds the constant a counter is stepped by: `slot` is only ever written by adding or subtracting
+// the same kind of whole number.
+static bool is_counter(const ir_fn_t *ir, const loop_t *loop, int slot) {
+    const warp_value_t *consts = ir->chunk->constants.data;
+    bool found = false;
+    for(int i = loop->entry; i <= loop->tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(!writes_slot(instr->op) || instr->args[0] != slot) continue;
+        if(instr->op != OP_ADD_RK && instr->op != OP_SUB_RK) return false;
+        if(instr->args[1] != slot || !is_integral(consts[instr->args[2]])) return false;
+        found = true;
+    }
+    return found;
+}
+
+// Returns the whole number constant `slot` holds when the loop starts, which it was last set to in
+// the code right before the loop, or -1.
+static int entry_const(const ir_fn_t *ir, const loop_t *loop, int slot) {
+    if(is_entered_from_elsewhere(ir, loop)) return -1;
+    const warp_value_t *consts = ir->chunk->constants.data;
+
+    int prev = -1;
+    for(int i = loop->entry - 1; i >= 0; --i) {
+        if(!ir->code[i].removed) {
+            prev = i;
+            break;
+        }
+    }
+    if(prev < 0 || ir_is_jump(ir->code[prev].op) || ir->code[prev].op == OP_RETURN) return -1;
+
+    const ir_block_t *block = &ir->blocks[ir->code[prev].block];
+    for(int i = prev; i >= block->start; --i) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(instr->removed) continue;
+
+        ir_stack_use_t use = ir_stack_use(instr);
+        int written = instr->depth - use.pops;
+        bool pushes = slot >= written && slot < written + use.pushes;
+        bool sets = writes_slot(instr->op) && instr->args[0] == slot;
+        if(!pushes && !sets) continue;
+
+        if(sets) {
+            if(instr->op != OP_SET_LOCAL && instr->op != OP_POP_LOCAL) return -1;
+            int value = ir_prev_in_block(ir, i);
+            if(value < 0) return -1;
+            instr = &ir->code[value];
+        }
+        if(instr->op != OP_CONST || !is_integral(consts[instr->args[0]])) return -1;
+        return instr->args[0];
+    }
+    return -1;
+}
+
+// Whether the instruction at `idx` can run more than once per round of the loop: a loop nested in
+// it, or a `continue`, jumps back over it.
+static bool is_repeated(const ir_fn_t *ir, const loop_t *loop, int idx) {
+    for(int i = idx; i < loop->tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(warp_jumps_back(instr->op) && live_index(ir, instr->target) <= idx) return true;
+    }
+    return false;
+}
+
+// Returns how far from zero counter `slot`, which starts at constant `start`, can get while the
+// loop runs, or -1 when there's no telling. The loop has to go round only while `slot` is on one
+// side of a constant, and every step has to take it towards that constant: it then never gets
+// further than one round of steps past it.
+static double counter_reach(const ir_fn_t *ir, const loop_t *loop, int slot, int start) {
+    const warp_value_t *consts = ir->chunk->constants.data;
+    int test = loop->tail;
+    uint8_t op = OP_LT;
+    if(ir->code[test].op == OP_LOOP_IF) {
+        test = ir_prev_in_block(ir, test);
+        if(test < 0) return -1;
+        op = ir->code[test].op;
+    } else if(ir->code[test].op != OP_LT_LOOP_IF) {
+        return -1;
+    }
+    int b = ir_prev_in_block(ir, test);
+    int a = b < 0 ? -1 : ir_prev_in_block(ir, b);
+    if(a < 0) return -1;
+
+    bool below;
+    switch(op) {
+    case OP_LT:
+    case OP_LTEQ:
+    case OP_LT_NN:
+    case OP_LTEQ_NN:
+        below = true;
+        break;
+    case OP_GT:
+    case OP_GTEQ:
+    case OP_GT_NN:
+    case OP_GTEQ_NN:
+        below = false;
+        break;
+    default:
+        return -1;
+    }
+
+    const ir_instr_t *lhs = &ir->code[a], *rhs = &ir->code[b];
+    int limit;
+    if(lhs->op == OP_GET_LOCAL && lhs->args[0] == slot && rhs->op == OP_CONST) {
+        limit = rhs->args[0];
+    } else if(lhs->op == OP_CONST && rhs->op == OP_GET_LOCAL && rhs->args[0] == slot) {
+        limit = lhs->args[0];
+        below = !below;
+    } else {
+        return -1;
+    }
+    if(!is_integral(consts[limit])) return -1;
+
+    double steps = 0;
+    for(int i = loop->entry; i <= loop->tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(!writes_slot(instr->op) || instr->args[0] != slot) continue;
+        double step = WARP_AS_NUM(consts[instr->args[2]]);
+        if(instr->op == OP_SUB_RK) step = -step;
+        if((below ? step <= 0 : step >= 0) || is_repeated(ir, loop, i)) return -1;
+        steps += fabs(step);
+    }
+    return fmax(fabs(WARP_AS_NUM(consts[start])), fabs(WARP_AS_NUM(consts[limit]))) + steps;
+}
+
+// Matches `slot * constant` at `idx`, in either order, and returns the instruction that does the
+// multiplication.
+static int match_scaled(const ir_fn_t *ir, int idx, int *slot, int *constant) {
+    const ir_instr_t *a = &ir->code[idx];
+    int b = ir_next(ir, idx);
+    if(b >= ir->count || ir->code[b].block != a->block) return -1;
+    int mul = ir_next(ir, b);
+    if(mul >= ir->count || ir->code[mul].block != a->block) return -1;
+    if(ir->code[mul].op != OP_MUL_NN) return -1;
+
+    if(a->op == OP_GET_LOCAL && ir->code[b].op == OP_CONST) {
+        *slot = a->args[0];
+        *constant = ir->code[b].args[0];
+        return mul;
+    }
+    if(a->op == OP_CONST && ir->code[b].op == OP_GET_LOCAL) {
+        *slot = ir->code[b].args[0];
+        *constant = a->args[0];
+        return mul;
+    }
+    return -1;
+}
+
+// Replaces `counter * constant` in the loop with a local that is stepped along with the counter.
+static bool reduce_strength(ir_fn_t *ir, const loop_t *loop) {
+    const warp_value_t *consts = ir->chunk->constants.data;
+    int slot = -1, constant = -1, mul = -1;
+    for(int i = loop->entry; i <= loop->tail && mul < 0; i = ir_next(ir, i)) {
+        if(ir->code[i].depth < 0) continue;
+        mul = match_scaled(ir, i, &slot, &constant);
+        if(mul < 0) continue;
+        if(slot >= loop->depth || !is_integral(consts[constant]) || !is_counter(ir, loop, slot)) {
+            mul = -1;
+            continue;
+        }
+
+        // Multiplying zero by a negative number gives -0, which adding never does.
+        double scale = WARP_AS_NUM(consts[constant]);
+        int start = entry_const(ir, loop, slot);
+        double reach = start < 0 ? -1 : counter_reach(ir, loop, slot, start);
+        if(scale <= 0 || reach < 0 || reach * scale > OPT_MAX_REDUCED) mul = -1;
+    }
+    if(mul < 0) return false;
+
+    // Every step of the counter has to step the new local too, by the step times the constant.
+    i32_buf_t steps;
+    i32_buf_init(&steps);
+    for(int i = loop->entry; i <= loop->tail; i = ir_next(ir, i)) {
+        const ir_instr_t *instr = &ir->code[i];
+        if(!writes_slot(instr->op) || instr->args[0] != slot) continue;
+        warp_value_t step = value_mul(consts[instr->args[2]], consts[constant]);
+        int idx = chunk_add_const(ir->vm, ir->chunk, step);
+        consts = ir->chunk->constants.data;
+        if(idx >= UINT8_MAX) {
+            i32_buf_fini(ir->vm, &steps);
+            return false;
+        }
+        i32_buf_write(ir->vm, &steps, i);
+        i32_buf_write(ir->vm, &steps, idx);
+    }
+
+    ir_instr_t init[3] = {
+        {.op=OP_GET_LOCAL, .args={(uint8_t)slot}, .line=ir->code[mul].line},
+        {.op=OP_CONST, .args={(uint8_t)constant}, .line=ir->code[mul].line},
+        {.op=OP_MUL_NN, .line=ir->code[mul].line},
+    };
+    uint8_t temp = (uint8_t)loop->depth;
+
+    open_temp(ir, loop);
+    for(int i = loop->entry; i <= loop->tail; i = ir_next(ir, i)) {
+        int s, c;
+        int end = match_scaled(ir, i, &s, &c);
+        if(end < 0 || s != slot || c != constant) continue;
+        for(int j = i; j < end; ++j) {
+            ir->code[j].removed = true;
+        }
+        ir->code[end].op = OP_GET_LOCAL;
+        ir->code[end].args[0] = temp;
+        i = end;
+    }
+
+    close_temp(ir, loop);
+    for(int i = steps.count - 2; i >= 0; i -= 2) {
+        int at = steps.data[i];
+        int idx = ir_insert(ir, at + 1, 1);
+        ir_instr_t *step = &ir->code[idx];
+        step->op = ir->code[at].op;
+        step->line = ir->code[at].line;
+        step->args[0] = temp;
+        step->args[1] = temp;
+        step->args[2] = (uint8_t)steps.data[i + 1];
+    }
+    init_temp(ir, loop, init, 3, loop->tail + steps.count / 2);
+    i32_buf_fini(ir->vm, &steps);
+    return true;
+}
+
+bool opt_optimize_loops(ir_fn_t *ir) {
+    ASSERT(ir);
+    bool changed = false;
+    for(int temps = 0; temps < OPT_MAX_TEMPS; ++temps) {
+        // Back edges of inner loops come first, so those are done before the loops around them.
+        bool found = false;
+        for(int i = 0; i < ir->count && !found; ++i) {
+            const ir_instr_t *instr = &ir->code[i];
+            if(instr->removed || instr->depth < 0 || !warp_jumps_back(instr->op)) continue;
+
+            loop_t loop;
+            if(!find_loop(ir, i, &loop)) continue;
+            found = hoist_invariant(ir, &loop) || reduce_strength(ir, &loop);
+        }
+        if(!found) break;
+        ir_update(ir);
+        changed = true;
+    }
+    return changed;
+}
@@ -0,0 +1,49 @@
+//===--------------------------------------------------------------------------------------------===
+// opt.h - Optimization passes over the basic-block representation
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "ir.h"
+#include "types/obj_impl.h"
+
+// Returns the WARP_PASS_* flags of the passes to run for the optimization options in `cfg`.
+uint32_t opt_passes(const warp_cfg_t *cfg);
+
+// Runs the passes in `passes` over `fn`'s freshly compiled bytecode. With no passes, the bytecode
+// is left exactly as it is.
+void opt_fn(warp_vm_t *vm, warp_fn_t *fn, uint32_t passes);
+
+// Computes what the instruction `op` gives for constant operands. Fails for operands the VM would
+// reject, so that the error still happens when the code runs.
+bool opt_fold_binary(warp_vm_t *vm, uint8_t op, warp_value_t a, warp_value_t b, warp_value_t *out);
+bool opt_fold_unary(uint8_t op, warp_value_t a, warp_value_t *out);
+
+// Replaces operations on constants with their result, and conditional jumps on a constant with
+// either nothing or an unconditional jump.
+bool opt_fold_constants(ir_fn_t *ir);
+
+// Replaces reads of a local with the constant or the other local it was last set to, as long as
+// that happened earlier in the same basic block.
+bool opt_propagate_copies(ir_fn_t *ir);
+
+// Drops writes to locals that are never read before they are written again, or dropped.
+bool opt_remove_dead_stores(ir_fn_t *ir);
+
+// Drops code that can't be reached, jumps to the next instruction, and values that are computed
+// without side effects only to be popped.
+bool opt_remove_dead_code(ir_fn_t *ir);
+
+// Works out which slots hold numbers at each instruction, and swaps arithmetic and comparisons on
+// two of them for their unchecked forms. Runs last, since the other passes only know the generic
+// instructions.
+bool opt_specialize_numbers(ir_fn_t *ir);
+
+// Moves code whose result is the same every time round a loop out in front of it, and replaces
+// counters multiplied by a constant with a local that steps along with the counter. Runs after
+// opt_specialize_numbers(), since unchecked arithmetic can be moved where checked arithmetic can't.
+bool opt_optimize_loops(ir_fn_t *ir);
@@ -9,6 +9,7 @@
 #include "parser.h"
 #include "buffers.h"
 #include "diag_impl.h"
+#include "value_impl.h"
 #include <warp/obj.h>
 #include <string.h>
 #include <stdio.h>
@@ -273,7 +274,7 @@ static token_t number(parser_t *parser) {
     }
     
     token_t tok = make_token(parser, TOK_NUMBER);
-    tok.value = WARP_NUM_VAL(strtod(parser->start, NULL));
+    tok.value = value_from_double(strtod(parser->start, NULL));
     return tok;
 }
 
@@ -399,6 +400,66 @@ void parser_init(parser_t *parser, warp_vm_t *vm, const char *fname, const char
     if(!size) parser->copy = '\0';
 }
 
+void parser_seek(parser_t *parser, const char *pos, int line) {
+    ASSERT(pos >= parser->source.start && pos <= src_end(parser));
+    parser->start = pos;
+    parser->current = pos;
+    parser->line = line;
+    parser->start_of_line = false;
+    
+    uint8_t size = 0;
+    parser->copy = unicode_utf8_read(pos, src_left(parser), &size);
+    if(!size) parser->copy = '\0';
+}
+
+// Only braces, strings and comments matter here, and they are all ASCII, which can't appear inside
+// the encoding of a longer UTF-8 sequence: we can look at bytes rather than decode the source.
+bool skip_block(parser_t *parser) {
+    const token_t *first = current(parser);
+    if(first->kind == TOK_EOF) return false;
+    if(first->kind == TOK_RBRACE) {
+        advance(parser);
+        return true;
+    }
+    
+    int depth = first->kind == TOK_LBRACE ? 2 : 1;
+    int line = parser->line;
+    const char *pos = parser->current;
+    const char *end = src_end(parser);
+    
+    while(depth > 0 && pos < end) {
+        switch(*pos++) {
+        case '\n': line += 1; break;
+        case '{': depth += 1; break;
+        case '}': depth -= 1; break;
+            
+        case '/':
+            if(pos == end || *pos != '/') break;
+            // fallthrough
+        case '#':
+            while(pos < end && *pos != '\n') pos += 1;
+            break;
+            
+        case '"':
+            while(pos < end && *pos != '"') {
+                if(*pos == '\\' && pos + 1 < end) pos += 1;
+                if(*pos == '\n') line += 1;
+                pos += 1;
+            }
+            if(pos == end) return false;
+            pos += 1;
+            break;
+        }
+    }
+    if(depth > 0) return false;
+    
+    // Scan the closing brace as usual, so it ends up as the previous token.
+    parser_seek(parser, pos - 1, line);
+    advance(parser);
+    advance(parser);
+    return true;
+}
+
 // MARK: - Parser implementation
 
 void error_silent(parser_t *parser) {
@@ -130,6 +130,16 @@ typedef struct parser_s {
 
 void parser_init(parser_t *parser, warp_vm_t *vm, const char *fname, const char *text, size_t length);
 token_t scan_token(parser_t *parser);
+
+// Moves the scanner to `pos`, which is on `line`, as if everything before it had been scanned. The
+// next call to advance() reads the token at `pos`.
+void parser_seek(parser_t *parser, const char *pos, int line);
+
+// Skips to the end of the block whose opening brace was just consumed, matching braces rather than
+// parsing what is in between. Returns true, with the closing brace consumed, if the block is
+// closed. Otherwise returns false and leaves the scanner anywhere: the caller must rewind and parse
+// the block to get it reported.
+bool skip_block(parser_t *parser);
 const char *token_name(token_kind_t kind);
 
 void error_silent(parser_t *parser);
@@ -0,0 +1,213 @@
+//===--------------------------------------------------------------------------------------------===
+// peephole.c - Bytecode peephole optimizer
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "peephole.h"
+#include "buffers.h"
+#include <warp/instr.h>
+
+#define WARP_OP(code, op_size, _) [OP_##code] = op_size+1,
+static const int code_size[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+static bool is_jump(uint8_t instr) {
+    return instr == OP_JMP
+        || instr == OP_JMP_FALSE
+        || instr == OP_LOOP
+        || instr == OP_LOOP_IF
+        || instr == OP_LT_JMP_FALSE
+        || instr == OP_LT_LOOP_IF
+        || instr == OP_GUARD_FN;
+}
+
+static int jump_target(const uint8_t *code, int offset) {
+    uint8_t instr = code[offset];
+    int jmp = code[offset+1] | (code[offset+2] << 8);
+    int next = offset + code_size[instr];
+    return warp_jumps_back(instr) ? next - jmp : next + jmp;
+}
+
+// Instructions that only push a value, and can be dropped along with a POP that follows them.
+static bool is_pure_push(uint8_t instr) {
+    switch(instr) {
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_DUP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Checks whether the code at `offset` does nothing but return, possibly after jumping there or
+// dropping the current block's locals. A call followed by that is in tail position.
+static bool is_return_path(const chunk_t *chunk, int offset) {
+    while(offset < chunk->count) {
+        switch(chunk->code[offset]) {
+        case OP_RETURN:
+            return true;
+        case OP_JMP:
+            offset = jump_target(chunk->code, offset);
+            break;
+        case OP_BLOCK:
+            offset += code_size[OP_BLOCK];
+            break;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// Checks that the `n` instructions starting at `offset` are `seq`, and that nothing jumps into the
+// middle of them. Returns the number of bytes the sequence covers, or 0 when it doesn't match.
+static int match_seq(
+    const chunk_t *chunk,
+    const bool *is_target,
+    int offset,
+    const uint8_t *seq,
+    int n
+) {
+    int start = offset;
+    for(int i = 0; i < n; ++i) {
+        if(offset >= chunk->count) return 0;
+        if(chunk->code[offset] != seq[i]) return 0;
+        if(i > 0 && is_target[offset]) return 0;
+        offset += code_size[seq[i]];
+    }
+    return offset - start;
+}
+
+#define MATCH(...)                                                                                 \
+    (len = match_seq(chunk, is_target, r, (const uint8_t[]){__VA_ARGS__},                          \
+        sizeof((const uint8_t[]){__VA_ARGS__})))
+
+void peephole_optimize(warp_vm_t *vm, chunk_t *chunk) {
+    ASSERT(vm);
+    ASSERT(chunk);
+    
+    int count = chunk->count;
+    uint8_t *code = chunk->code;
+    
+    // Code is rewritten in place, but the line table is written anew: runs are still read from the
+    // old one for code further down.
+    line_buf_t lines;
+    line_buf_init(&lines);
+    
+    bool *is_target = ALLOCATE_ARRAY(vm, bool, count + 1);
+    int *new_offset = ALLOCATE_ARRAY(vm, int, count + 1);
+    for(int i = 0; i <= count; ++i) {
+        is_target[i] = false;
+        new_offset[i] = -1;
+    }
+    for(int i = 0; i < count; i += code_size[code[i]]) {
+        if(is_jump(code[i])) is_target[jump_target(code, i)] = true;
+    }
+    
+    // Jumps are re-encoded once everything has moved, so we keep pairs of (new offset of the jump,
+    // old offset of its target) around until then.
+    i32_buf_t jumps;
+    i32_buf_init(&jumps);
+    
+    // The rewritten code is never longer than the original, so we can work in place: everything
+    // under `w` is output, everything from `r` on is still to be read.
+    int w = 0;
+    int r = 0;
+    int len = 0;
+
+#define EMIT(byte) (chunk_add_line(vm, &lines, w, line), code[w] = (byte), w += 1)
+    
+    while(r < count) {
+        int line = chunk_get_line(chunk, r);
+        new_offset[r] = w;
+        
+        // Superinstructions save more than the unchecked forms do, so those get fused as well.
+        if(MATCH(OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD) || MATCH(OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD_NN)) {
+            uint8_t a = code[r+1];
+            uint8_t b = code[r+3];
+            EMIT(OP_ADD_LL);
+            EMIT(a);
+            EMIT(b);
+        } else if(MATCH(OP_CONST, OP_ADD) || MATCH(OP_CONST, OP_SUB)
+                  || MATCH(OP_CONST, OP_ADD_NN) || MATCH(OP_CONST, OP_SUB_NN)) {
+            uint8_t k = code[r+1];
+            uint8_t instr = code[r+2] == OP_ADD || code[r+2] == OP_ADD_NN ? OP_ADD_K : OP_SUB_K;
+            EMIT(instr);
+            EMIT(k);
+        } else if((MATCH(OP_LT, OP_JMP_FALSE, OP_POP) || MATCH(OP_LT_NN, OP_JMP_FALSE, OP_POP))
+                  && code[jump_target(code, r+1)] == OP_POP) {
+            // Both sides of the branch pop the condition: the fall-through with the POP we fuse
+            // here, and the jump target with the POP we jump over.
+            int target = jump_target(code, r+1) + 1;
+            i32_buf_write(vm, &jumps, w);
+            i32_buf_write(vm, &jumps, target);
+            EMIT(OP_LT_JMP_FALSE);
+            EMIT(0xff);
+            EMIT(0xff);
+        } else if(MATCH(OP_LT, OP_LOOP_IF) || MATCH(OP_LT_NN, OP_LOOP_IF)) {
+            int loop = r + code_size[code[r]];
+            i32_buf_write(vm, &jumps, w);
+            i32_buf_write(vm, &jumps, jump_target(code, loop));
+            EMIT(OP_LT_LOOP_IF);
+            EMIT(0xff);
+            EMIT(0xff);
+            EMIT(code[loop+3]);
+            EMIT(code[loop+4]);
+        } else if((code[r] == OP_CALL || code[r] == OP_CALL_GLOB)
+                  && is_return_path(chunk, r + code_size[code[r]])) {
+            // We leave whatever follows the call alone: natives still need it to return. Tail
+            // calls don't need an inline cache, they never get to push a frame.
+            uint8_t arg_count = code[r+1];
+            len = code_size[code[r]];
+            EMIT(OP_TAIL_CALL);
+            EMIT(arg_count);
+        } else if(code[r] == OP_BLOCK && code[r+1] == 0 && code[r+2] == 0) {
+            // Blocks that don't declare any locals have nothing to clean up.
+            len = code_size[OP_BLOCK];
+        } else if(is_pure_push(code[r]) && (len = code_size[code[r]]) < count - r
+                  && code[r + len] == OP_POP && !is_target[r + len]) {
+            len += 1;
+        } else {
+            len = code_size[code[r]];
+            if(is_jump(code[r])) {
+                i32_buf_write(vm, &jumps, w);
+                i32_buf_write(vm, &jumps, jump_target(code, r));
+            }
+            for(int i = 0; i < len; ++i) {
+                EMIT(code[r + i]);
+            }
+        }
+        r += len;
+    }
+    new_offset[count] = w;
+#undef EMIT
+    
+    for(int i = 0; i < jumps.count; i += 2) {
+        int offset = jumps.data[i];
+        int target = new_offset[jumps.data[i+1]];
+        ASSERT(target >= 0);
+        
+        int next = offset + code_size[code[offset]];
+        int jmp = warp_jumps_back(code[offset]) ? next - target : target - next;
+        code[offset+1] = jmp & 0xff;
+        code[offset+2] = (jmp >> 8) & 0xff;
+    }
+    chunk->count = w;
+    line_buf_fini(vm, &chunk->lines);
+    chunk->lines = lines;
+    
+    i32_buf_fini(vm, &jumps);
+    FREE_ARRAY(vm, new_offset, int, count + 1);
+    FREE_ARRAY(vm, is_target, bool, count + 1);
+}
+
+#undef MATCH
@@ -0,0 +1,16 @@
+//===--------------------------------------------------------------------------------------------===
+// peephole.h - Bytecode peephole optimizer
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "chunk.h"
+
+// Rewrites common instruction sequences in a finished chunk into superinstructions, marks calls in
+// tail position, and drops values that are pushed only to be popped straight away. Jump offsets and
+// line information are kept in sync with the shrunk code.
+void peephole_optimize(warp_vm_t *vm, chunk_t *chunk);
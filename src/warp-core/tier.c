@@ -0,0 +1,52 @@
+//===--------------------------------------------------------------------------------------------===
+// tier.c - Moves hot functions to faster execution tiers
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "tier.h"
+#include "jit.h"
+
+void tier_init(tier_manager_t *tiers, const warp_cfg_t *cfg) {
+    ASSERT(tiers);
+    ASSERT(cfg);
+    
+    tiers->call_threshold = cfg->tiering.call_threshold
+        ? cfg->tiering.call_threshold
+        : WARP_TIER_CALLS;
+    tiers->backedge_threshold = cfg->tiering.backedge_threshold
+        ? cfg->tiering.backedge_threshold
+        : WARP_TIER_BACKEDGES;
+    tiers->transition = cfg->tiering.transition;
+    tiers->user_info = cfg->tiering.user_info;
+}
+
+static void report(warp_vm_t *vm, warp_fn_t *fn, warp_tier_t from) {
+    if(!vm->tiers.transition) return;
+    const char *name = fn->name ? fn->name->data : "<script>";
+    vm->tiers.transition(name, from, fn->tier, vm->tiers.user_info);
+}
+
+void tier_promote(warp_vm_t *vm, warp_fn_t *fn) {
+    ASSERT(vm);
+    ASSERT(fn);
+    
+    warp_tier_t from = fn->tier;
+    switch(fn->tier) {
+    case WARP_TIER_INTERPRETED:
+#if WARP_JIT
+        // The interpreter picks up the native code through `fn->jit` the next time it calls `fn`.
+        if(!jit_compile(vm, fn)) return;
+        fn->tier = WARP_TIER_COMPILED;
+        break;
+#else
+        return;
+#endif
+        
+    case WARP_TIER_COMPILED:
+        return;
+    }
+    report(vm, fn, from);
+}
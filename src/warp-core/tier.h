@@ -0,0 +1,39 @@
+//===--------------------------------------------------------------------------------------------===
+// tier.h - Moves hot functions to faster execution tiers
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "warp_internal.h"
+#include "types/obj_impl.h"
+
+// Number of calls after which a function moves up a tier, unless the VM was configured otherwise.
+#ifndef WARP_TIER_CALLS
+    #define WARP_TIER_CALLS (100)
+#endif
+
+// Number of loop iterations after which a function moves up a tier. Functions that are only called
+// a few times can still spend most of the program's time in their loops.
+#ifndef WARP_TIER_BACKEDGES
+    #define WARP_TIER_BACKEDGES (1000)
+#endif
+
+void tier_init(tier_manager_t *tiers, const warp_cfg_t *cfg);
+
+// Moves `fn` to the next tier, if there is one it can move to. The new tier is used from `fn`'s
+// next call on: frames that are already running it carry on where they are.
+void tier_promote(warp_vm_t *vm, warp_fn_t *fn);
+
+// The counters are bumped on every call and back edge, so checking them is kept inline. Each
+// threshold is only ever crossed once.
+static inline void tier_count_call(warp_vm_t *vm, warp_fn_t *fn) {
+    if(++fn->calls == vm->tiers.call_threshold) tier_promote(vm, fn);
+}
+
+static inline void tier_count_backedge(warp_vm_t *vm, warp_fn_t *fn) {
+    if(++fn->backedges == vm->tiers.backedge_threshold) tier_promote(vm, fn);
+}
@@ -8,19 +8,34 @@
  *===--------------------------------------------------------------------------------------------===
 */
 #include "obj_impl.h"
+#include "../jit.h"
 #include <string.h>
 
 warp_fn_t *warp_fn_new(warp_vm_t *vm, warp_fn_kind_t kind) {
     warp_fn_t *fn = ALLOCATE_OBJ(vm, warp_fn_t, WARP_OBJ_FN);
     fn->name = NULL;
     fn->arity = 0;
+    fn->max_slots = 1;
+    fn->verified = false;
+    fn->tier = WARP_TIER_INTERPRETED;
+    fn->calls = 0;
+    fn->backedges = 0;
     chunk_init(vm, &fn->chunk);
+    fn->lazy = NULL;
+#if WARP_JIT
+    fn->jit = NULL;
+    fn->jit_size = 0;
+#endif
     UNUSED(kind);
     return fn;
 }
 
 void warp_fn_free(warp_vm_t *vm, warp_fn_t *fn) {
+#if WARP_JIT
+    jit_free(vm, fn);
+#endif
     chunk_fini(vm, &fn->chunk);
+    if(fn->lazy) DEALLOCATE_SARRAY(vm, fn->lazy, lazy_body_t, char, fn->lazy->length + 1);
     FREE(vm, fn, warp_fn_t);
 }
 
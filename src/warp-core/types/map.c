@@ -58,9 +58,20 @@ static inline uint32_t hash_num(double num) {
     return hash_bits(bits.u64);
 }
 
+// Int keys are mostly indices, which are already spread out.
+static inline uint32_t hash_int(warp_int_t num) {
+    return (uint32_t)num;
+}
+
 static inline uint32_t hash(warp_value_t key) {
-    if(WARP_IS_NUM(key)) {
-        return hash_num(WARP_AS_NUM(key));
+    if(WARP_IS_INT(key)) {
+        return hash_int(WARP_AS_INT(key));
+    } else if(WARP_IS_NUM(key)) {
+        // A double that holds an int value is the same key as the int, and -0 is the same as 0.
+        double num = WARP_AS_NUM(key);
+        warp_int_t i = 0;
+        if(num == 0 || value_double_is_int(num, &i)) return hash_int(i);
+        return hash_num(num);
     } else if(WARP_IS_BOOL(key)) {
         return hash_bits(WARP_AS_BOOL(key));
     } else if(WARP_IS_STR(key)) {
@@ -10,6 +10,7 @@
 #ifndef _OBJ_IMPL_H_
 #define _OBJ_IMPL_H_
 #include <warp/obj.h>
+#include <warp/warp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "../chunk.h"
@@ -34,6 +35,10 @@ struct warp_str_t {
 };
 
 warp_str_t *alloc_str(warp_vm_t *vm, int length);
+
+// Returns the interned string with the contents of `c_str`, or NULL if there is none. Unlike
+// warp_copy_c_str(), this never allocates.
+warp_str_t *find_str(warp_vm_t *vm, const char *c_str, int length);
 void warp_str_free(warp_vm_t *vm, warp_str_t *str);
 
 // MARK: - Table interface
@@ -56,11 +61,32 @@ void warp_map_free(warp_vm_t *vm, warp_map_t *map);
 
 // MARK: Func Interface
 
+// Source of a function body the compiler skipped, to be compiled when the function is first called.
+// It starts at the beginning of the line the parameter list is on, `offset` bytes before it, so
+// that diagnostics can show that whole line.
+typedef struct {
+    warp_str_t      *fname;
+    int             line;       // Line the parameter list is on.
+    size_t          offset;
+    size_t          length;
+    char            source[];
+} lazy_body_t;
+
 struct warp_fn_t {
     warp_obj_t      obj;
     warp_str_t      *name;
     uint8_t         arity;
+    uint32_t        max_slots;  // Stack slots a call needs, including the callee and its arguments.
+    bool            verified;   // Whether the bytecode passed verify_fn(), see verify.h.
+    warp_tier_t     tier;
+    uint32_t        calls;
+    uint32_t        backedges;
     chunk_t         chunk;
+    lazy_body_t     *lazy;      // Body that hasn't been compiled yet, see compile_body().
+#if WARP_JIT
+    void            *jit;
+    size_t          jit_size;
+#endif
 };
 
 struct warp_native_t {
@@ -32,6 +32,10 @@ void warp_str_free(warp_vm_t *vm, warp_str_t *str) {
     DEALLOCATE_SARRAY(vm, str, warp_str_t, char, str->length + 1);
 }
 
+warp_str_t *find_str(warp_vm_t *vm, const char *c_str, int length) {
+    return warp_map_find_str(vm->strings, c_str, length, str_hash(c_str, length));
+}
+
 warp_str_t *warp_copy_c_str(warp_vm_t *vm, const char *c_str, int length) {
     uint32_t hash = str_hash(c_str, length);
     warp_str_t *str = warp_map_find_str(vm->strings, c_str, length, hash);
@@ -8,6 +8,7 @@
 //===--------------------------------------------------------------------------------------------===
 #include "value_impl.h"
 #include "types/obj_impl.h"
+#include <string.h>
 
 static inline warp_value_kind_t value_kind(warp_value_t val) {
 #ifdef WARP_USE_NAN
@@ -29,14 +30,22 @@ bool value_is_falsey(warp_value_t a) {
     return WARP_IS_NIL(a) || (WARP_IS_BOOL(a) && !WARP_AS_BOOL(a));
 }
 
+bool value_same(warp_value_t a, warp_value_t b) {
+#ifdef WARP_USE_NAN
+    return a == b;
+#else
+    if(value_kind(a) != VAL_NUM || value_kind(b) != VAL_NUM) return value_equals(a, b);
+    return !memcmp(&a.as.num, &b.as.num, sizeof(double));
+#endif
+}
+
 bool value_equals(warp_value_t a, warp_value_t b) {
 #ifdef WARP_USE_NAN
     UNUSED(value_kind);
-    if(WARP_IS_OBJ(a) && WARP_IS_OBJ(b)) {
-        return WARP_AS_OBJ(a) == WARP_AS_OBJ(b);
-    } else {
-        return a == b;
-    }
+    if(a == b) return true;
+    // The same number can be an int on one side and a double on the other.
+    if(WARP_ARE_NUMS(a, b)) return WARP_AS_NUM(a) == WARP_AS_NUM(b);
+    return false;
 #else
     if(value_kind(a) != value_kind(b)) return false;
     switch(value_kind(a)) {
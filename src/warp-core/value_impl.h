@@ -6,7 +6,73 @@
 // Licensed under the MIT License
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
+#pragma once
 #include <warp/value.h>
+#include <math.h>
 
 bool value_is_falsey(warp_value_t a);
 bool value_equals(warp_value_t a, warp_value_t b);
+
+// Whether `a` and `b` are the very same value, down to how it is stored. 0 and -0.0 are equal, but
+// they aren't the same: one of them prints with a sign.
+bool value_same(warp_value_t a, warp_value_t b);
+
+// Checks whether `num` can be stored as an int. -0 can't, it would lose its sign.
+static inline bool value_double_is_int(double num, warp_int_t *out) {
+    if(!(num >= INT32_MIN && num <= INT32_MAX)) return false;
+    warp_int_t i = (warp_int_t)num;
+    if(i != num || (i == 0 && signbit(num))) return false;
+    *out = i;
+    return true;
+}
+
+// Numbers are stored as ints whenever they fit, so that counters and indices stay on the integer
+// fast paths.
+static inline warp_value_t value_from_double(double num) {
+    warp_int_t i;
+    return value_double_is_int(num, &i) ? WARP_INT_VAL(i) : WARP_NUM_VAL(num);
+}
+
+static inline warp_value_t value_from_i64(int64_t num) {
+    if(num < INT32_MIN || num > INT32_MAX) return WARP_NUM_VAL((double)num);
+    return WARP_INT_VAL(num);
+}
+
+// Arithmetic on two numbers. Two ints give an int when the result fits, a double otherwise.
+static inline warp_value_t value_add(warp_value_t a, warp_value_t b) {
+    if(WARP_ARE_INTS(a, b)) return value_from_i64((int64_t)WARP_AS_INT(a) + WARP_AS_INT(b));
+    return WARP_NUM_VAL(WARP_AS_NUM(a) + WARP_AS_NUM(b));
+}
+
+static inline warp_value_t value_sub(warp_value_t a, warp_value_t b) {
+    if(WARP_ARE_INTS(a, b)) return value_from_i64((int64_t)WARP_AS_INT(a) - WARP_AS_INT(b));
+    return WARP_NUM_VAL(WARP_AS_NUM(a) - WARP_AS_NUM(b));
+}
+
+// Zero times a negative number is -0, which only a double can hold.
+static inline warp_value_t value_mul(warp_value_t a, warp_value_t b) {
+    if(WARP_ARE_INTS(a, b)) {
+        int64_t num = (int64_t)WARP_AS_INT(a) * WARP_AS_INT(b);
+        if(num != 0 || (WARP_AS_INT(a) | WARP_AS_INT(b)) >= 0) return value_from_i64(num);
+    }
+    return WARP_NUM_VAL(WARP_AS_NUM(a) * WARP_AS_NUM(b));
+}
+
+// Division is done on doubles, but an exact quotient of two ints goes back to being an int.
+static inline warp_value_t value_div(warp_value_t a, warp_value_t b) {
+    double num = WARP_AS_NUM(a) / WARP_AS_NUM(b);
+    return WARP_ARE_INTS(a, b) ? value_from_double(num) : WARP_NUM_VAL(num);
+}
+
+static inline warp_value_t value_neg(warp_value_t a) {
+    if(WARP_IS_INT(a) && WARP_AS_INT(a) != 0 && WARP_AS_INT(a) != INT32_MIN) {
+        return WARP_INT_VAL(-WARP_AS_INT(a));
+    }
+    return WARP_NUM_VAL(-WARP_AS_NUM(a));
+}
+
+// Compares two numbers, as ints when both of them are.
+#define VALUE_COMPARE(a, op, b)                                                                    \
+    (WARP_ARE_INTS(a, b)                                                                           \
+        ? WARP_AS_INT(a) op WARP_AS_INT(b)                                                         \
+        : WARP_AS_NUM(a) op WARP_AS_NUM(b))
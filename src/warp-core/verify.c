@@ -0,0 +1,265 @@
+//===--------------------------------------------------------------------------------------------===
+// verify.c - Bytecode verifier
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include "verify.h"
+#include "buffers.h"
+#include <warp/instr.h>
+
+#define WARP_OP(code, op_size, _) [OP_##code] = op_size+1,
+static const int code_size[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+#define WARP_OP(code, _, effect) [OP_##code] = effect,
+static const int stack_effect[] = {
+#include <warp/instr.def>
+};
+#undef WARP_OP
+
+#define OP_COUNT ((int)(sizeof(code_size) / sizeof(code_size[0])))
+
+typedef struct {
+    warp_vm_t       *vm;
+    const warp_fn_t *fn;
+    const chunk_t   *chunk;
+    bool            *is_instr;  // Whether an instruction starts at each offset.
+    int             *depth;     // Stack depth before each instruction, or -1 until it is reached.
+    i32_buf_t       work;       // Instructions that were reached but not checked yet.
+} verifier_t;
+
+static inline int read_16(const uint8_t *code) {
+    return code[0] | (code[1] << 8);
+}
+
+// Records that the instruction at `offset` can run with `depth` values on the stack. Every path
+// that gets there must agree on the depth.
+static bool reach(verifier_t *v, int offset, int depth) {
+    if(offset < 0 || offset >= v->chunk->count || !v->is_instr[offset]) return false;
+    if(depth < 1 || depth > (int)v->fn->max_slots) return false;
+    if(v->depth[offset] >= 0) return v->depth[offset] == depth;
+    
+    v->depth[offset] = depth;
+    i32_buf_write(v->vm, &v->work, offset);
+    return true;
+}
+
+static bool is_const(const verifier_t *v, int idx) {
+    return idx < v->chunk->constants.count;
+}
+
+static bool is_global(const verifier_t *v, int idx) {
+    return idx < v->vm->globals.count;
+}
+
+// Checks the operands of the instruction at `offset`, and passes the stack depth on to whatever can
+// run after it.
+static bool check_instr(verifier_t *v, int offset) {
+    const uint8_t *code = v->chunk->code + offset;
+    int depth = v->depth[offset];
+    int next = offset + code_size[code[0]];
+    
+    // Values the instruction reads off the top of the stack, on top of those it pops.
+    int uses = 0;
+    int effect = stack_effect[code[0]];
+    
+    switch(code[0]) {
+    case OP_CONST:
+        if(!is_const(v, code[1])) return false;
+        break;
+    
+    case OP_SET_GLOB:
+        uses = 1;
+        // fallthrough
+    case OP_DEF_GLOB:
+    case OP_POP_GLOB:
+    case OP_GET_GLOB:
+        if(!is_global(v, read_16(code + 1))) return false;
+        break;
+    
+    case OP_SET_LOCAL:
+        uses = 1;
+        // fallthrough
+    case OP_GET_LOCAL:
+        if(code[1] >= depth) return false;
+        break;
+    
+    // The slot must be under the value that is popped into it.
+    case OP_POP_LOCAL:
+        if(code[1] >= depth - 1) return false;
+        break;
+    
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+        if(code[1] >= depth || code[2] >= depth || code[3] >= depth) return false;
+        break;
+    
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+        if(code[1] >= depth || code[2] >= depth || !is_const(v, code[3])) return false;
+        break;
+    
+    case OP_ADD_LL:
+        if(code[1] >= depth || code[2] >= depth) return false;
+        break;
+    
+    case OP_ADD_K:
+    case OP_SUB_K:
+        if(!is_const(v, code[1])) return false;
+        uses = 1;
+        break;
+    
+    case OP_DUP:
+    case OP_NEG:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_RETURN:
+    case OP_JMP_FALSE:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POW:
+    case OP_LT:
+    case OP_GT:
+    case OP_LTEQ:
+    case OP_GTEQ:
+    case OP_EQ:
+    case OP_ADD_NUM_NUM:
+    case OP_ADD_STR_STR:
+    case OP_ADD_NN:
+    case OP_SUB_NN:
+    case OP_MUL_NN:
+    case OP_DIV_NN:
+    case OP_LT_NN:
+    case OP_GT_NN:
+    case OP_LTEQ_NN:
+    case OP_GTEQ_NN:
+        uses = 1;
+        break;
+    
+    // The value a block evaluates to stays on top of the locals it drops.
+    case OP_BLOCK:
+        effect = -read_16(code + 1);
+        uses = 1;
+        break;
+    
+    case OP_DROP:
+        effect = -read_16(code + 1);
+        break;
+    
+    // The callee and its arguments are replaced by the result.
+    case OP_CALL_GLOB: {
+        int cache = read_16(code + 2);
+        if(cache >= v->chunk->caches.count) return false;
+        if(!is_global(v, v->chunk->caches.data[cache].global)) return false;
+    }
+        // fallthrough
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        effect = -code[1];
+        uses = 1;
+        break;
+    
+    case OP_LOOP_IF:
+    case OP_LT_LOOP_IF:
+        uses = 1;
+        // fallthrough
+    case OP_LOOP:
+        if(read_16(code + 3) >= v->chunk->loops.count) return false;
+        break;
+    
+    // The callee is checked where it sits, under the arguments.
+    case OP_GUARD_FN:
+        if(!is_const(v, code[3])) return false;
+        uses = code[4] + 1;
+        break;
+    
+    case OP_POP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_JMP:
+    case OP_LT_JMP_FALSE:
+        break;
+    
+    // Breaks are patched into jumps once their loop is compiled.
+    case OP_ENDLOOP:
+    default:
+        return false;
+    }
+    
+    if(depth < uses - (effect < 0 ? effect : 0)) return false;
+    int after = depth + effect;
+    
+    switch(code[0]) {
+    case OP_RETURN:
+        return true;
+    case OP_JMP:
+        return reach(v, next + read_16(code + 1), after);
+    case OP_LOOP:
+        return reach(v, next - read_16(code + 1), after);
+    case OP_LOOP_IF:
+    case OP_LT_LOOP_IF:
+        if(!reach(v, next - read_16(code + 1), after)) return false;
+        break;
+    case OP_JMP_FALSE:
+    case OP_LT_JMP_FALSE:
+    case OP_GUARD_FN:
+        if(!reach(v, next + read_16(code + 1), after)) return false;
+        break;
+    default:
+        break;
+    }
+    // Tail calls to natives still carry on with the code that follows.
+    return reach(v, next, after);
+}
+
+bool verify_fn(warp_vm_t *vm, warp_fn_t *fn) {
+    ASSERT(vm);
+    ASSERT(fn);
+    
+    const chunk_t *chunk = &fn->chunk;
+    verifier_t v;
+    v.vm = vm;
+    v.fn = fn;
+    v.chunk = chunk;
+    v.is_instr = ALLOCATE_ARRAY(vm, bool, chunk->count + 1);
+    v.depth = ALLOCATE_ARRAY(vm, int, chunk->count + 1);
+    i32_buf_init(&v.work);
+    for(int i = 0; i <= chunk->count; ++i) {
+        v.is_instr[i] = false;
+        v.depth[i] = -1;
+    }
+    
+    bool ok = true;
+    for(int i = 0; i < chunk->count; i += code_size[chunk->code[i]]) {
+        if(chunk->code[i] >= OP_COUNT || i + code_size[chunk->code[i]] > chunk->count) {
+            ok = false;
+            break;
+        }
+        v.is_instr[i] = true;
+    }
+    
+    ok = ok && reach(&v, 0, 1 + fn->arity);
+    while(ok && v.work.count > 0) {
+        int offset = v.work.data[--v.work.count];
+        ok = check_instr(&v, offset);
+    }
+    
+    i32_buf_fini(vm, &v.work);
+    FREE_ARRAY(vm, v.depth, int, chunk->count + 1);
+    FREE_ARRAY(vm, v.is_instr, bool, chunk->count + 1);
+    
+    fn->verified = ok;
+    return ok;
+}
@@ -0,0 +1,21 @@
+//===--------------------------------------------------------------------------------------------===
+// verify.h - Bytecode verifier
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#pragma once
+#include <warp/warp.h>
+#include "warp_internal.h"
+#include "types/obj_impl.h"
+
+// Checks that `fn`'s bytecode is safe to run without any checks: every instruction is complete,
+// jumps land on instructions, constant, slot, global, cache and loop indices are in bounds, and the
+// stack is balanced, with the same depth on every path to an instruction and never more than
+// `fn->max_slots`. Marks `fn` as verified when it passes.
+//
+// The interpreter and the JIT trust the operands of the code they run, so a function must pass this
+// before it is first called.
+bool verify_fn(warp_vm_t *vm, warp_fn_t *fn);
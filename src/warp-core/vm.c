@@ -13,8 +13,17 @@
 #include "memory.h"
 #include "debug.h"
 #include "value_impl.h"
+#include "jit.h"
+#include "opt.h"
+#include "tier.h"
+#include "verify.h"
+#include "bytecode.h"
+#include "cache.h"
 #include "types/obj_impl.h"
 #include <stdarg.h>
+#include <string.h>
+
+DEFINE_BUFFER(global, global_t)
 
 static void reset_stack(warp_vm_t *vm) {
     vm->sp = vm->stack;
@@ -39,12 +48,29 @@ warp_vm_t *warp_vm_new(const warp_cfg_t *cfg) {
     CHECK(vm);
     
     vm->frame_count = 0;
+    vm->max_frames = cfg->stack.max_frames ? cfg->stack.max_frames : WARP_MAX_FRAMES;
+    tier_init(&vm->tiers, cfg);
+    vm->passes = opt_passes(cfg);
+    vm->lazy = cfg->compiler.lazy;
+#if WARP_JIT
+    vm->recorder.active = false;
+    i32_buf_init(&vm->recorder.trace);
+#endif
     
     vm->allocator = alloc;
     vm->objects = NULL;
     vm->strings = warp_map_new(vm);
-    vm->globals = warp_map_new(vm);
+    vm->global_ids = warp_map_new(vm);
+    global_buf_init(&vm->globals);
+    vm->bytecode_files = NULL;
+    cache_init(vm, cfg);
     
+    size_t initial = cfg->stack.initial_slots ? cfg->stack.initial_slots : WARP_STACK_INITIAL;
+    vm->max_stack = cfg->stack.max_slots ? cfg->stack.max_slots : WARP_STACK_MAX;
+    if(initial > vm->max_stack) initial = vm->max_stack;
+    vm->frames = ALLOCATE_ARRAY(vm, call_frame_t, vm->max_frames);
+    vm->stack = ALLOCATE_ARRAY(vm, warp_value_t, initial);
+    vm->stack_end = vm->stack + initial;
     reset_stack(vm);
     
     warp_register_native(vm, "println", 1, &std_println);
@@ -56,15 +82,24 @@ void warp_vm_destroy(warp_vm_t *vm) {
     ASSERT(vm);
 	
     warp_map_free(vm, vm->strings);
-    warp_map_free(vm, vm->globals);
+    warp_map_free(vm, vm->global_ids);
+    global_buf_fini(vm, &vm->globals);
+#if WARP_JIT
+    i32_buf_fini(vm, &vm->recorder.trace);
+#endif
     vm->strings = NULL;
-    vm->globals = NULL;
+    vm->global_ids = NULL;
     for(warp_obj_t *obj = vm->objects; obj != NULL;) {
         warp_obj_t *next = obj->next;
         obj_destroy(vm, obj);
         obj = next;
     }
     vm->objects = NULL;
+    bytecode_close_files(vm);
+    cache_fini(vm);
+    size_t stack_size = vm->stack_end - vm->stack;
+    FREE_ARRAY(vm, vm->stack, warp_value_t, stack_size);
+    FREE_ARRAY(vm, vm->frames, call_frame_t, vm->max_frames);
     vm->allocator(vm, 0);
 }
 
@@ -82,14 +117,29 @@ static inline warp_value_t pop(warp_vm_t *vm) {
     return *(--vm->sp);
 }
 
-static void runtime_error(warp_vm_t *vm, const char *fmt, ...) {
+// The instruction a frame is running has been read by the time it fails or calls something, so we
+// look at the last byte of it: whatever comes next may have been inlined from another function.
+static int frame_line(const call_frame_t *frame) {
+    const chunk_t *chunk = &frame->fn->chunk;
+    int instruction = (int)(frame->ip - chunk->code);
+    if(instruction > 0) instruction -= 1;
+    return chunk->count ? chunk_get_line(chunk, instruction) : 0;
+}
+
+void vm_runtime_error(warp_vm_t *vm, const char *fmt, ...) {
     // TODO: output to the diagnostics system, probably
-    call_frame_t *frame = &vm->frames[vm->frame_count-1];
+#if WARP_JIT
+    jit_record_abort(vm);
+#endif
     
-    size_t instruction = frame->ip - frame->fn->chunk.code;
-    int line = frame->fn->chunk.lines[instruction];
-
-    fprintf(stderr, "runtime error on line %d: ", line);
+    // The script's own call can fail before it gets a frame, if the stack can't fit it.
+    if(vm->frame_count > 0) {
+        const call_frame_t *frame = &vm->frames[vm->frame_count-1];
+        fprintf(stderr, "runtime error on line %d: ",
+                chunk_source_line(&frame->fn->chunk, frame_line(frame)));
+    } else {
+        fprintf(stderr, "runtime error: ");
+    }
     
     va_list args;
     va_start(args, fmt);
@@ -99,37 +149,88 @@ static void runtime_error(warp_vm_t *vm, const char *fmt, ...) {
     fputc('\n', stderr);
     
     fprintf(stderr, "\nstack trace:\n");
+    int depth = 0;
     for(int i = vm->frame_count-1; i >= 0; --i) {
-        warp_fn_t *fn = vm->frames[i].fn;
-        fprintf(stderr, "%02d: %s()\n",
-            (vm->frame_count-1) - i,
-            fn->name ? fn->name->data : "<script>");
+        const call_frame_t *frame = &vm->frames[i];
+        const chunk_t *chunk = &frame->fn->chunk;
+        
+        // Calls that were inlined don't have frames, but the line table remembers them.
+        for(int line = frame_line(frame); line < 0; line = chunk->inlined.data[-1 - line].caller) {
+            const warp_str_t *name = chunk->inlined.data[-1 - line].name;
+            fprintf(stderr, "%02d: %s()\n", depth++, name ? name->data : "<script>");
+        }
+        fprintf(stderr, "%02d: %s()\n", depth++,
+            frame->fn->name ? frame->fn->name->data : "<script>");
     }
 }
 
-static bool invoke(warp_vm_t *vm, warp_fn_t *fn, uint8_t arg_count) {
-    if(arg_count != fn->arity) {
-        runtime_error(vm, "calling %s() with %d arguments, %d required",
-            fn->name ? fn->name->data : "<script>",
-            (int)arg_count, (int)fn->arity);
+bool vm_grow_stack(warp_vm_t *vm, size_t needed) {
+    ASSERT(vm);
+    if(needed > vm->max_stack) {
+        vm_runtime_error(vm, "stack overflow");
         return false;
     }
     
-    if(vm->frame_count == MAX_FRAMES) {
-        runtime_error(vm, "stack overflow");
+    size_t capacity = vm->stack_end - vm->stack;
+    size_t new_capacity = capacity ? capacity : 1;
+    while(new_capacity < needed) new_capacity *= 2;
+    if(new_capacity > vm->max_stack) new_capacity = vm->max_stack;
+    
+    warp_value_t *old = vm->stack;
+    vm->stack = GROW_ARRAY(vm, vm->stack, warp_value_t, capacity, new_capacity);
+    vm->stack_end = vm->stack + new_capacity;
+    
+    // Everything that pointed into the old stack keeps its offset in the new one.
+    vm->sp = vm->stack + (vm->sp - old);
+    for(int i = 0; i < vm->frame_count; ++i) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old);
+    }
+    return true;
+}
+
+// Code the compiler produced was verified as it was compiled, so this only does any work for
+// bytecode that came from elsewhere, and for bodies the compiler left to compile on the first call.
+bool vm_check_call(warp_vm_t *vm, const warp_value_t *slots, warp_fn_t *fn) {
+    if(fn->lazy && !compile_body(vm, fn)) {
+        vm_runtime_error(vm, "could not compile %s()", fn->name ? fn->name->data : "<script>");
         return false;
     }
+    if(!fn->verified && !verify_fn(vm, fn)) {
+        vm_runtime_error(vm, "invalid bytecode in %s()", fn->name ? fn->name->data : "<script>");
+        return false;
+    }
+    return vm_ensure_stack(vm, slots, fn->max_slots);
+}
+
+static bool push_frame(warp_vm_t *vm, warp_fn_t *fn, uint8_t arg_count) {
+    if(vm->frame_count == vm->max_frames) {
+        vm_runtime_error(vm, "stack overflow");
+        return false;
+    }
+    if(!vm_check_call(vm, vm->sp - (arg_count + 1), fn)) return false;
     
     call_frame_t *frame = &vm->frames[vm->frame_count++];
     frame->fn = fn;
     frame->ip = fn->chunk.code;
     frame->slots = vm->sp - (arg_count + 1);
+    
+    tier_count_call(vm, fn);
     return true;
 }
 
+static bool invoke(warp_vm_t *vm, warp_fn_t *fn, uint8_t arg_count) {
+    if(arg_count != fn->arity) {
+        vm_runtime_error(vm, "calling %s() with %d arguments, %d required",
+            fn->name ? fn->name->data : "<script>",
+            (int)arg_count, (int)fn->arity);
+        return false;
+    }
+    return push_frame(vm, fn, arg_count);
+}
+
 static bool invoke_native(warp_vm_t *vm, warp_native_t *fn, uint8_t arg_count) {
     if(arg_count != fn->arity) {
-        runtime_error(vm, "calling %s() with %d arguments, %d required",
+        vm_runtime_error(vm, "calling %s() with %d arguments, %d required",
             fn->name ? fn->name->data : "<script>",
             (int)arg_count, (int)fn->arity);
         return false;
@@ -153,241 +254,693 @@ static bool invoke_val(warp_vm_t *vm, warp_value_t val, uint8_t arg_count) {
             break;
         }
     }
-    runtime_error(vm, "cannot call non-function value");
+    vm_runtime_error(vm, "cannot call non-function value");
     return false;
 }
 
-static void concatenate(warp_vm_t *vm) {
-    warp_str_t *b = WARP_AS_STR(pop(vm));
-    warp_str_t *a = WARP_AS_STR(pop(vm));
-    
-    push(vm, WARP_OBJ_VAL(warp_concat_str(vm, a, b)));
+static warp_value_t concatenate(warp_vm_t *vm, warp_value_t a, warp_value_t b) {
+    return WARP_OBJ_VAL(warp_concat_str(vm, WARP_AS_STR(a), WARP_AS_STR(b)));
 }
 
 void dbg(warp_value_t v) {
     warp_print_value(v, stdout);
 }
 
-warp_result_t warp_run(warp_vm_t *vm) {
+#if DEBUG_TRACE_EXEC == 1
+static void trace_exec(warp_vm_t *vm, call_frame_t *frame) {
+    fprintf(stdout, "\n===\n");
+    for(warp_value_t *v = vm->stack; v != vm->sp; ++v) {
+        if(v == frame->slots) {
+            printf("...\n");
+        }
+        printf("[");
+        warp_print_value(*v, stdout);
+        printf("]\n");
+    }
+    fprintf(stdout, "---\n");
+    disassemble_instr(&frame->fn->chunk, (int)(frame->ip - frame->fn->chunk.code), stdout);
+    fprintf(stdout, "===\n");
+    getchar();
+}
+#define TRACE_EXEC() (SAVE_STATE(), trace_exec(vm, frame))
+#else
+#define TRACE_EXEC() ((void)0)
+#endif
+
+// Labels-as-values are a GNU extension, so -Wpedantic has to be told to look the other way while
+// we build the dispatch table and jump through it.
+#if WARP_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Runs bytecode until the frame at index `base` returns. The outermost call runs the whole program
+// from frame 0, the JIT comes back in here with the index of the frame it needs run. Operands are
+// used without any checks: vm_check_call() makes sure every function was verified before it runs.
+static warp_result_t run(warp_vm_t *vm, int base) {
     ASSERT(vm);
-    // reset_stack(vm);
-    call_frame_t *frame = &vm->frames[vm->frame_count - 1];
+    ASSERT(base < vm->frame_count);
+    warp_opcode_t instr;
+    
+    // The hot interpreter state lives in locals so the compiler can keep it in registers. It is
+    // only written back to the current frame and the VM when something outside the loop needs
+    // to see it: calls, returns, natives and runtime errors.
+    call_frame_t *frame;
+    uint8_t *ip;
+    warp_value_t *sp;
+    warp_value_t *slots;
+    warp_value_t *consts;
     
-#define READ_8() (*frame->ip++)
+#define SAVE_STATE()                                                                               \
+    (frame->ip = ip, vm->sp = sp)
+#define LOAD_STATE()                                                                               \
+    (frame = &vm->frames[vm->frame_count - 1],                                                     \
+    ip = frame->ip,                                                                                \
+    slots = frame->slots,                                                                          \
+    consts = frame->fn->chunk.constants.data,                                                      \
+    sp = vm->sp)
+    
+#define READ_8() (*ip++)
 #define READ_16() \
-    (frame->ip += 2, \
-    (uint16_t)(frame->ip[-2] | (frame->ip[-1] << 8)))
+    (ip += 2, \
+    (uint16_t)(ip[-2] | (ip[-1] << 8)))
 #define READ_CONST() \
-    (frame->fn->chunk.constants.data[READ_8()])
+    (consts[READ_8()])
+    
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*(--sp))
+#define PEEK(offset) (sp[-1 - (offset)])
     
-#define BINARY(T, op)                                                                              \
+// Once a function has been compiled, calling it from the interpreter runs its native code to
+// completion, then picks up the caller where it left off.
+#if WARP_JIT
+#define RUN_COMPILED(count)                                                                        \
     do {                                                                                           \
-        if(!WARP_IS_NUM(peek(vm, 0)) || !WARP_IS_NUM(peek(vm, 1))) {                               \
-            runtime_error(vm, "Invalid operands to " #op " operator");                             \
-            return WARP_RUNTIME_ERROR;                                                             \
+        if(vm->frame_count > (count) && vm->frames[vm->frame_count-1].fn->jit) {                   \
+            if(!vm_execute_frame(vm)) return WARP_RUNTIME_ERROR;                                   \
         }                                                                                          \
-        double b = WARP_AS_NUM(pop(vm));                                                           \
-        double a = WARP_AS_NUM(pop(vm));                                                           \
-        push(vm, WARP_##T##_VAL(a op b));                                                          \
     } while(0)
-        
+#else
+#define RUN_COMPILED(count) ((void)(count))
+#endif
     
-    for(;;) {
-        warp_opcode_t instr;
-#if DEBUG_TRACE_EXEC == 1
-        fprintf(stdout, "\n===\n");
-        for(warp_value_t *v = vm->stack; v != vm->sp; ++v) {
-            if(v == frame->slots) {
-                printf("...\n");
-            }
-            printf("[");
-            warp_print_value(*v, stdout);
-            printf("]\n");
-        }
-        fprintf(stdout, "---\n");
-        disassemble_instr(&frame->fn->chunk, (int)(frame->ip - frame->fn->chunk.code), stdout);
-        fprintf(stdout, "===\n");
+#define RUNTIME_ERROR(...)                                                                         \
+    do {                                                                                           \
+        SAVE_STATE();                                                                              \
+        vm_runtime_error(vm, __VA_ARGS__);                                                         \
+        return WARP_RUNTIME_ERROR;                                                                 \
+    } while(0)
+    
+#define BINARY(fn, op)                                                                             \
+    do {                                                                                           \
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {                                                     \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        warp_value_t b = POP();                                                                    \
+        warp_value_t a = POP();                                                                    \
+        PUSH(value_##fn(a, b));                                                                    \
+    } while(0)
+    
+#define COMPARE(op)                                                                                \
+    do {                                                                                           \
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {                                                     \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        warp_value_t b = POP();                                                                    \
+        warp_value_t a = POP();                                                                    \
+        PUSH(WARP_BOOL_VAL(VALUE_COMPARE(a, op, b)));                                              \
+    } while(0)
+    
+// The compiler only emits unchecked forms for operands it has proven are numbers.
+#define UNCHECKED_BINARY(fn)                                                                       \
+    do {                                                                                           \
+        warp_value_t b = POP();                                                                    \
+        PEEK(0) = value_##fn(PEEK(0), b);                                                          \
+    } while(0)
+    
+#define UNCHECKED_COMPARE(op)                                                                      \
+    do {                                                                                           \
+        warp_value_t b = POP();                                                                    \
+        PEEK(0) = WARP_BOOL_VAL(VALUE_COMPARE(PEEK(0), op, b));                                    \
+    } while(0)
+    
+#define REGISTER_BINARY(fn, op, operand)                                                           \
+    do {                                                                                           \
+        uint8_t dst = READ_8();                                                                    \
+        warp_value_t a = slots[READ_8()];                                                          \
+        warp_value_t b = (operand);                                                                \
+        if(!WARP_ARE_NUMS(a, b)) {                                                                 \
+            RUNTIME_ERROR("Invalid operands to " #op " operator");                                 \
+        }                                                                                          \
+        slots[dst] = value_##fn(a, b);                                                             \
+    } while(0)
+    
+#define GENERIC_ADD(dst, a, b)                                                                     \
+    do {                                                                                           \
+        if(WARP_ARE_NUMS(a, b)) {                                                                  \
+            (dst) = value_add(a, b);                                                               \
+        } else if(WARP_IS_STR(a) && WARP_IS_STR(b)) {                                              \
+            (dst) = concatenate(vm, a, b);                                                         \
+        } else {                                                                                   \
+            RUNTIME_ERROR("invalid operands to `+'");                                              \
+        }                                                                                          \
+    } while(0)
+    
+// Rewinds to the start of the current instruction and turns it back into its generic form, which
+// is then dispatched as usual. (No do/while here: VM_NEXT() may be a `break` out of the switch.)
+#define DEQUICKEN(code)                                                                            \
+    {                                                                                              \
+        ip -= 1;                                                                                   \
+        *ip = OP_##code;                                                                           \
+        VM_NEXT();                                                                                 \
+    }
+    
+// With computed gotos, each handler jumps straight to the next one through the label table, so
+// every opcode gets its own indirect branch (and its own slot in the branch predictor). The
+// portable path funnels everything through a single switch.
+//
+// While a trace is being recorded, every instruction is reported to jit_record() before it runs.
+// The threaded loop does that by swapping in a table where every opcode leads to `record_instr`,
+// so there is no cost when we aren't recording. The switch checks the recorder's flag instead.
+#if WARP_COMPUTED_GOTO
+#define WARP_OP(code, _, __) &&op_##code,
+    static void *dispatch_table[] = {
+#include <warp/instr.def>
+    };
+#undef WARP_OP
+#if WARP_JIT
+#define WARP_OP(code, _, __) &&record_instr,
+    static void *record_table[] = {
+#include <warp/instr.def>
+    };
+#undef WARP_OP
 #endif
-        switch(instr = READ_8()) {            
-        case OP_CONST:
-            push(vm, READ_CONST());
-            break;
-            
-        case OP_DEF_GLOB: {
-            warp_value_t name = READ_CONST();
-            warp_map_set(vm, vm->globals, name, peek(vm, 0));
-            break;
-        }
+    void **table = dispatch_table;
+    
+#define VM_DISPATCH()   do { TRACE_EXEC(); goto *table[instr = READ_8()]; } while(0)
+#define VM_LOOP()       VM_DISPATCH();
+#define VM_CASE(code)   op_##code
+#define VM_NEXT()       VM_DISPATCH()
+#define VM_DEFAULT()    
+#define START_RECORDING() (table = record_table)
+#else
+#if WARP_JIT
+#define RECORD_INSTR()                                                                             \
+    (vm->recorder.active ? (void)jit_record(vm, ip - 1, sp, slots) : (void)0)
+#else
+#define RECORD_INSTR()  ((void)0)
+#endif
+#define VM_LOOP()       for(;;) switch(TRACE_EXEC(), instr = READ_8(), RECORD_INSTR(), instr)
+#define VM_CASE(code)   case OP_##code
+#define VM_NEXT()       break
+#define VM_DEFAULT()    default: UNREACHABLE(); break;
+#define START_RECORDING() ((void)0)
+#endif
+    
+    LOAD_STATE();
+    
+    VM_LOOP() {
+    VM_CASE(CONST):
+        PUSH(READ_CONST());
+        VM_NEXT();
         
-        case OP_GET_GLOB: {
-            warp_value_t name = READ_CONST();
-            warp_value_t val = WARP_NIL_VAL;
-            if(!warp_map_get(vm->globals, name, &val)) {
-                runtime_error(vm, "undefined global variable '%s'", WARP_AS_CSTR(name));
-                return WARP_RUNTIME_ERROR;
-            }
-            push(vm, val);
-            break;
+    VM_CASE(DEF_GLOB): {
+        global_t *global = &vm->globals.data[READ_16()];
+        global->value = POP();
+        global->version += 1;
+        global->defined = true;
+        VM_NEXT();
+    }
+    
+    VM_CASE(GET_GLOB): {
+        global_t *global = &vm->globals.data[READ_16()];
+        if(!global->defined) {
+            RUNTIME_ERROR("undefined global variable '%s'", global->name->data);
         }
-        
-        case OP_SET_GLOB: {
-            warp_value_t name = READ_CONST();
-            if(!warp_map_set(vm, vm->globals, name, peek(vm, 0))) {
-                warp_map_delete(vm->globals, name, NULL);
-                runtime_error(vm, "undefined global variable '%s", WARP_AS_CSTR(name));
-            }
-            break;
+        PUSH(global->value);
+        VM_NEXT();
+    }
+    
+    VM_CASE(SET_GLOB): {
+        global_t *global = &vm->globals.data[READ_16()];
+        if(!global->defined) {
+            RUNTIME_ERROR("undefined global variable '%s'", global->name->data);
         }
-        
-        case OP_GET_LOCAL: {
-            uint8_t slot = READ_8();
-            push(vm, frame->slots[slot]);
-            break;
+        global->value = PEEK(0);
+        global->version += 1;
+        VM_NEXT();
+    }
+    
+    VM_CASE(POP_GLOB): {
+        global_t *global = &vm->globals.data[READ_16()];
+        if(!global->defined) {
+            RUNTIME_ERROR("undefined global variable '%s'", global->name->data);
         }
+        global->value = POP();
+        global->version += 1;
+        VM_NEXT();
+    }
+    
+    VM_CASE(GET_LOCAL): {
+        uint8_t slot = READ_8();
+        PUSH(slots[slot]);
+        VM_NEXT();
+    }
+    
+    VM_CASE(SET_LOCAL): {
+        uint8_t slot = READ_8();
+        slots[slot] = PEEK(0);
+        VM_NEXT();
+    }
+    
+    VM_CASE(POP_LOCAL): {
+        uint8_t slot = READ_8();
+        slots[slot] = POP();
+        VM_NEXT();
+    }
+    
+    VM_CASE(DUP): {
+        warp_value_t val = PEEK(0);
+        PUSH(val);
+        VM_NEXT();
+    }
         
-        case OP_SET_LOCAL: {
-            uint8_t slot = READ_8();
-            frame->slots[slot] = peek(vm, 0);
-            break;
-        }
+    VM_CASE(POP):
+        sp -= 1;
+        VM_NEXT();
         
-        case OP_DUP:
-            push(vm, peek(vm, 0));
-            break;
-            
-        case OP_POP:
-            pop(vm);
-            break;
-            
-        // because we are expression-oriented, the last result of a block is its value. So we
-        // can't just POP our way out of all of our locals -- we need to save the top-of-stack
-        // first.
-        case OP_BLOCK: {
-            uint8_t slots = READ_16();
-            warp_value_t val = pop(vm);
-            vm->sp -= slots;
-            push(vm, val);
-            break;
-        }
-            
-        case OP_NIL:
-            push(vm, WARP_NIL_VAL);
-            break;
-            
-        case OP_TRUE:
-            push(vm, WARP_BOOL_VAL(true));
-            break;
-            
-        case OP_FALSE:
-            push(vm, WARP_BOOL_VAL(false));
-            break;
-            
-        case OP_NEG: {
-            if(!WARP_IS_NUM(peek(vm, 0))) {
-                // TODO: throw error
-                runtime_error(vm, "invalid operands to `-'");
-                return WARP_RUNTIME_ERROR;
-            }
-            double val = WARP_AS_NUM(pop(vm));
-            push(vm, WARP_NUM_VAL(-val));
-            break;
-        }
+    // because we are expression-oriented, the last result of a block is its value. So we
+    // can't just POP our way out of all of our locals -- we need to save the top-of-stack
+    // first.
+    VM_CASE(BLOCK): {
+        uint16_t count = READ_16();
+        warp_value_t val = POP();
+        sp -= count;
+        PUSH(val);
+        VM_NEXT();
+    }
+    
+    VM_CASE(DROP):
+        sp -= READ_16();
+        VM_NEXT();
         
-        case OP_NOT: {
-            warp_value_t val = pop(vm);
-            push(vm, WARP_BOOL_VAL(value_is_falsey(val)));
-            break;
-        }
-            
-        case OP_ADD:
-            if(WARP_IS_STR(peek(vm, 0)) && WARP_IS_STR(peek(vm, 1))) {
-                concatenate(vm);
-            } else if(WARP_IS_NUM(peek(vm, 0)) && WARP_IS_NUM(peek(vm, 1))) {
-                double b = WARP_AS_NUM(pop(vm));
-                double a = WARP_AS_NUM(pop(vm));
-                push(vm, WARP_NUM_VAL(a + b));
-            } else {
-                runtime_error(vm, "invalid operands to `+'");
-                return WARP_RUNTIME_ERROR;
-            }
-            break;
+    VM_CASE(NIL):
+        PUSH(WARP_NIL_VAL);
+        VM_NEXT();
         
+    VM_CASE(TRUE):
+        PUSH(WARP_BOOL_VAL(true));
+        VM_NEXT();
         
-        // BINARY(NUM, +); break;
-        case OP_SUB: BINARY(NUM, -); break;
-        case OP_MUL: BINARY(NUM, *); break;
-        case OP_DIV: BINARY(NUM, /); break;
+    VM_CASE(FALSE):
+        PUSH(WARP_BOOL_VAL(false));
+        VM_NEXT();
         
-        case OP_LT: BINARY(BOOL, <); break;
-        case OP_GT: BINARY(BOOL, >); break;
-        case OP_LTEQ: BINARY(BOOL, <=); break;
-        case OP_GTEQ: BINARY(BOOL, >=); break;
+    VM_CASE(NEG): {
+        if(!WARP_IS_NUM(PEEK(0))) {
+            RUNTIME_ERROR("invalid operands to `-'");
+        }
+        PEEK(0) = value_neg(PEEK(0));
+        VM_NEXT();
+    }
+    
+    VM_CASE(NOT): {
+        warp_value_t val = POP();
+        PUSH(WARP_BOOL_VAL(value_is_falsey(val)));
+        VM_NEXT();
+    }
         
-        case OP_EQ: {
-            warp_value_t b = pop(vm);
-            warp_value_t a = pop(vm);
-            push(vm, WARP_BOOL_VAL(value_equals(a, b)));
-            break;
+    // ADD quickens itself into a specialised instruction the first time it runs. If the operands
+    // of a quickened ADD ever stop matching, it turns back into a plain ADD and runs again.
+    VM_CASE(ADD): {
+        warp_value_t b = PEEK(0);
+        warp_value_t a = PEEK(1);
+        if(WARP_ARE_NUMS(a, b)) {
+            ip[-1] = OP_ADD_NUM_NUM;
+            sp -= 1;
+            PEEK(0) = value_add(a, b);
+        } else if(WARP_IS_STR(a) && WARP_IS_STR(b)) {
+            ip[-1] = OP_ADD_STR_STR;
+            sp -= 1;
+            PEEK(0) = concatenate(vm, a, b);
+        } else {
+            RUNTIME_ERROR("invalid operands to `+'");
         }
-		
-		case OP_LOOP: {
-			frame->ip -= READ_16();
-			break;
-		}
-		
-        case OP_JMP: {
-            frame->ip += READ_16();
-            break;
+        VM_NEXT();
+    }
+    
+    VM_CASE(ADD_NUM_NUM): {
+        warp_value_t b = PEEK(0);
+        warp_value_t a = PEEK(1);
+        if(!WARP_ARE_NUMS(a, b)) {
+            DEQUICKEN(ADD);
+        }
+        sp -= 1;
+        PEEK(0) = value_add(a, b);
+        VM_NEXT();
+    }
+    
+    VM_CASE(ADD_STR_STR): {
+        warp_value_t b = PEEK(0);
+        warp_value_t a = PEEK(1);
+        if(!WARP_IS_STR(a) || !WARP_IS_STR(b)) {
+            DEQUICKEN(ADD);
+        }
+        sp -= 1;
+        PEEK(0) = concatenate(vm, a, b);
+        VM_NEXT();
+    }
+    
+    VM_CASE(ADD_NN): UNCHECKED_BINARY(add); VM_NEXT();
+    VM_CASE(SUB_NN): UNCHECKED_BINARY(sub); VM_NEXT();
+    VM_CASE(MUL_NN): UNCHECKED_BINARY(mul); VM_NEXT();
+    VM_CASE(DIV_NN): UNCHECKED_BINARY(div); VM_NEXT();
+    VM_CASE(LT_NN): UNCHECKED_COMPARE(<); VM_NEXT();
+    VM_CASE(GT_NN): UNCHECKED_COMPARE(>); VM_NEXT();
+    VM_CASE(LTEQ_NN): UNCHECKED_COMPARE(<=); VM_NEXT();
+    VM_CASE(GTEQ_NN): UNCHECKED_COMPARE(>=); VM_NEXT();
+    
+    VM_CASE(SUB): BINARY(sub, -); VM_NEXT();
+    VM_CASE(MUL): BINARY(mul, *); VM_NEXT();
+    VM_CASE(DIV): BINARY(div, /); VM_NEXT();
+    
+    VM_CASE(POW):
+        UNREACHABLE();
+        VM_NEXT();
+    
+    VM_CASE(LT): COMPARE(<); VM_NEXT();
+    VM_CASE(GT): COMPARE(>); VM_NEXT();
+    VM_CASE(LTEQ): COMPARE(<=); VM_NEXT();
+    VM_CASE(GTEQ): COMPARE(>=); VM_NEXT();
+    
+    VM_CASE(EQ): {
+        warp_value_t b = POP();
+        warp_value_t a = POP();
+        PUSH(WARP_BOOL_VAL(value_equals(a, b)));
+        VM_NEXT();
+    }
+    
+    VM_CASE(ADD_RR): {
+        uint8_t dst = READ_8();
+        warp_value_t a = slots[READ_8()];
+        warp_value_t b = slots[READ_8()];
+        GENERIC_ADD(slots[dst], a, b);
+        VM_NEXT();
+    }
+    VM_CASE(ADD_RK): {
+        uint8_t dst = READ_8();
+        warp_value_t a = slots[READ_8()];
+        warp_value_t b = READ_CONST();
+        GENERIC_ADD(slots[dst], a, b);
+        VM_NEXT();
+    }
+    
+    VM_CASE(SUB_RR): REGISTER_BINARY(sub, -, slots[READ_8()]); VM_NEXT();
+    VM_CASE(MUL_RR): REGISTER_BINARY(mul, *, slots[READ_8()]); VM_NEXT();
+    VM_CASE(DIV_RR): REGISTER_BINARY(div, /, slots[READ_8()]); VM_NEXT();
+    VM_CASE(SUB_RK): REGISTER_BINARY(sub, -, READ_CONST()); VM_NEXT();
+    VM_CASE(MUL_RK): REGISTER_BINARY(mul, *, READ_CONST()); VM_NEXT();
+    VM_CASE(DIV_RK): REGISTER_BINARY(div, /, READ_CONST()); VM_NEXT();
+    
+    VM_CASE(ADD_LL): {
+        warp_value_t a = slots[READ_8()];
+        warp_value_t b = slots[READ_8()];
+        GENERIC_ADD(*sp, a, b);
+        sp += 1;
+        VM_NEXT();
+    }
+    
+    VM_CASE(ADD_K): {
+        warp_value_t b = READ_CONST();
+        warp_value_t a = PEEK(0);
+        GENERIC_ADD(PEEK(0), a, b);
+        VM_NEXT();
+    }
+    
+    VM_CASE(SUB_K): {
+        warp_value_t b = READ_CONST();
+        if(!WARP_ARE_NUMS(PEEK(0), b)) {
+            RUNTIME_ERROR("Invalid operands to - operator");
+        }
+        PEEK(0) = value_sub(PEEK(0), b);
+        VM_NEXT();
+    }
+    
+    VM_CASE(LT_JMP_FALSE): {
+        uint16_t jmp = READ_16();
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {
+            RUNTIME_ERROR("Invalid operands to < operator");
+        }
+        warp_value_t b = POP();
+        warp_value_t a = POP();
+        if(!VALUE_COMPARE(a, <, b)) ip += jmp;
+        VM_NEXT();
+    }
+    
+    // Back edges are where we look for hot loops. A loop that has a trace runs it until one of its
+    // guards fails, then we carry on from wherever the trace left off.
+    VM_CASE(LT_LOOP_IF): {
+        if(!WARP_ARE_NUMS(PEEK(0), PEEK(1))) {
+            RUNTIME_ERROR("Invalid operands to < operator");
+        }
+        warp_value_t b = POP();
+        warp_value_t a = POP();
+        if(!VALUE_COMPARE(a, <, b)) {
+            ip += 4;
+            VM_NEXT();
         }
+        goto back_edge;
+    }
+    
+    // Rotated loops test their condition at the bottom, and only go back round while it holds.
+    VM_CASE(LOOP_IF):
+        if(value_is_falsey(POP())) {
+            ip += 4;
+            VM_NEXT();
+        }
+        goto back_edge;
+    VM_CASE(LOOP):
+    back_edge: {
+        uint16_t jmp = READ_16();
+        uint16_t index = READ_16();
+        tier_count_backedge(vm, frame->fn);
+#if WARP_JIT
+        hot_loop_t *loop = &frame->fn->chunk.loops.data[index];
+        if(loop->trace) {
+            ip -= jmp;
+            SAVE_STATE();
+            int exit = jit_run_trace(vm, frame, loop);
+            if(exit < 0) return WARP_RUNTIME_ERROR;
+            frame->ip = frame->fn->chunk.code + exit;
+            LOAD_STATE();
+            VM_NEXT();
+        }
+        if(++loop->hotness >= WARP_TRACE_THRESHOLD && loop->attempts < WARP_TRACE_ATTEMPTS) {
+            int end = (int)(ip - frame->fn->chunk.code) - 5;
+            if(jit_record_start(vm, loop, end - jmp + 5, end)) START_RECORDING();
+        }
+#else
+        UNUSED(index);
+#endif
+        ip -= jmp;
+        VM_NEXT();
+    }
+    
+    VM_CASE(JMP): {
+        uint16_t jmp = READ_16();
+        ip += jmp;
+        VM_NEXT();
+    }
+    
+    VM_CASE(JMP_FALSE): {
+        uint16_t jmp = READ_16();
+        if(value_is_falsey(PEEK(0))) ip += jmp;
+        VM_NEXT();
+    }
+    
+    // Falls through to the inlined body as long as the callee is the function it came from.
+    VM_CASE(GUARD_FN): {
+        uint16_t jmp = READ_16();
+        warp_value_t fn = READ_CONST();
+        warp_value_t callee = PEEK(READ_8());
+        if(!WARP_IS_OBJ(callee) || WARP_AS_OBJ(callee) != WARP_AS_OBJ(fn)) ip += jmp;
+        VM_NEXT();
+    }
+    
+    VM_CASE(ENDLOOP):
+        UNREACHABLE();
+        VM_NEXT();
+    
+    VM_CASE(PRINT):
+        warp_print_value(PEEK(0), stdout);
+        VM_NEXT();
         
-        case OP_JMP_FALSE: {
-            uint16_t jmp = READ_16();
-            if(value_is_falsey(peek(vm, 0))) frame->ip += jmp;
-            break;
+    VM_CASE(CALL): {
+        int arg_count = READ_8();
+        int frame_count = vm->frame_count;
+        SAVE_STATE();
+        if(!invoke_val(vm, PEEK(arg_count), arg_count)) {
+            return WARP_RUNTIME_ERROR;
         }
-		
-		case OP_ENDLOOP:
-			UNREACHABLE();
-			break;
+        RUN_COMPILED(frame_count);
+        LOAD_STATE();
+        VM_NEXT();
+    }
         
-		case OP_PRINT:
-	        warp_print_value(peek(vm, 0), stdout);
-			break;
-            
-        case OP_CALL: {
-            int arg_count = READ_8();
-            if(!invoke_val(vm, peek(vm, arg_count), arg_count)) {
+    // If the global we're calling hasn't been written to since this call site last saw it, we
+    // already know it's a function with the right arity and can go straight to the new frame.
+    VM_CASE(CALL_GLOB): {
+        int arg_count = READ_8();
+        call_cache_t *cache = &frame->fn->chunk.caches.data[READ_16()];
+        global_t *global = &vm->globals.data[cache->global];
+        int frame_count = vm->frame_count;
+        SAVE_STATE();
+        
+        if(cache->version == global->version) {
+            if(!push_frame(vm, cache->fn, arg_count)) {
                 return WARP_RUNTIME_ERROR;
             }
-            frame = &vm->frames[vm->frame_count-1];
-            break;
+            RUN_COMPILED(frame_count);
+            LOAD_STATE();
+            VM_NEXT();
+        }
+        
+        warp_value_t callee = PEEK(arg_count);
+        if(WARP_IS_FN(callee)
+           && WARP_AS_FN(callee)->arity == arg_count
+           && value_equals(callee, global->value)) {
+            cache->version = global->version;
+            cache->fn = WARP_AS_FN(callee);
         }
-            
-        case OP_RETURN: {
-            warp_value_t result = pop(vm);
-            --vm->frame_count;
-            
-            vm->sp = frame->slots;
-            push(vm, result);
-            if(vm->frame_count == 0) {
-                return WARP_OK;
+        if(!invoke_val(vm, callee, arg_count)) {
+            return WARP_RUNTIME_ERROR;
+        }
+        RUN_COMPILED(frame_count);
+        LOAD_STATE();
+        VM_NEXT();
+    }
+    
+    // Tail calls to bytecode functions slide the callee and its arguments down over the current
+    // frame and start over, natively if the callee has been compiled. Anything else is called
+    // normally, and the code after the call (which is always on the way to a RETURN) takes care of
+    // returning its result.
+    VM_CASE(TAIL_CALL): {
+        int arg_count = READ_8();
+        warp_value_t callee = PEEK(arg_count);
+        if(!WARP_IS_FN(callee) || WARP_AS_FN(callee)->arity != arg_count) {
+            SAVE_STATE();
+            if(!invoke_val(vm, callee, arg_count)) {
+                return WARP_RUNTIME_ERROR;
             }
-            frame = &vm->frames[vm->frame_count-1];
-            break;
+            LOAD_STATE();
+            VM_NEXT();
         }
-        default:
-            UNREACHABLE();
-            break;
+        
+        warp_fn_t *fn = WARP_AS_FN(callee);
+        SAVE_STATE();
+        if(!vm_check_call(vm, slots, fn)) return WARP_RUNTIME_ERROR;
+        LOAD_STATE();
+        memmove(slots, sp - (arg_count + 1), (arg_count + 1) * sizeof(warp_value_t));
+        frame->fn = fn;
+        frame->ip = fn->chunk.code;
+        vm->sp = slots + arg_count + 1;
+        tier_count_call(vm, fn);
+#if WARP_JIT
+        if(fn->jit) {
+            if(!vm_execute_frame(vm)) return WARP_RUNTIME_ERROR;
+            if(vm->frame_count == base) return WARP_OK;
         }
+#endif
+        LOAD_STATE();
+        VM_NEXT();
+    }
         
-#if DEBUG_TRACE_EXEC
-        getchar();
+    VM_CASE(RETURN): {
+        warp_value_t result = POP();
+        --vm->frame_count;
+        
+        sp = slots;
+        PUSH(result);
+        if(vm->frame_count == base) {
+            vm->sp = sp;
+            return WARP_OK;
+        }
+        vm->sp = sp;
+        LOAD_STATE();
+        VM_NEXT();
+    }
+    
+#if WARP_COMPUTED_GOTO && WARP_JIT
+    record_instr:
+        if(!jit_record(vm, ip - 1, sp, slots)) table = dispatch_table;
+        goto *dispatch_table[instr];
 #endif
+    
+    VM_DEFAULT()
     }
     return WARP_OK;
+#undef SAVE_STATE
+#undef LOAD_STATE
 #undef READ_8
 #undef READ_16
 #undef READ_CONST
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUN_COMPILED
+#undef RUNTIME_ERROR
+#undef BINARY
+#undef COMPARE
+#undef REGISTER_BINARY
+#undef GENERIC_ADD
+#undef DEQUICKEN
+#undef VM_LOOP
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_DEFAULT
+#undef VM_DISPATCH
+#undef START_RECORDING
+#undef RECORD_INSTR
+}
+
+#if WARP_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+warp_result_t warp_run(warp_vm_t *vm) {
+    ASSERT(vm);
+    return run(vm, 0);
+}
+
+bool vm_execute_frame(warp_vm_t *vm) {
+    ASSERT(vm);
+    int base = vm->frame_count - 1;
+#if WARP_JIT
+    // Compiled code hands the frame back when it makes a tail call, so that whatever it called
+    // can run in its place -- natively if it has been compiled too.
+    for(;;) {
+        call_frame_t *frame = &vm->frames[base];
+        if(!frame->fn->jit) break;
+        
+        jit_status_t status = jit_run(vm, frame);
+        if(status != JIT_TAIL_CALL) return status == JIT_RETURNED;
+    }
+#endif
+    return run(vm, base) == WARP_OK;
+}
+
+bool vm_call_value(warp_vm_t *vm, warp_value_t callee, uint8_t arg_count) {
+    ASSERT(vm);
+    int frame_count = vm->frame_count;
+    if(!invoke_val(vm, callee, arg_count)) return false;
+    return vm->frame_count == frame_count || vm_execute_frame(vm);
+}
+
+bool vm_call_fn(warp_vm_t *vm, warp_fn_t *fn, uint8_t arg_count) {
+    ASSERT(vm);
+    ASSERT(fn);
+    if(!push_frame(vm, fn, arg_count)) return false;
+    return vm_execute_frame(vm);
 }
 
 void warp_register_native(warp_vm_t *vm, const char *name, uint8_t arity, warp_native_f fn) {
@@ -396,27 +949,114 @@ void warp_register_native(warp_vm_t *vm, const char *name, uint8_t arity, warp_n
     ASSERT(fn);
     
     warp_native_t *native = warp_native_new(vm, name, arity, fn);
-    warp_map_set(vm, vm->globals, WARP_OBJ_VAL(native->name), WARP_OBJ_VAL(native));
+    int slot = vm_global_slot(vm, native->name);
+    global_t *global = &vm->globals.data[slot];
+    global->value = WARP_OBJ_VAL(native);
+    global->version += 1;
+    global->defined = true;
+}
+
+int vm_global_slot(warp_vm_t *vm, warp_str_t *name) {
+    ASSERT(vm);
+    ASSERT(name);
+    
+    warp_value_t id = WARP_NIL_VAL;
+    if(warp_map_get(vm->global_ids, WARP_OBJ_VAL(name), &id)) {
+        return (int)WARP_AS_NUM(id);
+    }
+    
+    int slot = vm->globals.count;
+    global_buf_write(vm, &vm->globals, (global_t){
+        .name=name,
+        .value=WARP_NIL_VAL,
+        .version=1,
+        .defined=false,
+        .inline_fn=NULL
+    });
+    warp_map_set(vm, vm->global_ids, WARP_OBJ_VAL(name), WARP_NUM_VAL(slot));
+    return slot;
+}
+
+bool warp_get_global(warp_vm_t *vm, const char *name, warp_value_t *out) {
+    ASSERT(vm);
+    ASSERT(name);
+    ASSERT(out);
+    
+    // Global names are interned when they are declared, so a name that isn't can't be a global.
+    warp_str_t *key = find_str(vm, name, strlen(name));
+    warp_value_t id = WARP_NIL_VAL;
+    if(!key || !warp_map_get(vm->global_ids, WARP_OBJ_VAL(key), &id)) return false;
+    
+    global_t *global = &vm->globals.data[(int)WARP_AS_NUM(id)];
+    if(!global->defined) return false;
+    *out = global->value;
+    return true;
 }
 
 bool warp_get_slot(warp_vm_t *vm, int slot, warp_value_t *out) {
     ASSERT(vm);
     ASSERT(slot >= 0);
     ASSERT(out);
-    if(vm->stack + slot >= vm->sp) return false;
+    if(slot >= vm->sp - vm->stack) return false;
     *out = vm->stack[slot];
     return true;
 }
 
+static warp_result_t run_script(warp_vm_t *vm, warp_fn_t *fn) {
+    push(vm, WARP_OBJ_VAL(fn));
+    if(!invoke(vm, fn, 0)) return WARP_RUNTIME_ERROR;
+    
+    return warp_run(vm);
+}
+
 warp_result_t warp_interpret(warp_vm_t *vm, const char *fname, const char *source, size_t length) {
     ASSERT(vm);
     ASSERT(source);
     
-    warp_fn_t *fn = compile(vm, fname, source, length);
+    warp_fn_t *fn = cache_compile(vm, fname, source, length);
     if(!fn) return WARP_COMPILE_ERROR;
+    return run_script(vm, fn);
+}
+
+warp_result_t warp_check(warp_vm_t *vm, const char *fname, const char *source, size_t length) {
+    ASSERT(vm);
+    ASSERT(source);
     
-    push(vm, WARP_OBJ_VAL(fn));
-    invoke(vm, fn, 0);
+    bool lazy = vm->lazy;
+    vm->lazy = false;
+    warp_fn_t *fn = compile(vm, fname, source, length);
+    vm->lazy = lazy;
+    return fn ? WARP_OK : WARP_COMPILE_ERROR;
+}
+
+warp_result_t warp_compile_file(warp_vm_t *vm, const char *fname, const char *source, size_t length,
+                                const char *out_path) {
+    ASSERT(vm);
+    ASSERT(source);
+    ASSERT(out_path);
     
-    return warp_run(vm);
+    warp_fn_t *fn = compile(vm, fname, source, length);
+    if(!fn) return WARP_COMPILE_ERROR;
+    return bytecode_save(vm, fn, out_path) ? WARP_OK : WARP_IO_ERROR;
+}
+
+warp_result_t warp_run_file(warp_vm_t *vm, const char *path) {
+    ASSERT(vm);
+    ASSERT(path);
+    
+    warp_fn_t *fn = bytecode_load(vm, path);
+    if(!fn) return WARP_IO_ERROR;
+    return run_script(vm, fn);
+}
+
+warp_result_t warp_save_image(warp_vm_t *vm, const char *path) {
+    ASSERT(vm);
+    ASSERT(path);
+    return bytecode_save_image(vm, path) ? WARP_OK : WARP_IO_ERROR;
+}
+
+warp_result_t warp_load_image(warp_vm_t *vm, const char *path) {
+    ASSERT(vm);
+    ASSERT(path);
+    return bytecode_load_image(vm, path) ? WARP_OK : WARP_IO_ERROR;
 }
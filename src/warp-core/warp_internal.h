@@ -12,9 +12,33 @@
 #include "chunk.h"
 
 typedef void *(*allocator_t)(void *, size_t);
+typedef struct bytecode_file_t bytecode_file_t;
 
-#define MAX_FRAMES  (64)
-#define STACK_MAX   (MAX_FRAMES * UINT8_MAX)
+// Default sizes of the call stack and the value stack, for configurations that leave them at zero.
+#ifndef WARP_MAX_FRAMES
+    #define WARP_MAX_FRAMES (64)
+#endif
+
+#ifndef WARP_STACK_INITIAL
+    #define WARP_STACK_INITIAL (256)
+#endif
+
+#ifndef WARP_STACK_MAX
+    #define WARP_STACK_MAX (1024 * 1024)
+#endif
+
+// Globals are resolved to a slot index when code is compiled, so the VM can get to them without
+// hashing their name on every access. The version is bumped on every write, which lets call
+// sites cache what they found in the global last time.
+typedef struct {
+    warp_str_t      *name;
+    warp_value_t    value;
+    uint32_t        version;
+    bool            defined;
+    warp_fn_t       *inline_fn;     // Function the compiler inlines calls to, see compiler.c.
+} global_t;
+
+DECLARE_BUFFER(global, global_t);
 
 typedef struct {
     warp_fn_t       *fn;
@@ -22,19 +46,90 @@ typedef struct {
     warp_value_t    *slots;
 } call_frame_t;
 
+// Decides when functions move up a tier. See tier.h.
+typedef struct {
+    uint32_t        call_threshold;
+    uint32_t        backedge_threshold;
+    void            (*transition)(const char *name, warp_tier_t from, warp_tier_t to, void *);
+    void            *user_info;
+} tier_manager_t;
+
+// Where warp_interpret() caches compiled scripts, see cache.h.
+typedef struct {
+    char                *dir;       // NULL when there is no cache.
+    size_t              max_size;
+    warp_cache_stats_t  stats;
+} compile_cache_t;
+
+#if WARP_JIT
+// The trace being recorded, if any. The interpreter reports every instruction it runs while this is
+// active, and we keep those that belong to the loop we are tracing. See jit_record().
+typedef struct {
+    bool            active;
+    int             frame;      // Index of the frame the loop runs in.
+    hot_loop_t      *loop;
+    int             start;      // Offset of the loop header, where the trace starts.
+    int             end;        // Offset of the LOOP instruction that closes the loop.
+    i32_buf_t       trace;      // Pairs of (offset of an instruction, what we saw when it ran).
+} recorder_t;
+#endif
+
+// Frames never move once the VM is created: compiled code and the interpreter both hold on to
+// pointers to them. The value stack does move when it grows, and vm_grow_stack() fixes up `sp` and
+// the frames' slots when it does.
 struct warp_vm_t {
-    call_frame_t    frames[MAX_FRAMES];
+    call_frame_t    *frames;
     warp_int_t      frame_count;
+    warp_int_t      max_frames;
+    tier_manager_t  tiers;
+    uint32_t        passes;     // WARP_PASS_* flags of the passes the compiler runs, see opt.h.
+    bool            lazy;       // Whether function bodies are compiled on their first call.
+    compile_cache_t cache;
+#if WARP_JIT
+    recorder_t      recorder;
+#endif
     
     uint8_t         *ip;
     
     warp_obj_t      *objects;
     warp_map_t      *strings;
-    warp_map_t      *globals;
+    warp_map_t      *global_ids;
+    global_buf_t    globals;
+    bytecode_file_t *bytecode_files;    // Files that loaded functions point into, see bytecode.h.
     
-    warp_value_t    stack[WARP_STACK_MAX];
+    warp_value_t    *stack;
+    warp_value_t    *stack_end;
     warp_value_t    *sp;
+    size_t          max_stack;
     
     size_t          allocated;
     void            *(*allocator)(void *, size_t);
 };
+
+int vm_global_slot(warp_vm_t *vm, warp_str_t *name);
+void vm_runtime_error(warp_vm_t *vm, const char *fmt, ...);
+
+// Grows the value stack to hold at least `needed` slots. Reports a stack overflow and returns false
+// when that is more than the VM allows. Anything pointing into the stack, other than `vm->sp` and
+// the frames' slots, must be reloaded afterwards.
+bool vm_grow_stack(warp_vm_t *vm, size_t needed);
+
+// Gets a call to `fn`, whose frame starts at `slots`, ready to run: its bytecode must have been
+// verified, and the stack must have room for it. Reports a runtime error when either fails.
+bool vm_check_call(warp_vm_t *vm, const warp_value_t *slots, warp_fn_t *fn);
+
+// Makes sure there are `count` slots available from `slots` on. Calls check this once for the
+// callee's `max_slots`, so nothing needs checking when values are pushed.
+static inline bool vm_ensure_stack(warp_vm_t *vm, const warp_value_t *slots, uint32_t count) {
+    if(slots + count <= vm->stack_end) return true;
+    return vm_grow_stack(vm, (size_t)(slots - vm->stack) + count);
+}
+
+// Runs the frame on top of the call stack until it returns, leaving its result on the stack.
+bool vm_execute_frame(warp_vm_t *vm);
+
+// Calls `callee` with the `arg_count` values on top of the stack, and runs it to completion.
+bool vm_call_value(warp_vm_t *vm, warp_value_t callee, uint8_t arg_count);
+
+// Same as vm_call_value(), for callers that already know `fn` takes `arg_count` arguments.
+bool vm_call_fn(warp_vm_t *vm, warp_fn_t *fn, uint8_t arg_count);
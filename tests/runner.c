@@ -0,0 +1,209 @@
+//===--------------------------------------------------------------------------------------------===
+// runner.c - Runs a test script in one way the VM can run it, and checks what it prints.
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#define _DEFAULT_SOURCE
+#include <warp/warp.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// None of the ways a script can be run change what it does: every mode has to print exactly what
+// the script's .out file says, runtime errors and stack traces included. The one difference that
+// is allowed is in stack traces through a tail call that was inlined, which keeps the frame of the
+// caller that the call would have replaced: scripts that fail don't make those.
+//
+//     warp-test-run <mode> <script.warp> <script.out> <scratch dir>
+static const char *usage =
+    "usage: warp-test-run <mode> <script.warp> <script.out> <scratch dir>\n"
+    "modes: O0 O1 O2 lazy interpreted eager cached warpc\n";
+
+static char *read_file(const char *path, size_t *length) {
+    FILE *f = fopen(path, "rb");
+    if(!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(size + 1);
+    *length = fread(data, 1, size, f);
+    data[*length] = '\0';
+    fclose(f);
+    return data;
+}
+
+// Sends both stdout and stderr, where the VM reports errors, to `path` while a script runs.
+typedef struct {
+    int out;
+    int err;
+} capture_t;
+
+static capture_t capture_start(const char *path) {
+    fflush(stdout);
+    fflush(stderr);
+    capture_t saved = {dup(STDOUT_FILENO), dup(STDERR_FILENO)};
+    FILE *f = fopen(path, "wb");
+    if(!f) {
+        fprintf(stderr, "could not write '%s'\n", path);
+        exit(2);
+    }
+    dup2(fileno(f), STDOUT_FILENO);
+    dup2(fileno(f), STDERR_FILENO);
+    fclose(f);
+    return saved;
+}
+
+static void capture_end(capture_t saved) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved.out, STDOUT_FILENO);
+    dup2(saved.err, STDERR_FILENO);
+    close(saved.out);
+    close(saved.err);
+}
+
+static warp_result_t run_source(const warp_cfg_t *cfg, const char *fname, const char *source,
+                                size_t length, const char *out, warp_cache_stats_t *stats) {
+    warp_vm_t *vm = warp_vm_new(cfg);
+    capture_t saved = capture_start(out);
+    warp_result_t result = warp_interpret(vm, fname, source, length);
+    capture_end(saved);
+    if(stats) warp_get_cache_stats(vm, stats);
+    warp_vm_destroy(vm);
+    return result;
+}
+
+static bool same_output(const char *mode, const char *expected, const char *path) {
+    size_t length = 0;
+    char *actual = read_file(path, &length);
+    bool same = actual && !strcmp(actual, expected);
+    if(!same) {
+        fprintf(stderr, "%s: output differs from the expected output\n", mode);
+        fprintf(stderr, "--- expected\n%s--- got\n%s---\n", expected, actual ? actual : "");
+    }
+    free(actual);
+    return same;
+}
+
+// Compiles the script to a .warpc file, and runs that in a new VM.
+static void run_warpc(const warp_cfg_t *cfg, const char *script, const char *source,
+                      size_t length, const char *out, const char *scratch) {
+    char warpc[4096];
+    snprintf(warpc, sizeof(warpc), "%s/script.warpc", scratch);
+    
+    warp_vm_t *vm = warp_vm_new(cfg);
+    capture_t saved = capture_start(out);
+    warp_result_t result = warp_compile_file(vm, script, source, length, warpc);
+    capture_end(saved);
+    warp_vm_destroy(vm);
+    
+    // Scripts that don't compile can't be saved, which the output already says.
+    if(result != WARP_OK) return;
+    vm = warp_vm_new(cfg);
+    saved = capture_start(out);
+    warp_run_file(vm, warpc);
+    capture_end(saved);
+    warp_vm_destroy(vm);
+}
+
+// Deletes what an earlier run left in `dir`.
+static void clear_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if(!d) return;
+    char path[4096];
+    for(struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        if(ent->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+// The cold run compiles the script and writes it to the cache, the warm one has to run what the
+// cold one wrote. Both have to print the same thing.
+static bool run_cached(warp_cfg_t *cfg, const char *script, const char *source, size_t length,
+                       const char *expected, const char *out, const char *scratch) {
+    char dir[4096], cold_out[4096];
+    snprintf(dir, sizeof(dir), "%s/cache", scratch);
+    snprintf(cold_out, sizeof(cold_out), "%s/cold.txt", scratch);
+    cfg->compiler.cache_dir = dir;
+    clear_dir(dir);
+    
+    warp_cache_stats_t cold, warm;
+    run_source(cfg, script, source, length, cold_out, &cold);
+    run_source(cfg, script, source, length, out, &warm);
+    
+    bool ok = same_output("cold", expected, cold_out);
+    ok = same_output("warm", expected, out) && ok;
+    if(cold.hits != 0 || warm.hits != 1) {
+        fprintf(stderr, "cached: expected a miss then a hit, got %u then %u hits\n",
+                cold.hits, warm.hits);
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, const char **argv) {
+    if(argc != 5) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    const char *mode = argv[1];
+    const char *script = argv[2];
+    const char *scratch = argv[4];
+    
+    size_t length = 0, expected_length = 0;
+    char *source = read_file(script, &length);
+    char *expected = read_file(argv[3], &expected_length);
+    if(!source || !expected) {
+        fprintf(stderr, "could not read '%s'\n", source ? argv[3] : script);
+        return 2;
+    }
+    
+    char out[4096];
+    snprintf(out, sizeof(out), "%s/%s.txt", scratch, mode);
+    
+    warp_cfg_t cfg = {0};
+    cfg.compiler.level = WARP_OPT_FULL;
+    bool ok = false;
+    
+    if(!strcmp(mode, "O0")) {
+        cfg.compiler.level = WARP_OPT_NONE;
+    } else if(!strcmp(mode, "O1")) {
+        cfg.compiler.level = WARP_OPT_BASIC;
+    } else if(!strcmp(mode, "lazy")) {
+        cfg.compiler.lazy = true;
+    } else if(!strcmp(mode, "interpreted")) {
+        cfg.tiering.call_threshold = UINT32_MAX;
+        cfg.tiering.backedge_threshold = UINT32_MAX;
+    } else if(!strcmp(mode, "eager")) {
+        // Without the JIT, this runs the same as O2.
+        cfg.tiering.call_threshold = 1;
+        cfg.tiering.backedge_threshold = 1;
+    } else if(strcmp(mode, "O2") && strcmp(mode, "cached") && strcmp(mode, "warpc")) {
+        fputs(usage, stderr);
+        free(source);
+        free(expected);
+        return 2;
+    }
+    
+    if(!strcmp(mode, "cached")) {
+        ok = run_cached(&cfg, script, source, length, expected, out, scratch);
+    } else if(!strcmp(mode, "warpc")) {
+        run_warpc(&cfg, script, source, length, out, scratch);
+        ok = same_output(mode, expected, out);
+    } else {
+        run_source(&cfg, script, source, length, out, NULL);
+        ok = same_output(mode, expected, out);
+    }
+    
+    free(source);
+    free(expected);
+    return ok ? 0 : 1;
+}
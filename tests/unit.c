@@ -0,0 +1,514 @@
+//===--------------------------------------------------------------------------------------------===
+// unit.c - Tests for the parts of the VM scripts can't reach: the bytecode verifier, line tables,
+// and loading files that are damaged or were written for something else.
+//
+// Created by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2021 Amy Parent
+// Licensed under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#define _DEFAULT_SOURCE
+#include <warp/warp.h>
+#include <warp/instr.h>
+#include "bytecode.h"
+#include "chunk.h"
+#include "verify.h"
+#include "types/obj_impl.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+static int failures = 0;
+static char scratch[1024];
+
+// Unlike CHECK(), carries on with the other tests when one fails.
+#define EXPECT(expr)                                                                               \
+    do {                                                                                           \
+        if(!(expr)) {                                                                              \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #expr);                    \
+            failures += 1;                                                                         \
+        }                                                                                          \
+    } while(0)
+
+// MARK: Helpers
+
+typedef char path_t[2048];
+
+static const char *scratch_path(path_t path, const char *name) {
+    snprintf(path, sizeof(path_t), "%s/%s", scratch, name);
+    return path;
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if(!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(*size ? *size : 1);
+    *size = fread(data, 1, *size, f);
+    fclose(f);
+    return data;
+}
+
+static void write_file(const char *path, const void *data, size_t size) {
+    FILE *f = fopen(path, "wb");
+    if(!f) return;
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+// Most of what these tests do makes the VM complain on stderr, which is expected.
+static int quiet_start(void) {
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    return saved;
+}
+
+static void quiet_end(int saved) {
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+}
+
+static warp_cfg_t test_cfg(void) {
+    warp_cfg_t cfg = {0};
+    cfg.compiler.level = WARP_OPT_FULL;
+    return cfg;
+}
+
+static warp_result_t interpret(warp_vm_t *vm, const char *source) {
+    int saved = quiet_start();
+    warp_result_t result = warp_interpret(vm, "test", source, strlen(source));
+    quiet_end(saved);
+    return result;
+}
+
+static warp_result_t run_file(const char *path, double *answer) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    int saved = quiet_start();
+    warp_result_t result = warp_run_file(vm, path);
+    quiet_end(saved);
+    
+    warp_value_t value;
+    if(answer && result == WARP_OK && warp_get_global(vm, "answer", &value)) {
+        *answer = WARP_AS_NUM(value);
+    }
+    warp_vm_destroy(vm);
+    return result;
+}
+
+static warp_result_t load_image(const char *path) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    int saved = quiet_start();
+    warp_result_t result = warp_load_image(vm, path);
+    quiet_end(saved);
+    warp_vm_destroy(vm);
+    return result;
+}
+
+// Overwrites the 32-bit field at `offset` of a file's header.
+static void patch_u32(uint8_t *data, size_t offset, uint32_t value) {
+    memcpy(data + offset, &value, sizeof(value));
+}
+
+// Deletes what an earlier run left in `dir`.
+static void clear_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if(!d) return;
+    char path[4096];
+    for(struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        if(ent->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+// Returns the path of the only entry in the cache directory.
+static const char *cache_entry(const char *dir) {
+    static char path[4096];
+    path[0] = '\0';
+    DIR *d = opendir(dir);
+    if(!d) return path;
+    for(struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        size_t length = strlen(ent->d_name);
+        if(length > 6 && !strcmp(ent->d_name + length - 6, ".warpc")) {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        }
+    }
+    closedir(d);
+    return path;
+}
+
+static warp_cache_stats_t run_cached(const char *dir, const char *source, double *answer) {
+    warp_cfg_t cfg = test_cfg();
+    cfg.compiler.cache_dir = dir;
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    EXPECT(interpret(vm, source) == WARP_OK);
+    
+    warp_value_t value;
+    if(warp_get_global(vm, "answer", &value)) *answer = WARP_AS_NUM(value);
+    warp_cache_stats_t stats;
+    warp_get_cache_stats(vm, &stats);
+    warp_vm_destroy(vm);
+    return stats;
+}
+
+// MARK: Verifier
+
+typedef struct {
+    int         arity;
+    uint32_t    max_slots;
+    int         constants;
+    int         size;
+    uint8_t     code[16];
+} test_fn_t;
+
+static bool verifies(warp_vm_t *vm, test_fn_t test) {
+    warp_fn_t *fn = warp_fn_new(vm, WARP_FN_BYTECODE);
+    fn->arity = test.arity;
+    fn->max_slots = test.max_slots;
+    for(int i = 0; i < test.constants; ++i) {
+        chunk_add_const(vm, &fn->chunk, WARP_NUM_VAL(i + 1));
+    }
+    for(int i = 0; i < test.size; ++i) {
+        chunk_write(vm, &fn->chunk, test.code[i], 1);
+    }
+    return verify_fn(vm, fn);
+}
+
+static void test_verifier(void) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    
+    EXPECT(verifies(vm, (test_fn_t){0, 2, 1, 3, {OP_CONST, 0, OP_RETURN}}));
+    EXPECT(verifies(vm, (test_fn_t){1, 3, 0, 3, {OP_GET_LOCAL, 1, OP_RETURN}}));
+    EXPECT(verifies(vm, (test_fn_t){0, 2, 0, 7, {
+        OP_TRUE, OP_JMP_FALSE, 2, 0, OP_POP, OP_TRUE, OP_RETURN
+    }}));
+    
+    // Operands out of bounds.
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 1, 3, {OP_CONST, 1, OP_RETURN}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 3, {OP_GET_LOCAL, 1, OP_RETURN}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 4, {OP_GET_GLOB, 0xff, 0xff, OP_RETURN}}));
+    
+    // Code that isn't made of whole instructions.
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 1, {0xff}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 1, 1, {OP_CONST}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 3, 0, 2, {OP_NIL, OP_NIL}}));
+    
+    // Jumps into an operand, and past the end.
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 1, 6, {OP_JMP, 1, 0, OP_CONST, 0, OP_RETURN}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 4, {OP_JMP, 9, 0, OP_RETURN}}));
+    
+    // Stacks that underflow, overflow, or don't agree on their depth where paths meet.
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 3, {OP_POP, OP_POP, OP_RETURN}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 3, {OP_NIL, OP_NIL, OP_RETURN}}));
+    EXPECT(!verifies(vm, (test_fn_t){0, 3, 0, 6, {
+        OP_TRUE, OP_JMP_FALSE, 1, 0, OP_NIL, OP_RETURN
+    }}));
+    
+    // Instructions the compiler never leaves in finished code.
+    EXPECT(!verifies(vm, (test_fn_t){0, 2, 0, 4, {OP_NIL, OP_ENDLOOP, 0, 0}}));
+    
+    warp_vm_destroy(vm);
+}
+
+// MARK: Line tables
+
+static void test_lines(void) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    
+    // Lines 1, 1, 1, 2, 2, 5, 5, 5, 5, 3: four runs.
+    static const int lines[] = {1, 1, 1, 2, 2, 5, 5, 5, 5, 3};
+    static const int count = sizeof(lines) / sizeof(lines[0]);
+    chunk_t chunk;
+    chunk_init(vm, &chunk);
+    for(int i = 0; i < count; ++i) {
+        chunk_write(vm, &chunk, OP_NIL, lines[i]);
+    }
+    EXPECT(chunk.lines.count == 4);
+    for(int i = 0; i < count; ++i) {
+        EXPECT(chunk_get_line(&chunk, i) == lines[i]);
+    }
+    
+    // Rewriting code drops the runs from there on.
+    chunk_add_line(vm, &chunk.lines, 4, 9);
+    EXPECT(chunk.lines.count == 3);
+    EXPECT(chunk_get_line(&chunk, 3) == 2);
+    EXPECT(chunk_get_line(&chunk, 4) == 9);
+    EXPECT(chunk_get_line(&chunk, count - 1) == 9);
+    chunk_fini(vm, &chunk);
+    
+    // Empty chunks and chunks with a single run.
+    chunk_init(vm, &chunk);
+    chunk_write(vm, &chunk, OP_NIL, 7);
+    chunk_write(vm, &chunk, OP_RETURN, 7);
+    EXPECT(chunk.lines.count == 1);
+    EXPECT(chunk_get_line(&chunk, 0) == 7);
+    EXPECT(chunk_get_line(&chunk, 1) == 7);
+    chunk_fini(vm, &chunk);
+    
+    warp_vm_destroy(vm);
+}
+
+// MARK: Lazy compilation
+
+static void test_lazy(void) {
+    // Bodies are only deferred when they are long enough to be worth it.
+    static const char *source =
+        "fn broken = () {\n"
+        "    var total = 0\n"
+        "    var i = 0\n"
+        "    while i < 10 { total = total + i * 2; i = i + 1 }\n"
+        "    while i > 0 { total = total - i; i = i - 1 }\n"
+        "    total = total +\n"
+        "}\n"
+        "fn fine = (x) { x * 2 }\n"
+        "var answer = fine(21)\n";
+    
+    warp_cfg_t cfg = test_cfg();
+    cfg.compiler.lazy = true;
+    
+    // The broken body isn't compiled until it is called.
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    EXPECT(interpret(vm, source) == WARP_OK);
+    warp_value_t answer;
+    EXPECT(warp_get_global(vm, "answer", &answer) && WARP_AS_NUM(answer) == 42);
+    
+    EXPECT(interpret(vm, "broken()\n") == WARP_RUNTIME_ERROR);
+    warp_vm_destroy(vm);
+    
+    // Checking a script compiles all of it.
+    vm = warp_vm_new(&cfg);
+    int saved = quiet_start();
+    EXPECT(warp_check(vm, "test", source, strlen(source)) == WARP_COMPILE_ERROR);
+    quiet_end(saved);
+    warp_vm_destroy(vm);
+    
+    // Without lazy compilation, the script doesn't start.
+    cfg.compiler.lazy = false;
+    vm = warp_vm_new(&cfg);
+    EXPECT(interpret(vm, source) == WARP_COMPILE_ERROR);
+    warp_vm_destroy(vm);
+}
+
+// MARK: Bytecode files
+
+static const char *loader_source =
+    "fn sq = (x) { x * x }\n"
+    "fn add = (a, b) { a + b }\n"
+    "var answer = add(sq(3), sq(4)) + 17\n";
+
+static void test_warpc(void) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    path_t path, bad, other;
+    scratch_path(path, "test.warpc");
+    EXPECT(warp_compile_file(vm, "test", loader_source, strlen(loader_source), path) == WARP_OK);
+    warp_vm_destroy(vm);
+    
+    double answer = 0;
+    EXPECT(run_file(path, &answer) == WARP_OK);
+    EXPECT(answer == 42);
+    
+    size_t size = 0;
+    uint8_t *data = read_file(path, &size);
+    EXPECT(data && size > 16);
+    if(!data) return;
+    
+    scratch_path(bad, "bad.warpc");
+    uint8_t *copy = malloc(size);
+    
+    // Every way of cutting the file short.
+    for(size_t length = 0; length < size; ++length) {
+        write_file(bad, data, length);
+        EXPECT(run_file(bad, NULL) == WARP_IO_ERROR);
+    }
+    
+    // Files for another version of Warp, another instruction set or another kind of file.
+    memcpy(copy, data, size);
+    patch_u32(copy, 8, WARP_BYTECODE_VERSION + 1);
+    write_file(bad, copy, size);
+    EXPECT(run_file(bad, NULL) == WARP_IO_ERROR);
+    
+    memcpy(copy, data, size);
+    patch_u32(copy, 12, OP_RETURN + 2);
+    write_file(bad, copy, size);
+    EXPECT(run_file(bad, NULL) == WARP_IO_ERROR);
+    
+    memcpy(copy, data, size);
+    copy[3] = 'I';
+    write_file(bad, copy, size);
+    EXPECT(run_file(bad, NULL) == WARP_IO_ERROR);
+    
+    EXPECT(run_file(scratch_path(other, "missing.warpc"), NULL) == WARP_IO_ERROR);
+    
+    // Damaged files can fail to load, or run differently, but never crash the VM. Code the
+    // verifier rejects is reported when it is first called.
+    for(size_t i = 0; i < size; ++i) {
+        memcpy(copy, data, size);
+        copy[i] ^= 0x5a;
+        write_file(bad, copy, size);
+        run_file(bad, NULL);
+    }
+    
+    free(copy);
+    free(data);
+}
+
+static void test_image(void) {
+    warp_cfg_t cfg = test_cfg();
+    warp_vm_t *vm = warp_vm_new(&cfg);
+    path_t path, bad, other;
+    scratch_path(path, "test.warpi");
+    EXPECT(interpret(vm, loader_source) == WARP_OK);
+    EXPECT(warp_save_image(vm, path) == WARP_OK);
+    warp_vm_destroy(vm);
+    
+    // Functions from the image can be called by the scripts that run after it.
+    vm = warp_vm_new(&cfg);
+    EXPECT(warp_load_image(vm, path) == WARP_OK);
+    EXPECT(interpret(vm, "var result = add(answer, sq(2))\n") == WARP_OK);
+    warp_value_t result;
+    EXPECT(warp_get_global(vm, "result", &result) && WARP_AS_NUM(result) == 46);
+    warp_vm_destroy(vm);
+    
+    size_t size = 0;
+    uint8_t *data = read_file(path, &size);
+    EXPECT(data && size > 16);
+    if(!data) return;
+    
+    scratch_path(bad, "bad.warpi");
+    uint8_t *copy = malloc(size);
+    for(size_t length = 0; length < size; ++length) {
+        write_file(bad, data, length);
+        EXPECT(load_image(bad) == WARP_IO_ERROR);
+    }
+    
+    memcpy(copy, data, size);
+    patch_u32(copy, 8, WARP_BYTECODE_VERSION + 1);
+    write_file(bad, copy, size);
+    EXPECT(load_image(bad) == WARP_IO_ERROR);
+    
+    // A .warpc file isn't an image.
+    EXPECT(load_image(scratch_path(other, "test.warpc")) == WARP_IO_ERROR);
+    EXPECT(load_image(scratch_path(other, "missing.warpi")) == WARP_IO_ERROR);
+    
+    for(size_t i = 0; i < size; ++i) {
+        memcpy(copy, data, size);
+        copy[i] ^= 0x5a;
+        write_file(bad, copy, size);
+        load_image(bad);
+    }
+    
+    free(copy);
+    free(data);
+}
+
+// MARK: Compile cache
+
+static void test_cache(void) {
+    path_t dir;
+    scratch_path(dir, "cache");
+    clear_dir(dir);
+    
+    double answer = 0;
+    warp_cache_stats_t stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.misses == 1 && stats.writes == 1 && answer == 42);
+    stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.hits == 1 && answer == 42);
+    
+    char entry[4096];
+    snprintf(entry, sizeof(entry), "%s", cache_entry(dir));
+    size_t size = 0;
+    uint8_t *data = read_file(entry, &size);
+    EXPECT(data && size > 16);
+    if(!data) return;
+    
+    // Damaged entries are compiled again, and replaced.
+    write_file(entry, data, size / 2);
+    answer = 0;
+    stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.hits == 0 && stats.writes == 1 && answer == 42);
+    
+    uint8_t *copy = malloc(size);
+    memcpy(copy, data, size);
+    patch_u32(copy, 8, WARP_BYTECODE_VERSION + 1);
+    write_file(entry, copy, size);
+    answer = 0;
+    stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.hits == 0 && stats.writes == 1 && answer == 42);
+    
+    // An entry for another script of the same length under this one's name, as if their keys had
+    // collided, isn't used: entries say what they were compiled from.
+    size_t length = strlen(loader_source);
+    char *other = malloc(length + 1);
+    memset(other, ' ', length);
+    memcpy(other, "var answer = 7", strlen("var answer = 7"));
+    other[length - 1] = '\n';
+    other[length] = '\0';
+    path_t other_dir;
+    scratch_path(other_dir, "cache-other");
+    clear_dir(other_dir);
+    run_cached(other_dir, other, &answer);
+    EXPECT(answer == 7);
+    free(other);
+    size_t other_size = 0;
+    uint8_t *other_data = read_file(cache_entry(other_dir), &other_size);
+    EXPECT(other_data != NULL);
+    if(other_data) write_file(entry, other_data, other_size);
+    answer = 0;
+    stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.hits == 0 && answer == 42);
+    free(other_data);
+    
+    // Temporary files left behind by a writer that died are deleted once they are old enough.
+    char stale[4096 + 8], fresh[4096 + 8];
+    snprintf(stale, sizeof(stale), "%s.abc123", entry);
+    snprintf(fresh, sizeof(fresh), "%s.def456", entry);
+    write_file(stale, "x", 1);
+    write_file(fresh, "x", 1);
+    struct timeval old[2] = {{.tv_sec=time(NULL) - 3600}, {.tv_sec=time(NULL) - 3600}};
+    utimes(stale, old);
+    unlink(entry);
+    stats = run_cached(dir, loader_source, &answer);
+    EXPECT(stats.writes == 1);
+    EXPECT(access(stale, F_OK) != 0);
+    EXPECT(access(fresh, F_OK) == 0);
+    
+    free(copy);
+    free(data);
+}
+
+int main(int argc, const char **argv) {
+    if(argc != 2) {
+        fprintf(stderr, "usage: warp-test-unit <scratch dir>\n");
+        return 2;
+    }
+    snprintf(scratch, sizeof(scratch), "%s", argv[1]);
+    mkdir(scratch, 0755);
+    
+    test_verifier();
+    test_lines();
+    test_lazy();
+    test_warpc();
+    test_image();
+    test_cache();
+    
+    if(failures) fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}